@@ -51,6 +51,7 @@ void hal_invalidate_tlb(void);
 void hal_enable_l1_cache(void);
 void hal_disable_l1_cache(void);
 void hal_enable_paging(vm_addr pagedir, uint32_t flags);
+void hal_wfi(void);
 
 void hal_isb(void);
 void hal_memory_barrier(void);
@@ -237,6 +237,28 @@ typedef uint32_t pde_t;
 #define L2_AP_RKU         (L2_AP2 | L2_AP1 | L2_AP0)
 
 
+/* L2 page table entry memory types, with TEX remap disabled
+ *
+ * L2_MEM_NORMAL is Normal memory, inner and outer write-back write-allocate,
+ * shareable between the cores. RAM must be mapped this way for the caches to
+ * be coherent between cores and for ldrex/strex to use the global monitor.
+ * L2_MEM_NORMAL_NC is shareable Normal memory that is not cached.
+ * Device registers are left as strongly-ordered (no memory type bits).
+ */
+#define L2_MEM_NORMAL     (L2_TEX(1) | L2_C | L2_B | L2_S)
+#define L2_MEM_NORMAL_NC  (L2_TEX(1) | L2_S)
+
+
+/*
+ * TTBR0/TTBR1 page table walk attributes (multiprocessing extensions)
+ */
+#define TTBR_IRGN_WBWA    (1 << 6)  /* Inner write-back write-allocate walks */
+#define TTBR_RGN_WBWA     (1 << 3)  /* Outer write-back write-allocate walks */
+#define TTBR_S            (1 << 1)  /* Page tables are in shareable memory */
+
+#define TTBR_CACHE_CONF   (TTBR_IRGN_WBWA | TTBR_RGN_WBWA | TTBR_S)
+
+
 /*
  * Data Fault Status Register (DFSR) flags
  */
@@ -300,6 +322,8 @@ void hal_set_tlb_type(uint32_t reg);
 void hal_isb(void);
 void hal_dsb(void);
 void hal_dmb(void);
+void hal_sev(void);
+void hal_wfi(void);
 
 void hal_invalidate_branch(void);
 void hal_invalidate_icache(void);
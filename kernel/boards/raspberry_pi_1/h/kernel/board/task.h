@@ -100,6 +100,8 @@ struct CPU
   vm_addr svc_stack;
   vm_addr interrupt_stack;
   vm_addr exception_stack;
+  int cpu_id;
+  int online;
 } __attribute__((packed));
 
 
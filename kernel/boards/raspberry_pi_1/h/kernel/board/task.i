@@ -74,7 +74,9 @@
 .equ CPU_SVC_STACK,             12
 .equ CPU_INTERRUPT_STACK,       16
 .equ CPU_EXCEPTION_STACK,       20
-.equ SIZEOF_CPU,                24
+.equ CPU_CPU_ID,                24
+.equ CPU_ONLINE,                28
+.equ SIZEOF_CPU,                32
 
 
 // cpu_table
@@ -40,6 +40,11 @@ struct bcm2835_timer_registers
 #define ST_CS_M1 (0x02)
 #define ST_CS_M0 (0x01)
 
+// Shortest time ahead of the counter a compare register is programmed for,
+// a compare value that has already passed would not interrupt until the
+// 32-bit counter wraps around.
+#define TIMER_MIN_DELTA_US  50
+
 
 #endif
 
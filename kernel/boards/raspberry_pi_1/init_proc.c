@@ -69,8 +69,12 @@ void init_processes(void)
     LIST_INIT(&isr_handler_list[t]);
   }
 
-  for (int t = 0; t < 32; t++) {
-    CIRCLEQ_INIT(&sched_queue[t]);
+  for (int c = 0; c < MAX_CPU; c++) {
+    sched_queue[c].bitmap = 0;
+
+    for (int t = 0; t < 32; t++) {
+      CIRCLEQ_INIT(&sched_queue[c].queue[t]);
+    }
   }
 
   free_process_cnt = max_process;
@@ -82,18 +86,26 @@ void init_processes(void)
 
   Info(".. process table entries inited");
   
-  for (int t = 0; t < JIFFIES_PER_SECOND; t++) {
-    LIST_INIT(&timing_wheel[t]);
+  for (int l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+    for (int t = 0; t < TIMER_WHEEL_SLOTS; t++) {
+      LIST_INIT(&timing_wheel[l][t]);
+    }
   }
 
+  LIST_INIT(&hrtimer_list);
+  LIST_INIT(&hrtimer_expired_list);
+
   Info(".. timing wheel inited");
 
   InitRendez(&timer_rendez);
-  softclock_time = hardclock_time = 0;
+  softclock_time = hardclock_time = arch_read_hardclock();
+  timer_tick_stopped = false;
 
   max_cpu = 1;
   cpu_cnt = max_cpu;
   cpu = &cpu_table[0];
+  cpu->cpu_id = 0;
+  cpu->online = true;
   cpu->reschedule_request = 0;
   cpu->svc_stack = (vm_addr)&svc_stack_top;
   cpu->interrupt_stack = (vm_addr)&interrupt_stack_top;
@@ -143,6 +155,8 @@ void init_processes(void)
   // TODO: We switch address space here.
   // TODO: Can we free any bootsector pages and initial page table?
 
+  // root_process starts in StartKernelProcess which releases sched_slock
+  SpinLock(&sched_slock);
   GetContext(root_process->context);
 }
 
@@ -182,6 +196,7 @@ struct Process *create_process(void (*entry)(void), int policy, int priority,
 
   InitRendez(&proc->rendez);
   LIST_INIT(&proc->child_list);
+  LIST_INIT(&proc->knote_list);
 
   proc->pid = pid;
   proc->parent = NULL;
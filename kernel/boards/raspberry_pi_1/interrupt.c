@@ -68,8 +68,9 @@ void interrupt_top_half(void)
 
   save_pending_interrupts();
   
-  if (check_pending_interrupt(INTERRUPT_TIMER3)) {
+  if (check_pending_interrupt(INTERRUPT_TIMER1) || check_pending_interrupt(INTERRUPT_TIMER3)) {
     interrupt_top_half_timer();   
+    clear_pending_interrupt(INTERRUPT_TIMER1);
     clear_pending_interrupt(INTERRUPT_TIMER3);
   }
   
@@ -179,3 +180,11 @@ void disable_irq(int irq)
 }
 
 
+/*
+ * Send an inter-processor interrupt, the Pi 1 has a single CPU
+ */
+void send_ipi(int cpu_id, int ipi)
+{
+}
+
+
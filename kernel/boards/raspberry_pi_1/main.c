@@ -65,13 +65,19 @@ void Main(void)
 
   max_process = NPROCESS;
   max_pageframe = mem_size / PAGE_SIZE;
-  max_buf = 4 * 1024;
+  max_buf = max_pageframe / 4;    // Cache can grow into free memory, see resize_cache()
+
+  if (max_buf > (CACHE_CEILING_VA - CACHE_BASE_VA) / CLUSTER_SZ) {
+    max_buf = (CACHE_CEILING_VA - CACHE_BASE_VA) / CLUSTER_SZ;
+  }
+
   max_superblock = NR_SUPERBLOCK;
   max_filp = NR_FILP;
   max_vnode = NR_VNODE;
   max_pipe = NR_PIPE;
   max_kqueue = NR_KQUEUE;
   max_knote = NR_KNOTE;
+  max_asyncmsg = NR_ASYNCMSG;
   max_isr_handler = NR_ISR_HANDLER;
   
   init_bootstrap_allocator();
@@ -88,6 +94,7 @@ void Main(void)
   vnode_table       = bootstrap_alloc(max_vnode * sizeof(struct VNode));
   kqueue_table      = bootstrap_alloc(max_kqueue * sizeof(struct KQueue));
   knote_table       = bootstrap_alloc(max_knote * sizeof(struct KNote));
+  asyncmsg_table    = bootstrap_alloc(max_asyncmsg * sizeof(struct AsyncMsg));
   isr_handler_table = bootstrap_alloc(max_isr_handler * sizeof(struct ISRHandler));
   
   init_io_pagetables();
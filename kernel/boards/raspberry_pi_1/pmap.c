@@ -622,6 +622,11 @@ int pmap_cache_extract(vm_addr va, vm_addr *pa)
   pt = (uint32_t *)pmap_pa_to_va((vm_addr)phys_pt);
 
   pte_idx = (va & L2_ADDR_BITS) >> L2_IDX_SHIFT;
+
+  if ((pt[pte_idx] & L2_TYPE_MASK) == L2_TYPE_INV) {
+    return -EINVAL;
+  }
+
   *pa = pt[pte_idx] & L2_ADDR_MASK;
   return 0;
 }
@@ -635,13 +640,61 @@ int pmap_cache_extract(vm_addr va, vm_addr *pa)
  * @param   src, base address in source to copy from
  * @param   sz, number of bytes to copy
  * @return  0 on success, negative errno if all bytes could not be copied.
+ *
+ * One of the address spaces must be the current process's, its side of the
+ * copy uses CopyIn or CopyOut so faults are handled as usual. Pages of the
+ * other address space are accessed through the kernel's mapping of physical
+ * memory and must be present, destination pages must also be writable and
+ * not copy-on-write.
  */
 int pmap_interprocess_copy(struct AddressSpace *dst_as, void *dst, 
                            struct AddressSpace *src_as, void *src,
                            size_t sz)
 {
-  // TODO: Copy between processes, handle unmapped pages.
-  return -ENOTSUP;
+  struct AddressSpace *current_as;
+  vm_addr pa;
+  uint32_t flags;
+  size_t offset;
+  size_t nbytes;
+  
+  current_as = &get_current_process()->as;
+  
+  while (sz > 0) {
+    if (dst_as == current_as) {
+      offset = (vm_addr)src % PAGE_SIZE;
+      nbytes = (sz < PAGE_SIZE - offset) ? sz : PAGE_SIZE - offset;
+
+      if (pmap_extract(src_as, ALIGN_DOWN((vm_addr)src, PAGE_SIZE), &pa, &flags) != 0
+          || (flags & MEM_MASK) == MEM_PHYS) {
+        return -EFAULT;
+      }
+      
+      if (CopyOut(dst, (void *)(pmap_pa_to_va(pa) + offset), nbytes) != 0) {
+        return -EFAULT;
+      }      
+    } else if (src_as == current_as) {
+      offset = (vm_addr)dst % PAGE_SIZE;
+      nbytes = (sz < PAGE_SIZE - offset) ? sz : PAGE_SIZE - offset;
+
+      if (pmap_extract(dst_as, ALIGN_DOWN((vm_addr)dst, PAGE_SIZE), &pa, &flags) != 0
+          || (flags & MEM_MASK) == MEM_PHYS
+          || (flags & (PROT_WRITE | MAP_COW)) != PROT_WRITE) {
+        return -EFAULT;
+      }
+      
+      if (CopyIn((void *)(pmap_pa_to_va(pa) + offset), src, nbytes) != 0) {
+        return -EFAULT;
+      }      
+    } else {
+      return -EINVAL;
+    }
+    
+    dst += nbytes;
+    src += nbytes;
+    sz -= nbytes;
+  }
+  
+  return 0;
 }
 
 
@@ -41,27 +41,109 @@ void init_timer_registers(void)
   clo += MICROSECONDS_PER_JIFFY;
   hal_mmio_write(&timer_regs->c3, clo);
 
+  enable_irq(INTERRUPT_TIMER1);
   enable_irq(INTERRUPT_TIMER3);
 }
 
 
-/* @brief   Special-case handling of timer interrupt
+/* @brief   Special-case handling of timer interrupts
  *
+ * Compare register 3 drives the timing wheel and compare register 1 the
+ * high resolution timers. They are reprogrammed by TimerTopHalf() and
+ * HRTimerTopHalf(), the interrupts are not periodic.
  */
 void interrupt_top_half_timer(void)
 {
-  uint32_t clo;
   uint32_t status;
 
   status = hal_mmio_read(&timer_regs->cs);
 
+  if (status & ST_CS_M1) {
+    hal_mmio_write(&timer_regs->cs, ST_CS_M1);
+    HRTimerTopHalf();
+  }
+
   if (status & ST_CS_M3) {
-    clo = hal_mmio_read(&timer_regs->clo);
-    clo += MICROSECONDS_PER_JIFFY;
-    hal_mmio_write(&timer_regs->c3, clo);    
     hal_mmio_write(&timer_regs->cs, ST_CS_M3);
-
     TimerTopHalf();
   }
 }
 
+
+/* @brief   Read the 64-bit free running microsecond system timer
+ */
+uint64_t timer_read(void)
+{
+  uint32_t chi1, chi2, clo;
+
+  do {
+    chi1 = hal_mmio_read(&timer_regs->chi);
+    clo = hal_mmio_read(&timer_regs->clo);
+    chi2 = hal_mmio_read(&timer_regs->chi);
+  } while (chi1 != chi2);
+
+  return (uint64_t)chi2 << 32 | (uint64_t)clo;
+}
+
+
+/* @brief   Read the hardclock from the free running system timer
+ *
+ * @return  Number of jiffies the system timer has counted
+ */
+uint64_t arch_read_hardclock(void)
+{
+  return timer_read() / MICROSECONDS_PER_JIFFY;
+}
+
+
+/* @brief   Program the next timer interrupt
+ *
+ * @param   expiration_time, hardclock time in jiffies at which to interrupt
+ *
+ * Called with interrupts disabled. Times that have passed or are closer than
+ * TIMER_MIN_DELTA_US microseconds away interrupt TIMER_MIN_DELTA_US from now.
+ */
+void arch_set_timer_event(uint64_t expiration_time)
+{
+  uint64_t now;
+  uint64_t target;
+
+  now = timer_read();
+  target = expiration_time * MICROSECONDS_PER_JIFFY;
+
+  if (target < now + TIMER_MIN_DELTA_US) {
+    target = now + TIMER_MIN_DELTA_US;
+  }
+
+  hal_mmio_write(&timer_regs->c3, (uint32_t)target);
+}
+
+
+/* @brief   Read the system timer in microseconds for high resolution timers
+ */
+uint64_t arch_read_hrclock(void)
+{
+  return timer_read();
+}
+
+
+/* @brief   Program the next high resolution timer interrupt
+ *
+ * @param   expiration_us, system timer time in microseconds to interrupt at
+ *
+ * Called with interrupts disabled. Times closer than TIMER_MIN_DELTA_US
+ * interrupt TIMER_MIN_DELTA_US from now.
+ */
+void arch_set_hrtimer_event(uint64_t expiration_us)
+{
+  uint64_t now;
+
+  now = timer_read();
+
+  if (expiration_us < now + TIMER_MIN_DELTA_US) {
+    expiration_us = now + TIMER_MIN_DELTA_US;
+  }
+
+  hal_mmio_write(&timer_regs->c1, (uint32_t)expiration_us);
+}
+
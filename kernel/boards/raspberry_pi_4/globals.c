@@ -69,6 +69,7 @@ struct bcm2711_gpio_registers *gpio_regs;
 struct bcm2711_aux_registers *aux_regs;
 struct bcm2711_gic_dist_registers *gic_dist_regs;
 struct bcm2711_gic_cpu_iface_registers *gic_cpu_iface_regs;
+vm_addr arm_local_base;
 
 
 /*
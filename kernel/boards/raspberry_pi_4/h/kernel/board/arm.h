@@ -116,8 +116,10 @@ void FiqHandler(void);
 
 void init_interrupt_controller(void);
 void interrupt_handler(struct UserContext *context);
-void interrupt_top_half(void);
+void interrupt_top_half(uint32_t irq_ack_reg);
+void interrupt_ipi(int ipi);
 void interrupt_top_half_timer(void);
+uint64_t timer_read(void);
 void save_pending_interrupts(void);
 bool check_pending_interrupt(int irq);
 void clear_pending_interrupt(uint32_t irq_ack);
@@ -133,6 +135,8 @@ void FPUSwitchState(void);
 
 void SpinLock(spinlock_t *spinlock);
 void SpinUnlock(spinlock_t *spinlock);
+int_state_t SpinLockIRQSave(spinlock_t *spinlock);
+void SpinUnlockIRQRestore(int_state_t state, spinlock_t *spinlock);
 
 void PmapPageFault(void);
 uint32_t *PmapGetPageTable(struct Pmap *pmap, int pde_idx);
@@ -22,9 +22,18 @@
 .equ IRQ_MODE,  0x12
 .equ SVC_MODE,  0x13
 .equ ABT_MODE,  0x17
+.equ HYP_MODE,  0x1a
 .equ UND_MODE,  0x1b
 .equ SYS_MODE,  0x1f
 
+// @brief System control register bits
+.equ SCTLR_M,   (1<<0)
+.equ SCTLR_C,   (1<<2)
+.equ SCTLR_I,   (1<<12)
+
+// @brief TTBR0 page table walk attributes, see TTBR_CACHE_CONF in hal_arm.h
+.equ TTBR_CACHE_CONF,   0x4A
+
 // @brief Flag register bits
 .equ I_BIT,     (1<<7)
 .equ F_BIT,     (1<<6)
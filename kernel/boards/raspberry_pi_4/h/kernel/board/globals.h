@@ -68,6 +68,7 @@ extern struct bcm2711_aux_registers *aux_regs;
 
 extern struct bcm2711_gic_dist_registers *gic_dist_regs;
 extern struct bcm2711_gic_cpu_iface_registers *gic_cpu_iface_regs;
+extern vm_addr arm_local_base;
 
 /*
  *
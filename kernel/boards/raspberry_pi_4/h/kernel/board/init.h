@@ -24,9 +24,13 @@
 #define BOOT_BASE_ADDR      0x00001000
 #define BOOT_CEILING_ADDR   0x00010000
 
+// Iterations to wait for a secondary core to come online
+#define SECONDARY_START_TIMEOUT   10000000
+
 
 // Externs
 extern uint8_t _stext;
+extern uint8_t _etext;
 extern uint8_t _ebss;
 extern vm_addr _heap_base;
 extern vm_addr _heap_current;
@@ -54,6 +58,8 @@ void init_timer_registers(void);
 void init_processes(void);
 struct Process *create_process(void (*entry)(void), int policy, int priority,
                                bits32_t flags, char *basename, struct CPU *cpu);
+void start_secondary_cpus(void);
+void secondary_main(struct CPU *cpu);
 
 // arm/init_vm.c
 void init_vm(void);
@@ -78,6 +84,7 @@ void BootstrapRootProcess(void);
 void Idle(void);
 void StartKernelProcess(void);
 void TimerBottomHalf(void);
+void secondary_start(void);
 
 
 #endif
@@ -91,11 +91,24 @@ struct bcm2711_gic_cpu_iface_registers
 };
 
 
+/*
+ * ARM local mailbox 3 of each core, the firmware's armstub parks cores 1 to 3
+ * until an entry point is written to it.
+ */
+#define ARM_LOCAL_MAILBOX3_SET(cpu)   (0x8C + 0x10 * (cpu))
+#define ARM_LOCAL_MAILBOX3_CLR(cpu)   (0xCC + 0x10 * (cpu))
+
+
 /*
  * Total number of interrupts on bcm2711 used in Raspberry Pi 4
  */
 #define NIRQ (192)
 
+/*
+ * Software generated interrupts 0 to 15 are used for IPIs
+ */
+#define NSGI (16)
+
 
 /*
  * GICv2 GIC400 register flags and masks
@@ -76,9 +76,10 @@
 
 /* @brief   Get a pointer to the current process
  *
+ * TPIDRPRW holds a pointer to this core's entry in cpu_table.
  */
 .macro MGetCurrentProcess reg
-    ldr \reg, =cpu_table
+    mrc p15, 0, \reg, c13, c0, 4
     ldr \reg, [\reg, #CPU_CURRENT_PROCESS]
 .endm
 
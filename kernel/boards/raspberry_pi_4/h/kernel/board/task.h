@@ -75,7 +75,8 @@ struct ExceptionState
                                    * register context when switching tasks with SetContext
                                    * and GetContext */
                                    
-#define MAX_CPU           1
+#define MAX_CPU           4
+#define CPU_STACK_SZ      4096    /* Size of each mode stack of cores 1 to 3 */
 #define USER_STACK_SZ     0x20000
 #define PROCESS_SZ        8192
 
@@ -100,6 +101,8 @@ struct CPU
   vm_addr svc_stack;
   vm_addr interrupt_stack;
   vm_addr exception_stack;
+  int cpu_id;
+  int online;
 } __attribute__((packed));
 
 
@@ -59,6 +59,10 @@
 // Process size (including stack)
 .equ PROCESS_SZ,                8192
 
+// Number of CPU cores and size of each secondary core's mode stacks
+.equ MAX_CPU,                   4
+.equ CPU_STACK_SZ,              4096
+
 
 // task_state.flags
 .equ TSF_EXIT,                  (1<<0)
@@ -74,7 +78,9 @@
 .equ CPU_SVC_STACK,             12
 .equ CPU_INTERRUPT_STACK,       16
 .equ CPU_EXCEPTION_STACK,       20
-.equ SIZEOF_CPU,                24
+.equ CPU_CPU_ID,                24
+.equ CPU_ONLINE,                28
+.equ SIZEOF_CPU,                32
 
 
 // cpu_table
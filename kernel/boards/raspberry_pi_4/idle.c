@@ -41,6 +41,7 @@ void Idle(void)
   EnableInterrupts();
   
   while(1) {
+    hal_wfi();
   }
 }
 
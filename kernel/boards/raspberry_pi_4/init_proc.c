@@ -24,6 +24,7 @@
 #include <kernel/board/boot.h>
 #include <kernel/board/globals.h>
 #include <kernel/board/init.h>
+#include <kernel/board/interrupt.h>
 #include <kernel/board/task.h>
 #include <kernel/dbg.h>
 #include <kernel/filesystem.h>
@@ -33,6 +34,7 @@
 #include <kernel/timer.h>
 #include <kernel/utility.h>
 #include <kernel/vm.h>
+#include <machine/cheviot_hal.h>
 #include <string.h>
 #include <sys/time.h>
 
@@ -40,6 +42,8 @@
 extern int svc_stack_top;
 extern int interrupt_stack_top;
 extern int exception_stack_top;
+extern int secondary_stacks;
+extern uint32_t secondary_ttbr0;
 
 
 
@@ -58,6 +62,7 @@ void init_processes(void)
 //  struct ISRHandler *isr_handler;
   struct CPU *cpu;
   struct Process *proc;
+  vm_addr stack;
 
   Info("InitProcesses.,");
   
@@ -69,8 +74,12 @@ void init_processes(void)
     LIST_INIT(&isr_handler_list[t]);
   }
 
-  for (int t = 0; t < 32; t++) {
-    CIRCLEQ_INIT(&sched_queue[t]);
+  for (int c = 0; c < MAX_CPU; c++) {
+    sched_queue[c].bitmap = 0;
+
+    for (int t = 0; t < 32; t++) {
+      CIRCLEQ_INIT(&sched_queue[c].queue[t]);
+    }
   }
 
   free_process_cnt = max_process;
@@ -82,22 +91,44 @@ void init_processes(void)
 
   Info(".. process table entries inited");
   
-  for (int t = 0; t < JIFFIES_PER_SECOND; t++) {
-    LIST_INIT(&timing_wheel[t]);
+  for (int l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+    for (int t = 0; t < TIMER_WHEEL_SLOTS; t++) {
+      LIST_INIT(&timing_wheel[l][t]);
+    }
   }
 
+  LIST_INIT(&hrtimer_list);
+  LIST_INIT(&hrtimer_expired_list);
+
   Info(".. timing wheel inited");
 
   InitRendez(&timer_rendez);
-  softclock_time = hardclock_time = 0;
+  softclock_time = hardclock_time = arch_read_hardclock();
+  timer_tick_stopped = false;
+
+  max_cpu = MAX_CPU;
+  cpu_cnt = 1;
+
+  for (int t = 0; t < max_cpu; t++) {
+    cpu = &cpu_table[t];
+    cpu->cpu_id = t;
+    cpu->online = false;
+    cpu->reschedule_request = 0;
+
+    if (t == 0) {
+      cpu->svc_stack = (vm_addr)&svc_stack_top;
+      cpu->interrupt_stack = (vm_addr)&interrupt_stack_top;
+      cpu->exception_stack = (vm_addr)&exception_stack_top;
+    } else {
+      stack = (vm_addr)&secondary_stacks + (t - 1) * 3 * CPU_STACK_SZ;
+      cpu->svc_stack = stack + CPU_STACK_SZ;
+      cpu->interrupt_stack = stack + 2 * CPU_STACK_SZ;
+      cpu->exception_stack = stack + 3 * CPU_STACK_SZ;
+    }
+  }
 
-  max_cpu = 1;
-  cpu_cnt = max_cpu;
   cpu = &cpu_table[0];
-  cpu->reschedule_request = 0;
-  cpu->svc_stack = (vm_addr)&svc_stack_top;
-  cpu->interrupt_stack = (vm_addr)&interrupt_stack_top;
-  cpu->exception_stack = (vm_addr)&exception_stack_top;
+  cpu->online = true;
 
   Info(".. cpu struct inited");
 
@@ -120,9 +151,11 @@ void init_processes(void)
 
   // Can we not schedule a no-op bit of code if no processes running?
   // Do we really need an idle task in separate address-space ? 
-  cpu->idle_process = create_process(Idle, SCHED_IDLE, 0, PROCF_KERNEL, "idle", &cpu_table[0]);
+  for (int t = 0; t < max_cpu; t++) {
+    cpu_table[t].idle_process = create_process(Idle, SCHED_IDLE, 0, PROCF_KERNEL, "idle", &cpu_table[t]);
 
-  Info("idle process created pid:%d", GetProcessPid(cpu->idle_process));
+    Info("idle process created pid:%d", GetProcessPid(cpu_table[t].idle_process));
+  }
 
   // Pick root process to run,  Switch To Root here  
   root_process->state = PROC_STATE_RUNNING;
@@ -132,6 +165,8 @@ void init_processes(void)
 
   ProcessesInitialized();
 
+  start_secondary_cpus();
+
 
   Info("switching to root_process");
 
@@ -143,9 +178,111 @@ void init_processes(void)
   
   // TODO: Can we free any bootsector pages and initial page table?
 
+  // root_process starts in StartKernelProcess which releases sched_slock
+  SpinLock(&sched_slock);
   GetContext(root_process->context);
 }
 
+
+/* @brief   Release cores 1 to 3 from the firmware's spin loop
+ *
+ * The armstub waits in wfe for an entry point to be written to a core's ARM
+ * local mailbox 3. Each core is started in turn with the page directory of
+ * its idle process, into which a 1:1 section mapping of secondary_start is
+ * entered so that the core can enable paging while running at its physical
+ * address. secondary_main() removes the section.
+ *
+ * Until its MMU is on a core reads memory uncached, so the kernel text and
+ * the words it reads are cleaned from this core's data cache first.
+ *
+ * Device interrupts remain routed to core 0 only. Other cores receive IPIs.
+ */
+void start_secondary_cpus(void)
+{
+  struct CPU *cpu;
+  uint32_t *pagedir;
+  vm_addr entry_pa;
+  int pde_idx;
+  int timeout;
+  
+  entry_pa = pmap_va_to_pa((vm_addr)secondary_start);
+  pde_idx = entry_pa / (N_PAGETABLE_PTE * PAGE_SIZE);
+
+  hal_clean_dcache(&_stext, &_etext);
+
+  for (int t = 1; t < max_cpu; t++) {
+    cpu = &cpu_table[t];
+    pagedir = cpu->idle_process->as.pmap.l1_table;
+
+    pagedir[pde_idx] = (entry_pa & L1_S_ADDR_MASK) | L1_TYPE_S | L1_S_AP_RWK;
+    secondary_ttbr0 = pmap_va_to_pa((vm_addr)pagedir);
+    hal_clean_dcache(&pagedir[pde_idx], &pagedir[pde_idx + 1]);
+    hal_clean_dcache(&secondary_ttbr0, &secondary_ttbr0 + 1);
+
+    hal_mmio_write((void *)(arm_local_base + ARM_LOCAL_MAILBOX3_SET(t)), entry_pa);
+    hal_sev();
+
+    for (timeout = 0; timeout < SECONDARY_START_TIMEOUT; timeout++) {
+      if (*(volatile int *)&cpu->online == true) {
+        break;
+      }
+    }
+
+    if (cpu->online == true) {
+      Info("cpu %d online", t);
+    } else {
+      Error("cpu %d failed to start", t);
+      pagedir[pde_idx] = L1_TYPE_INV;
+    }
+  }
+}
+
+
+/* @brief   C entry point of cores 1 to 3
+ *
+ * @param   cpu, this core's entry in cpu_table
+ *
+ * Called from secondary_start with paging enabled and the mode stacks set.
+ * The core then becomes its idle process, this stack is the idle process's
+ * kernel stack and the loop below its body. It runs other processes when a
+ * reschedule IPI arrives.
+ */
+void secondary_main(struct CPU *cpu)
+{
+  struct Process *idle;
+  int_state_t int_state;
+  uint32_t *pagedir;
+  int pde_idx;
+  
+  idle = cpu->idle_process;
+  pagedir = idle->as.pmap.l1_table;
+  pde_idx = pmap_va_to_pa((vm_addr)secondary_start) / (N_PAGETABLE_PTE * PAGE_SIZE);
+
+  pagedir[pde_idx] = L1_TYPE_INV;
+  hal_set_vbar((vm_addr)vector_table);
+  pmap_switch(idle, NULL);
+  
+  hal_mmio_write((void *)(arm_local_base + ARM_LOCAL_MAILBOX3_CLR(cpu->cpu_id)), 0xFFFFFFFF);
+
+  init_gicv2_cpu_iface();
+
+  idle->state = PROC_STATE_RUNNING;
+  cpu->current_process = idle;
+
+  int_state = DisableInterrupts();
+  SpinLock(&sched_slock);
+  cpu->online = true;
+  cpu_cnt++;
+  SpinUnlock(&sched_slock);
+  RestoreInterrupts(int_state);
+
+  EnableInterrupts();
+
+  while (1) {
+    hal_wfi();
+  }
+}
+
 /* @brief Create initial processes, root process and kernel processes for timer and idle tasks
  *
  * The address space created only has the kernel mapped. User-Space is marked as free.
@@ -182,6 +319,7 @@ struct Process *create_process(void (*entry)(void), int policy, int priority,
 
   InitRendez(&proc->rendez);
   LIST_INIT(&proc->child_list);
+  LIST_INIT(&proc->knote_list);
 
 
 	strcpy(proc->basename, basename);
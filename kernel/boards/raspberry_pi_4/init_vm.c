@@ -49,6 +49,7 @@ void init_io_addresses(void)
 	
   gic_dist_regs      = bootinfo->gicd_base;
   gic_cpu_iface_regs = bootinfo->gicc_base[0];
+  arm_local_base     = bootinfo->arm_base;
 }
 
 
@@ -146,6 +146,11 @@ void init_gicv2_cpu_iface(void)
  *
  * Called from irq_vector in vectors.S.
  *
+ * IPIs are handled without the BKL. Device interrupts are only routed to
+ * the boot CPU and are handled with the BKL held. If it is held by a process
+ * on another CPU the interrupted process blocks until the BKL is passed to
+ * it, so the interrupt is acknowledged and ended on the same CPU.
+ *
  * FIXME: We shouldn't need to lock the BKL lock in an interrupt.
  * We do however need to know if we're returning to kernel space
  * or user space in order to decide if we call CheckSignals(). 
@@ -153,13 +158,28 @@ void init_gicv2_cpu_iface(void)
 void interrupt_handler(struct UserContext *context)
 {
   bool unlock = false;
+  uint32_t irq_ack_reg;
+  uint32_t irq;
   
-  if (bkl_locked == false) {
+  irq_ack_reg = hal_mmio_read(&gic_cpu_iface_regs->int_ack);
+  irq = irq_ack_reg & 0x3FF;
+
+  if (irq == IRQ_SPURIOUS) {
+    return;
+  }
+
+  if (irq < NSGI) {
+    clear_pending_interrupt(irq_ack_reg);
+    interrupt_ipi(irq);
+    return;
+  }
+
+  if (bkl_owner != get_current_process()) {
     KernelLock();
     unlock = true;
   }
 
-  interrupt_top_half();
+  interrupt_top_half(irq_ack_reg);
 
   if (unlock == true) {
     KernelUnlock();
@@ -169,24 +189,36 @@ void interrupt_handler(struct UserContext *context)
 }
 
 
-/*
+/* @brief   Handle an inter-processor interrupt
+ *
+ * @param   ipi, IPI_xxx number the SGI was sent with
+ *
+ * A reschedule IPI switches to the highest priority ready process on this
+ * CPU. If the current process holds the BKL it is left to run, the IPI sent
+ * on the next timer tick reschedules this CPU.
+ */
+void interrupt_ipi(int ipi)
+{
+  if (ipi == IPI_RESCHEDULE && bkl_owner != get_current_process()) {
+    Reschedule();
+  }
+}
+
+
+/* @brief   Handle a device interrupt
  *
+ * @param   irq_ack_reg, value read from the GIC's interrupt acknowledge register
  */
-void interrupt_top_half(void)
+void interrupt_top_half(uint32_t irq_ack_reg)
 {
   struct ISRHandler *isr_handler;
   struct Process *current;
+  uint32_t irq;
   
   current = get_current_process();
+  irq = irq_ack_reg & 0x3FF;
 
-  uint32_t irq_ack_reg = hal_mmio_read(&gic_cpu_iface_regs->int_ack);
-  uint32_t irq = irq_ack_reg & 0x3FF;
-
-  if (irq == IRQ_SPURIOUS) {
-    return;
-  }
-  
-  if (irq == IRQ_TIMER3) {
+  if (irq == IRQ_TIMER1 || irq == IRQ_TIMER3) {
     clear_pending_interrupt(irq_ack_reg);
 
     interrupt_top_half_timer();
@@ -226,6 +258,18 @@ void clear_pending_interrupt(uint32_t irq_ack_reg)
 }
 
 
+/* @brief   Send an inter-processor interrupt
+ *
+ * @param   cpu_id, CPU to interrupt
+ * @param   ipi, IPI_xxx number, sent as the SGI of the same number
+ */
+void send_ipi(int cpu_id, int ipi)
+{
+  hal_dsb();
+  hal_mmio_write(&gic_dist_regs->sgi_control, (1 << (16 + cpu_id)) | (ipi & 0x0F));
+}
+
+
 /*
  * Unmasks an IRQ line
  */
@@ -52,11 +52,16 @@ int sys_rpi_mailbox(uint32_t tag, void *request, int req_sz, void *response, int
   
   mailbuffer[5 + req_sz/4] = 0;		// end tag
 
+  // The VideoCore reads and writes the buffer in memory, not in the cache
+  hal_flush_dcache(mailbuffer, mailbuffer + 64);
+
   do {
     hal_mbox_write(MBOX_PROP, mailbuffer_pa);
     result = hal_mbox_read(MBOX_PROP);
   } while (result == 0);
 
+  hal_invalidate_dcache(mailbuffer, mailbuffer + 64);
+
 	// TODO: Add additional checks of response
 
 	actual_response_sz = mailbuffer[3];	
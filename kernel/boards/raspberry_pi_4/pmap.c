@@ -52,6 +52,14 @@ static uint32_t pmap_calc_pa_bits(bits32_t flags)
     pa_bits |= L2_AP_RKU;     // read-only kernel & user
   }
 
+  // RAM uses the same memory type as the kernel's mapping of it
+  if ((flags & MEM_MASK) != MEM_PHYS) {
+    if ((flags & CACHE_MASK) == CACHE_UNCACHEABLE) {
+      pa_bits |= L2_MEM_NORMAL_NC;
+    } else {
+      pa_bits |= L2_MEM_NORMAL;
+    }
+  }
 
 // FIXME: Removed setting pmap cache, bufferable PTE bits
 
@@ -99,6 +107,25 @@ static uint32_t pmap_calc_pa_bits(bits32_t flags)
 }
 
 
+/* @brief   Write back and invalidate a page of RAM in the data cache
+ *
+ * @param   pa, physical address of the page
+ *
+ * The instruction cache is not coherent with the data cache. Code written
+ * to a page, by exec or a page fault, is written back before the page is
+ * mapped or its protections change, the callers then invalidate the I-cache.
+ * This also keeps uncached user mappings of the page consistent with what
+ * the kernel wrote through its cached mapping.
+ */
+static void pmap_flush_page(vm_addr pa)
+{
+  vm_addr va;
+  
+  va = pmap_pa_to_va(pa);
+  hal_flush_dcache((void *)va, (void *)(va + PAGE_SIZE));
+}
+
+
 /*
  * 4k page tables,  1k real PTEs,  3k virtual-page linked list and flags (packed
  * 12 bytes)
@@ -160,6 +187,11 @@ int pmap_enter(struct AddressSpace *as, vm_addr va, vm_addr pa, bits32_t flags)
   vpte->flags = flags;
   pt[pte_idx] = pa | pa_bits;
 
+  // Write back data to memory before the page can be fetched as instructions
+  if ((flags & MEM_MASK) != MEM_PHYS) {
+    pmap_flush_page(pa);
+  }
+
 #if 1
 	if (va >= 0x0001C000 && va <= 0x00028000) {
 		Info ("pmap_enter(va:%08x, pte:%08x, vpte->flgs:%08x)", va, pt[pte_idx], vpte->flags);
@@ -228,7 +260,7 @@ int pmap_remove(struct AddressSpace *as, vm_addr va)
     return -EINVAL;
   }
 
-  if ((vpte->flags & MEM_PHYS) == 0) {
+  if ((vpte->flags & MEM_MASK) != MEM_PHYS) {
     pf = pmap_pa_to_pf(current_paddr);
     LIST_REM_ENTRY(&pf->pmap_pageframe.vpte_list, vpte, link);
   }
@@ -305,6 +337,10 @@ int pmap_protect(struct AddressSpace *as, vm_addr va, bits32_t flags)
   pa_bits = pmap_calc_pa_bits(vpte->flags);
   pt[pte_idx] = pa | pa_bits;
 
+  if ((flags & MEM_MASK) != MEM_PHYS) {
+    pmap_flush_page(pa);
+  }
+
 	hal_dsb();
 	hal_invalidate_tlb_va(va & 0xFFFFF000);
   hal_invalidate_branch();
@@ -606,7 +642,7 @@ void pmap_switch(struct Process *next, struct Process *current)
 // Why does this work but below doesn't ?
   hal_set_ttbr0((void *)(pmap_va_to_pa(root_pagedir) /* | TTBR_CACHE_CONF */));
 #else
-  hal_set_ttbr0((pmap_va_to_pa((vm_addr)next->as.pmap.l1_table)));
+  hal_set_ttbr0((pmap_va_to_pa((vm_addr)next->as.pmap.l1_table)) | TTBR_CACHE_CONF);
 #endif
 	
 	hal_isb();
@@ -641,8 +677,8 @@ int pmap_cache_enter(vm_addr addr, vm_addr paddr)
 
   pa_bits = L2_TYPE_S;
   pa_bits |= L2_AP_RWK;   // read/write kernel-only
+  pa_bits |= L2_MEM_NORMAL;
 //  pa_bits |= L2_NX;
-//  pa_bits |= L2_B | L2_C;
 
   pde_idx = (addr & L1_ADDR_BITS) >> L1_IDX_SHIFT;
 
@@ -731,6 +767,11 @@ int pmap_cache_extract(vm_addr va, vm_addr *pa)
   pt = (uint32_t *)pmap_pa_to_va((vm_addr)phys_pt);
 
   pte_idx = (va & L2_ADDR_BITS) >> L2_IDX_SHIFT;
+
+  if ((pt[pte_idx] & L2_TYPE_MASK) == L2_TYPE_INV) {
+    return -EINVAL;
+  }
+
   *pa = pt[pte_idx] & L2_ADDR_MASK;
   return 0;
 }
@@ -744,13 +785,61 @@ int pmap_cache_extract(vm_addr va, vm_addr *pa)
  * @param   src, base address in source to copy from
  * @param   sz, number of bytes to copy
  * @return  0 on success, negative errno if all bytes could not be copied.
+ *
+ * One of the address spaces must be the current process's, its side of the
+ * copy uses CopyIn or CopyOut so faults are handled as usual. Pages of the
+ * other address space are accessed through the kernel's mapping of physical
+ * memory and must be present, destination pages must also be writable and
+ * not copy-on-write.
  */
 int pmap_interprocess_copy(struct AddressSpace *dst_as, void *dst, 
                            struct AddressSpace *src_as, void *src,
                            size_t sz)
 {
-  // TODO: Copy between processes, handle unmapped pages.
-  return -ENOTSUP;
+  struct AddressSpace *current_as;
+  vm_addr pa;
+  uint32_t flags;
+  size_t offset;
+  size_t nbytes;
+  
+  current_as = &get_current_process()->as;
+  
+  while (sz > 0) {
+    if (dst_as == current_as) {
+      offset = (vm_addr)src % PAGE_SIZE;
+      nbytes = (sz < PAGE_SIZE - offset) ? sz : PAGE_SIZE - offset;
+
+      if (pmap_extract(src_as, ALIGN_DOWN((vm_addr)src, PAGE_SIZE), &pa, &flags) != 0
+          || (flags & MEM_MASK) == MEM_PHYS) {
+        return -EFAULT;
+      }
+      
+      if (CopyOut(dst, (void *)(pmap_pa_to_va(pa) + offset), nbytes) != 0) {
+        return -EFAULT;
+      }      
+    } else if (src_as == current_as) {
+      offset = (vm_addr)dst % PAGE_SIZE;
+      nbytes = (sz < PAGE_SIZE - offset) ? sz : PAGE_SIZE - offset;
+
+      if (pmap_extract(dst_as, ALIGN_DOWN((vm_addr)dst, PAGE_SIZE), &pa, &flags) != 0
+          || (flags & MEM_MASK) == MEM_PHYS
+          || (flags & (PROT_WRITE | MAP_COW)) != PROT_WRITE) {
+        return -EFAULT;
+      }
+      
+      if (CopyIn((void *)(pmap_pa_to_va(pa) + offset), src, nbytes) != 0) {
+        return -EFAULT;
+      }      
+    } else {
+      return -EINVAL;
+    }
+    
+    dst += nbytes;
+    src += nbytes;
+    sz -= nbytes;
+  }
+  
+  return 0;
 }
 
 
@@ -152,7 +152,7 @@ const char *syscall_names[] = {
 	"sys_getgroups",
 	"sys_getpriority",
 	"sys_setpriority",
-	"sys_deprecatedsyscall",
+	"sys_sysconf",
 	"sys_fchmod",
 	"sys_fchown",
 
@@ -162,7 +162,17 @@ const char *syscall_names[] = {
 	"sys_rpi_configure_gpio",
 	"sys_rpi_set_gpio",
 
-	"sys_clock_settime"
+	"sys_clock_settime",
+
+	"sys_bdflush",
+	"sys_setsysconf",
+
+	"sys_mmap",
+	"sys_munmap",
+	"sys_getmsgv",
+	"sys_replymsgv",
+	"sys_sendrec_async",
+	"sys_clock_nanosleep"
 };
 
 
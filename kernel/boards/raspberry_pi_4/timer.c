@@ -49,34 +49,97 @@ void init_timer_registers(void)
 #endif
 
   // Enable the system timer interrupt
+  enable_irq(IRQ_TIMER1);
   enable_irq(IRQ_TIMER3);
 }
 
 
-/* @brief   Special-case handling of timer interrupt
+/* @brief   Special-case handling of timer interrupts
  *
- * TODO: We may want to support sub-jiffy timer interrupts and/or go semi-tickless,
- * to avoid waking up after every jiffy.
+ * Compare register 3 drives the timing wheel and compare register 1 the
+ * high resolution timers. They are reprogrammed by TimerTopHalf() and
+ * HRTimerTopHalf(), the interrupts are not periodic.
  */
 void interrupt_top_half_timer(void)
 {
-  uint32_t clo;
   uint32_t status;
 
   status = hal_mmio_read(&timer_regs->cs);
 
+  if (status & ST_CS_M1) {
+    hal_mmio_write(&timer_regs->cs, ST_CS_M1);
+    HRTimerTopHalf();
+  }
+
   if (status & ST_CS_M3) {
-    clo = hal_mmio_read(&timer_regs->clo);
-    clo += MICROSECONDS_PER_JIFFY;
-    hal_mmio_write(&timer_regs->c3, clo);
-        
     hal_mmio_write(&timer_regs->cs, ST_CS_M3);
-
     TimerTopHalf();
   }
 }
 
 
+/* @brief   Read the hardclock from the free running system timer
+ *
+ * @return  Number of jiffies the system timer has counted
+ */
+uint64_t arch_read_hardclock(void)
+{
+  return timer_read() / MICROSECONDS_PER_JIFFY;
+}
+
+
+/* @brief   Program the next timer interrupt
+ *
+ * @param   expiration_time, hardclock time in jiffies at which to interrupt
+ *
+ * Called with interrupts disabled. Times that have passed or are closer than
+ * TIMER_MIN_DELTA_US microseconds away interrupt TIMER_MIN_DELTA_US from now.
+ */
+void arch_set_timer_event(uint64_t expiration_time)
+{
+  uint64_t now;
+  uint64_t target;
+
+  now = timer_read();
+  target = expiration_time * MICROSECONDS_PER_JIFFY;
+
+  if (target < now + TIMER_MIN_DELTA_US) {
+    target = now + TIMER_MIN_DELTA_US;
+  }
+
+  hal_mmio_write(&timer_regs->c3, (uint32_t)target);
+}
+
+
+/* @brief   Read the system timer in microseconds for high resolution timers
+ */
+uint64_t arch_read_hrclock(void)
+{
+  return timer_read();
+}
+
+
+/* @brief   Program the next high resolution timer interrupt
+ *
+ * @param   expiration_us, system timer time in microseconds to interrupt at
+ *
+ * Called with interrupts disabled. Times closer than TIMER_MIN_DELTA_US
+ * interrupt TIMER_MIN_DELTA_US from now.
+ */
+void arch_set_hrtimer_event(uint64_t expiration_us)
+{
+  uint64_t now;
+
+  now = timer_read();
+
+  if (expiration_us < now + TIMER_MIN_DELTA_US) {
+    expiration_us = now + TIMER_MIN_DELTA_US;
+  }
+
+  hal_mmio_write(&timer_regs->c1, (uint32_t)expiration_us);
+}
+
+
 /* @brief		Read the 64-bit free running microsecond system timer
  *
  */
@@ -121,30 +184,3 @@ int arch_clock_gettime(int clock_id, struct timespec *ts)
 	return sc;
 }
 
-
-/* @brief		Handle nanosleep for sub-jiffy delays
- *
- * We use a spin-loop here to wait for short delays by repeatedly reading
- * the microsecond system timer.
- *
- * Alternatively we could have a small pool of timers to support sub-jiffy delays
- * using interrupts. If there are too many short delays then put them onto the
- * normal timing wheel.
- */
-int arch_spin_nanosleep(struct timespec *req)
-{
-	uint64_t start_clock;
-	uint64_t current_clock;
-	uint64_t timeout = req->tv_nsec / 1000;
-	
-	start_clock = timer_read();
-	
-	do
-	{
-		current_clock = timer_read();
-	}	while (current_clock - start_clock < timeout);
-		
-	return 0;
-}
-
-
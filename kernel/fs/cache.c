@@ -31,20 +31,29 @@
  * @param   vnode, file to read from
  * @param   dst, destination address to copy file data to (kernel or user)
  * @param   sz, number of bytes to read
+ * @param   offset, file offset to read from, updated by the number of bytes read
+ * @param   ra, read-ahead state of the filp or NULL to disable read-ahead
  * @param   inkernel, set to true if the destination address is in the kernel (for kread)
  * @return  number of bytes read or negative errno on failure  
+ *
+ * Read-ahead is started once the first cluster of the request has been read
+ * so that the remaining clusters of a large read and the read-ahead window
+ * are in flight while the data is being copied out.
  */
-ssize_t read_from_cache(struct VNode *vnode, void *dst, size_t sz, off64_t *offset, bool inkernel)
+ssize_t read_from_cache(struct VNode *vnode, void *dst, size_t sz, off64_t *offset,
+                        struct ReadAhead *ra, bool inkernel)
 {
   struct Buf *buf;
   off64_t cluster_base;
   off64_t cluster_offset;
+  off64_t start_offset;
   size_t nbytes_xfer;
   size_t nbytes_total;
   size_t remaining_in_file;
   size_t nbytes_to_read;
   size_t remaining_to_xfer;  
   size_t remaining_in_cluster;    
+  struct IOV iov;
   struct Process *current;
 
   current = get_current_process();
@@ -53,14 +62,11 @@ ssize_t read_from_cache(struct VNode *vnode, void *dst, size_t sz, off64_t *offs
     return 0;
   }
 
-	if (*offset >= vnode->size) {
-		return 0;
-	}
-
 	remaining_in_file = vnode->size - *offset;
 	
 	nbytes_total = 0;
   nbytes_to_read = (remaining_in_file < sz) ? remaining_in_file : sz;
+  start_offset = *offset;
 
   while (nbytes_total < nbytes_to_read) {  
     cluster_base = ALIGN_DOWN(*offset, CLUSTER_SZ);
@@ -69,6 +75,16 @@ ssize_t read_from_cache(struct VNode *vnode, void *dst, size_t sz, off64_t *offs
 		remaining_to_xfer = nbytes_to_read - nbytes_total;
 		remaining_in_cluster = CLUSTER_SZ - cluster_offset;
 		nbytes_xfer = (remaining_to_xfer < remaining_in_cluster) ? remaining_to_xfer : remaining_in_cluster;
+
+    // A fault on an mmap() of this cluster would bread() the buf we hold busy
+    if (inkernel == false) {
+      iov.addr = dst;
+      iov.size = nbytes_xfer;
+      
+      if (prefault_iov(1, &iov, true) != 0) {
+        break;
+      }
+    }
 		
     buf = bread(vnode, cluster_base);
 
@@ -78,10 +94,15 @@ ssize_t read_from_cache(struct VNode *vnode, void *dst, size_t sz, off64_t *offs
       break;
     }
 
+    if (ra != NULL && nbytes_total == 0) {
+      start_readahead(vnode, ra, start_offset, start_offset + nbytes_to_read);
+    }
+    
     if (inkernel == true) {
         memcpy(dst, buf->data + cluster_offset, nbytes_xfer);
     } else {    
         if (CopyOut(dst, buf->data + cluster_offset, nbytes_xfer) != 0) {
+          brelse(buf);
         	break;
         }
     }
@@ -91,6 +112,8 @@ ssize_t read_from_cache(struct VNode *vnode, void *dst, size_t sz, off64_t *offs
     dst += nbytes_xfer;
     *offset += nbytes_xfer;
     nbytes_total += nbytes_xfer;
+
+    KernelPreemptionPoint();
   }
 
 //	Info("read_from_cache() total= %d", nbytes_total);
@@ -98,6 +121,71 @@ ssize_t read_from_cache(struct VNode *vnode, void *dst, size_t sz, off64_t *offs
 }
 
 
+/* @brief   Issue asynchronous reads ahead of a sequential reader
+ *
+ * @param   vnode, file being read
+ * @param   ra, read-ahead state of the filp doing the reading
+ * @param   offset, file offset the current read started at
+ * @param   end_offset, file offset the current read will end at
+ *
+ * A read that starts where the previous one ended is treated as sequential
+ * and doubles the read-ahead window up to READAHEAD_MAX_CLUSTERS. A read
+ * elsewhere in the file halves the window, so random access soon stops
+ * issuing read-ahead at all.
+ *
+ * New read-ahead is only issued once the reader has consumed half of the
+ * window already in flight, so a stream of small reads does not send a
+ * message to the filesystem handler on every call.
+ */
+void start_readahead(struct VNode *vnode, struct ReadAhead *ra, off64_t offset, off64_t end_offset)
+{
+  off64_t ra_start;
+  off64_t ra_end;
+  off64_t file_end;
+  int cluster_cnt;
+  
+  if (offset != ra->next_offset) {
+    ra->window /= 2;
+    ra->async_offset = 0;
+    ra->next_offset = end_offset;
+    return;
+  }
+
+  ra->next_offset = end_offset;
+
+  if (ra->window != 0 && ra->async_offset >= ALIGN_UP(end_offset, CLUSTER_SZ)
+                                              + (ra->window / 2) * CLUSTER_SZ) {
+    return;
+  }
+
+  if (ra->window == 0) {
+    ra->window = READAHEAD_MIN_CLUSTERS;
+  } else if (ra->window < READAHEAD_MAX_CLUSTERS) {
+    ra->window *= 2;
+  }
+
+  ra_start = ALIGN_DOWN(offset, CLUSTER_SZ) + CLUSTER_SZ;
+  
+  if (ra->async_offset > ra_start) {
+    ra_start = ra->async_offset;
+  }
+  
+  ra_end = ALIGN_UP(end_offset, CLUSTER_SZ) + ra->window * CLUSTER_SZ;
+  file_end = ALIGN_UP(vnode->size, CLUSTER_SZ);
+
+  if (ra_end > file_end) {
+    ra_end = file_end;
+  }
+
+  if (ra_start >= ra_end) {
+    return;
+  }
+  
+  cluster_cnt = breada(vnode, ra_start, (ra_end - ra_start) / CLUSTER_SZ);
+  ra->async_offset = ra_start + (off64_t)cluster_cnt * CLUSTER_SZ;
+}
+
+
 /* @brief   Write to a file through the VFS file cache
  *
  * @param   vnode, file to write to
@@ -118,11 +206,16 @@ ssize_t write_to_cache(struct VNode *vnode, void *src, size_t sz, off64_t *offse
   size_t nbytes_to_write;
   size_t remaining_to_xfer;  
   size_t remaining_in_cluster;  
+  struct IOV iov;
   struct Process *current;
   
     
   current = get_current_process();
 
+  if (vnode->text_cnt > 0) {
+    return -ETXTBSY;
+  }
+
 	nbytes_total = 0;
   nbytes_to_write = sz;
 
@@ -133,6 +226,14 @@ ssize_t write_to_cache(struct VNode *vnode, void *src, size_t sz, off64_t *offse
 		remaining_to_xfer = nbytes_to_write - nbytes_total;
 		remaining_in_cluster = CLUSTER_SZ - cluster_offset;
 		nbytes_xfer = (remaining_to_xfer < remaining_in_cluster) ? remaining_to_xfer : remaining_in_cluster;
+
+    // A fault on an mmap() of this cluster would bread() the buf we hold busy
+    iov.addr = src;
+    iov.size = nbytes_xfer;
+    
+    if (prefault_iov(1, &iov, false) != 0) {
+      break;
+    }
 		
 		if (cluster_base < vnode->size) {
       buf = bread(vnode, cluster_base);
@@ -162,6 +263,8 @@ ssize_t write_to_cache(struct VNode *vnode, void *src, size_t sz, off64_t *offse
     } else {
       bdwrite(buf);
     }    
+
+    KernelPreemptionPoint();
   }
 
   return nbytes_total;
@@ -192,10 +295,7 @@ ssize_t write_to_cache(struct VNode *vnode, void *src, size_t sz, off64_t *offse
 struct Buf *getblk(struct VNode *vnode, uint64_t cluster_offset)
 {
   struct Buf *buf;
-  struct Pageframe *pf;
   struct SuperBlock *sb;
-  uint32_t hash;
-  vm_addr pa;
 
   while (1) {
     if ((buf = findblk(vnode, cluster_offset)) != NULL) {
@@ -204,59 +304,56 @@ struct Buf *getblk(struct VNode *vnode, uint64_t cluster_offset)
         continue;
       }
 
+      // A dirty buf stays on the delayed-write timing wheel while busy
+      LIST_REM_ENTRY(&buf_avail_list, buf, free_link);
       buf->flags |= B_BUSY;
-
-      if (buf->flags & (B_DELWRI | B_ASYNC)) {
-        buf->flags &= ~(B_DELWRI | B_ASYNC);
-        sb = buf->vnode->superblock;
-  
-        hash = buf->expiration_time % NR_DELWRI_BUCKETS;
-        LIST_REM_ENTRY(&sb->delwri_timing_wheel[hash], buf, delwri_hash_link);
-      }
-      
       return buf;
 
     } else {
-      if ((buf = LIST_HEAD(&buf_avail_list)) == NULL) {
-        TaskSleep(&buf_list_rendez);
-        continue;
-      }
+      // Grow the cache into free memory before recycling the LRU buf
+      if (buf_page_cnt + CLUSTER_SZ / PAGE_SIZE <= buf_page_limit
+          && (buf = LIST_HEAD(&buf_empty_list)) != NULL) {
+        LIST_REM_HEAD(&buf_empty_list, free_link);
+
+        if (alloc_buf_pages(buf) == 0) {
+          buf->flags = B_BUSY;
+          bhash(buf, vnode, cluster_offset);
+          return buf;
+        }
 
-      LIST_REM_HEAD(&buf_avail_list, free_link);
-      buf->flags |= B_BUSY;
+        LIST_ADD_HEAD(&buf_empty_list, buf, free_link);
+      }
 
-      if (buf->flags & B_VALID) {
-        LIST_REM_ENTRY(&buf_hash[buf->cluster_offset % BUF_HASH], buf, lookup_link);
+      // Bufs with pages mapped by mmap() are not recycled until unmapped
+      buf = LIST_HEAD(&buf_avail_list);
 
-        pmap_cache_extract((vm_addr)buf->data, &pa);
-        pf = pmap_pa_to_pf(pa);
-        pmap_cache_remove((vm_addr)buf->data);
-        free_pageframe(pf);
+      while (buf != NULL && buf->mapped_cnt > 0) {
+        buf = LIST_NEXT(buf, free_link);
       }
-
-/*
-      if (cluster_offset >= vnode->size) {
-        cluster_size = 0;
-      } else if (vnode->size - cluster_offset < CLUSTER_SZ) {
-        cluster_size = ALIGN_UP(vnode->size - cluster_offset, PAGE_SIZE);
-      } else {
-        cluster_size = CLUSTER_SZ;
+      
+      if (buf == NULL) {
+        TaskSleep(&buf_list_rendez);
+        continue;
       }
-*/
 
-      for (int t = 0; t < (CLUSTER_SZ / PAGE_SIZE); t++) {
-        pf = alloc_pageframe(PAGE_SIZE);
-        pmap_cache_enter((vm_addr)buf->data + t * PAGE_SIZE, pf->physical_addr);
+      if (buf->flags & (B_DELWRI | B_ASYNC)) {
+        // Start writing the dirty buf, it returns to the avail list when done
+        sb = buf->vnode->superblock;
+        unhash_delayed_write_buf(sb, buf);
+        bwrite_run(sb, gather_delayed_writes(sb, buf));
+        continue;
       }
+      
+      LIST_REM_ENTRY(&buf_avail_list, buf, free_link);
+      buf->flags |= B_BUSY;
 
-      pmap_flush_tlbs();
-      buf->flags &= ~B_VALID;
-      buf->vnode = vnode;
-
-      buf->cluster_offset = cluster_offset;
-      LIST_ADD_HEAD(&buf_hash[buf->cluster_offset % BUF_HASH], buf,
-                    lookup_link);
+      if (buf->vnode != NULL) {
+        bunhash(buf);
+      }
 
+      // The buf's pages stay wired at buf->data, its contents are overwritten
+      buf->flags = B_BUSY;
+      bhash(buf, vnode, cluster_offset);
       return buf;
     }
   }
@@ -270,10 +367,9 @@ struct Buf *getblk(struct VNode *vnode, uint64_t cluster_offset)
 void brelse(struct Buf *buf)
 {
   if (buf->flags & (B_ERROR | B_DISCARD)) {
-    LIST_REM_ENTRY(&buf_hash[buf->cluster_offset % BUF_HASH], buf, lookup_link);
-    buf->flags &= ~(B_VALID | B_ERROR);
-    buf->cluster_offset = -1;
-    buf->vnode = NULL;
+    remove_delayed_write_buf(buf);
+    bunhash(buf);
+    buf->flags &= ~(B_VALID | B_ERROR | B_DISCARD);
 
     if (buf->data != NULL) {
       LIST_ADD_HEAD(&buf_avail_list, buf, free_link);
@@ -298,7 +394,7 @@ struct Buf *findblk(struct VNode *vnode, uint64_t cluster_offset)
 {
   struct Buf *buf;
 
-  buf = LIST_HEAD(&buf_hash[cluster_offset % BUF_HASH]);
+  buf = LIST_HEAD(&buf_hash[buf_hash_key(vnode, cluster_offset)]);
 
   while (buf != NULL) {
     if (buf->vnode == vnode && buf->cluster_offset == cluster_offset)
@@ -311,6 +407,62 @@ struct Buf *findblk(struct VNode *vnode, uint64_t cluster_offset)
 }
 
 
+/* @brief   Hash a vnode and file offset to a bucket of the buf hash table
+ *
+ * @param   vnode, file the block belongs to
+ * @param   cluster_offset, offset within the file (aligned to cluster size)
+ * @return  index into buf_hash
+ *
+ * The vnode's table index and the cluster index are mixed with a
+ * multiplicative (Fibonacci) hash so that the same cluster of different
+ * files and consecutive clusters of one file land in different buckets.
+ */
+uint32_t buf_hash_key(struct VNode *vnode, uint64_t cluster_offset)
+{
+  uint32_t key;
+  
+  key = (uint32_t)(vnode - vnode_table) * 0x9E3779B1;
+  key ^= (uint32_t)(cluster_offset / CLUSTER_SZ);
+  key *= 0x9E3779B1;
+  return key >> (32 - BUF_HASH_SHIFT);
+}
+
+
+/* @brief   Add a buf to the buf hash table and its file's buf list
+ *
+ * @param   buf, buf to hash, must not already be hashed
+ * @param   vnode, file the block belongs to
+ * @param   cluster_offset, offset within the file (aligned to cluster size)
+ */
+void bhash(struct Buf *buf, struct VNode *vnode, uint64_t cluster_offset)
+{
+  KASSERT(buf->vnode == NULL);
+  
+  buf->vnode = vnode;
+  buf->cluster_offset = cluster_offset;
+  LIST_ADD_HEAD(&buf_hash[buf_hash_key(vnode, cluster_offset)], buf, lookup_link);
+  LIST_ADD_TAIL(&vnode->buf_list, buf, vnode_link);
+}
+
+
+/* @brief   Remove a buf from the buf hash table and its file's buf list
+ *
+ * @param   buf, hashed buf to remove
+ */
+void bunhash(struct Buf *buf)
+{
+  struct VNode *vnode;
+  
+  vnode = buf->vnode;
+  KASSERT(vnode != NULL);
+  
+  LIST_REM_ENTRY(&buf_hash[buf_hash_key(vnode, buf->cluster_offset)], buf, lookup_link);
+  LIST_REM_ENTRY(&vnode->buf_list, buf, vnode_link);
+  buf->vnode = NULL;
+  buf->cluster_offset = -1;
+}
+
+
 /* @brief   Read a block from a file
  *
  * @param   vnode, vnode of file to read
@@ -363,6 +515,122 @@ struct Buf *bread(struct VNode *vnode, uint64_t cluster_base)
 }
 
 
+/* @brief   Start asynchronous reads of a range of blocks for read-ahead
+ *
+ * @param   vnode, vnode of file to read
+ * @param   cluster_base, file offset of the first block, aligned to the cluster size
+ * @param   cluster_cnt, number of blocks to read
+ * @return  number of blocks from cluster_base that are cached, in flight or
+ *          have been queued. Less than cluster_cnt if the cache ran out of bufs.
+ *
+ * Runs of adjacent blocks that are not in the cache are sent to the
+ * filesystem handler as a single CMD_READ of up to MAX_CLUSTERS_PER_REQ
+ * clusters, with the riov listing the data page of each buf.
+ *
+ * The bufs stay busy until the filesystem handler replies, at which point
+ * bdflush_brelse() marks them valid and releases them. A bread() of the same
+ * block in the meantime sleeps on the busy buf rather than issuing a second
+ * read. Read-ahead is cut short when the cache has no buf available.
+ *
+ * getblk() can sleep, so a block loaded or dirtied by another process
+ * after the findblk() check is released rather than read over.
+ */
+int breada(struct VNode *vnode, uint64_t cluster_base, int cluster_cnt)
+{
+  struct Buf *buf;
+  struct Buf *head;
+  struct Buf *tail;
+  uint64_t offset;
+  int nbufs;
+  int t;
+
+  head = NULL;
+  tail = NULL;
+  nbufs = 0;
+  
+  for (t = 0; t < cluster_cnt; t++) {
+    offset = cluster_base + (uint64_t)t * CLUSTER_SZ;
+    
+    if (findblk(vnode, offset) != NULL) {
+      breada_run(vnode, head);
+      head = NULL;
+      nbufs = 0;
+      continue;
+    }
+
+    if (LIST_HEAD(&buf_avail_list) == NULL
+        && (LIST_HEAD(&buf_empty_list) == NULL
+            || buf_page_cnt + CLUSTER_SZ / PAGE_SIZE > buf_page_limit)) {
+      break;
+    }
+
+    buf = getblk(vnode, offset);
+
+    if (buf->flags & (B_VALID | B_DELWRI)) {
+      brelse(buf);
+      breada_run(vnode, head);
+      head = NULL;
+      nbufs = 0;
+      continue;
+    }
+    
+    buf->flags = (buf->flags | B_READ | B_ASYNC | B_READAHEAD) & ~B_WRITE;
+    buf->cluster_next = NULL;
+    
+    if (head == NULL) {
+      head = buf;
+    } else {
+      tail->cluster_next = buf;
+    }
+    
+    tail = buf;
+    nbufs++;
+    
+    if (nbufs == MAX_CLUSTERS_PER_REQ) {
+      breada_run(vnode, head);
+      head = NULL;
+      nbufs = 0;
+    }
+  }
+  
+  breada_run(vnode, head);  
+  return t;
+}
+
+
+/* @brief   Send a run of adjacent read-ahead bufs as a single read request
+ *
+ * @param   vnode, vnode of file to read
+ * @param   head, first buf of the run linked by cluster_next, may be NULL
+ * @return  0 on success, negative errno on failure
+ *
+ * If the request cannot be sent the bufs are discarded.
+ */
+int breada_run(struct VNode *vnode, struct Buf *head)
+{
+  struct Buf *buf;
+  struct Buf *next;
+  int sc;
+  
+  if (head == NULL) {
+    return 0;
+  }
+  
+  sc = vfs_read_async(vnode->superblock, head);
+  
+  if (sc != 0) {
+    for (buf = head; buf != NULL; buf = next) {
+      next = buf->cluster_next;
+      buf->cluster_next = NULL;
+      buf->flags = (buf->flags | B_ERROR) & ~(B_READ | B_ASYNC | B_READAHEAD);
+      brelse(buf);
+    }
+  }
+  
+  return sc;
+}
+
+
 /*
  *
  */
@@ -403,6 +671,7 @@ int bwrite(struct Buf *buf)
   struct VNode *vnode;
   off64_t cluster_offset;
   
+  remove_delayed_write_buf(buf);
   buf->flags = (buf->flags | B_WRITE) & ~(B_READ | B_ASYNC);
   vnode = buf->vnode;
   cluster_offset = buf->cluster_offset;
@@ -438,17 +707,11 @@ int bwrite(struct Buf *buf)
 int bawrite(struct Buf *buf)
 {
   struct SuperBlock *sb;
-  struct VNode *vnode;
-  uint32_t hash;
 
-  vnode = buf->vnode;
-  sb = vnode->superblock;
-    
-  buf->flags = (buf->flags | B_WRITE | B_ASYNC) & ~(B_READ | B_DELWRI);
-  buf->expiration_time = sb->softclock;
+  sb = buf->vnode->superblock;
   
-  hash = buf->expiration_time % NR_DELWRI_BUCKETS;
-  LIST_ADD_TAIL(&sb->delwri_timing_wheel[hash], buf, delwri_hash_link);
+  hash_delayed_write_buf(buf, sb->softclock);
+  buf->flags = (buf->flags | B_WRITE | B_ASYNC) & ~(B_READ | B_DELWRI);
   brelse(buf);
 
   return 0;
@@ -466,7 +729,6 @@ int bawrite(struct Buf *buf)
  *
  * This is called when a write does not cross into the next block.
  * 
-  // TODO: Insert onto delwri queue 5 seconds from now
   // If already on delayed write queue, reinsert it at time, so that
   // it will eventually get flushed, if time has passed, insert it at
   // the head so it will be written soon.
@@ -474,37 +736,64 @@ int bawrite(struct Buf *buf)
 int bdwrite(struct Buf *buf)
 {
   struct SuperBlock *sb;
-  struct VNode *vnode;
-  uint32_t hash;
 
-  vnode = buf->vnode;
-  sb = vnode->superblock;
+  sb = buf->vnode->superblock;
 
+  hash_delayed_write_buf(buf, sb->softclock + DELWRI_DELAY_TICKS);
   buf->flags = (buf->flags | B_WRITE | B_DELWRI) & ~(B_READ | B_ASYNC);
-
-  buf->expiration_time = sb->softclock + DELWRI_DELAY_TICKS;
-
-  hash = buf->expiration_time % NR_DELWRI_BUCKETS;
-  LIST_ADD_TAIL(&sb->delwri_timing_wheel[hash], buf, delwri_hash_link);
   brelse(buf);
   
   return 0;
 }
 
 
+/* @brief   Start an asynchronous write of a run of dirty bufs
+ *
+ * @param   sb, superblock of the file's mount
+ * @param   head, first buf of a run of busy bufs linked by cluster_next
+ * @return  0 on success, negative errno on failure
+ *
+ * If the write cannot be sent the bufs are returned to the delayed-write
+ * timing wheel with bdwrite() so that they stay dirty and are retried later.
+ */
+int bwrite_run(struct SuperBlock *sb, struct Buf *head)
+{
+  struct Buf *buf;
+  struct Buf *next;
+  int sc;
+  
+  sc = vfs_write_async(sb, head);
+  
+  if (sc != 0) {
+    for (buf = head; buf != NULL; buf = next) {
+      next = buf->cluster_next;
+      buf->cluster_next = NULL;
+      bdwrite(buf);
+    }
+  }
+  
+  return sc;
+}
+
+
 /* @brief   Write out all cached blocks of a file
  *
  * @param   vnode, file to write dirty cached blocks to disk
  * @return  0 on success, negative errno on failure.
+ *
+ * Only the file's own dirty blocks are written. They are taken off the
+ * delayed-write timing wheel and sent as multi-cluster async writes, then
+ * this waits for all writes of the file to complete.
  */
 int bsync(struct VNode *vnode)
 {
-  // Find all blocks in cache belonging to file, immediately write out.
-  // What if blocks are busy, wait?
+  int sc;
   
-  // Do we notify the bdflush_task ?
+  if ((sc = bflush(vnode)) != 0) {
+    return sc;
+  }
   
-  return -ENOSYS;
+  return bwait(vnode);
 }
 
 
@@ -512,12 +801,85 @@ int bsync(struct VNode *vnode)
  * 
  * @param   sb, superblock of mounted filesystem to sync contents of
  * @return  0 on success, negative errno on failure
+ *
+ * Writes for all files are started before waiting for any of them so that
+ * the filesystem handler can work through them back to back.
  */
 int bsyncfs(struct SuperBlock *sb)
 {
-  // Do we notify the bdflush_task ?
+  struct VNode *vnode;
+  int sc = 0;
+  
+  for (int t = 0; t < max_vnode; t++) {
+    vnode = &vnode_table[t];
+    
+    if (vnode->superblock == sb && LIST_HEAD(&vnode->dirty_buf_list) != NULL) {
+      bflush(vnode);
+    }
+  }
 
-  return -ENOSYS;
+  for (int t = 0; t < max_vnode; t++) {
+    vnode = &vnode_table[t];
+    
+    if (vnode->superblock == sb && bwait(vnode) != 0) {
+      sc = -EIO;
+    }
+  }
+  
+  return sc;
+}
+
+
+/* @brief   Start writing all dirty blocks of a file without waiting
+ *
+ * @param   vnode, file to write dirty cached blocks of
+ * @return  0 on success, negative errno on failure
+ *
+ * A dirty block that is busy is waited on as its holder may dirty it
+ * further, it is then written once released.
+ */
+int bflush(struct VNode *vnode)
+{
+  struct SuperBlock *sb;
+  struct Buf *buf;
+  int sc;
+  
+  sb = vnode->superblock;
+  
+  while ((buf = LIST_HEAD(&vnode->dirty_buf_list)) != NULL) {
+    if (buf->flags & B_BUSY) {
+      TaskSleep(&buf->rendez);
+      continue;
+    }
+    
+    unhash_delayed_write_buf(sb, buf);
+    
+    if ((sc = bwrite_run(sb, gather_delayed_writes(sb, buf))) != 0) {
+      return sc;
+    }
+  }
+  
+  return 0;
+}
+
+
+/* @brief   Wait for all in-progress async writes of a file to complete
+ *
+ * @param   vnode, file to wait on
+ * @return  0 on success, -EIO if any of the writes failed
+ */
+int bwait(struct VNode *vnode)
+{
+  while (vnode->write_pending_cnt > 0) {
+    TaskSleep(&vnode->rendez);
+  }
+  
+  if (vnode->flags & V_WRITE_ERROR) {
+    vnode->flags &= ~V_WRITE_ERROR;
+    return -EIO;
+  }
+  
+  return 0;
 }
 
 
@@ -532,21 +894,237 @@ int bsyncfs(struct SuperBlock *sb)
  */
 int btruncate(struct VNode *vnode)
 {
-  return -ENOSYS;
+  struct Buf *buf;
+  off64_t cluster_base;
+  off64_t cluster_offset;
+  
+  bdiscard(vnode, ALIGN_UP(vnode->size, CLUSTER_SZ));
+  
+  cluster_offset = vnode->size % CLUSTER_SZ;
+  
+  if (cluster_offset != 0) {
+    cluster_base = ALIGN_DOWN(vnode->size, CLUSTER_SZ);
+    
+    if (findblk(vnode, cluster_base) != NULL) {
+      buf = getblk(vnode, cluster_base);
+      
+      if (buf->flags & B_VALID) {
+        memset(buf->data + cluster_offset, 0, CLUSTER_SZ - cluster_offset);
+      }
+      
+      brelse(buf);
+    }
+  }
+
+  return 0;
 }
 
 
-/* @brief   Dynamically change the size of the filesystem cache
+/* @brief   Discard cached blocks of a file without writing them
+ *
+ * @param   vnode, file to discard blocks of
+ * @param   offset, blocks at or beyond this cluster-aligned offset are discarded
+ *
+ * Busy blocks are waited on before being discarded.
  */
-size_t resize_cache(size_t free)
+void bdiscard(struct VNode *vnode, off64_t offset)
 {
-  // Find out how much we need
-  // while (cache_shrink_busy)
-  // cond_wait();
+  struct Buf *buf;
+  struct Buf *next;
+  
+  buf = LIST_HEAD(&vnode->buf_list);
+  
+  while (buf != NULL) {
+    next = LIST_NEXT(buf, vnode_link);
 
-  // Flush LRU until
+    if (buf->cluster_offset < offset) {
+      buf = next;
+      continue;
+    }
+    
+    if (buf->flags & B_BUSY) {
+      // The buf list may have changed while asleep, start again
+      TaskSleep(&buf->rendez);
+      buf = LIST_HEAD(&vnode->buf_list);
+      continue;
+    }
 
-  return -ENOSYS;
+    LIST_REM_ENTRY(&buf_avail_list, buf, free_link);
+    buf->flags |= B_BUSY | B_DISCARD;
+    brelse(buf);
+    buf = next;
+  }
+}
+
+
+/* @brief   Map newly allocated pages into an empty buf's cluster
+ *
+ * @param   buf, buf taken from the empty list
+ * @return  0 on success, -ENOMEM if there is not enough free memory
+ *
+ * The pages are not cleared, they are filled by bread(), bread_zero() or a
+ * write. They remain wired until the buf is reclaimed by reclaim_cache_pageframe().
+ */
+int alloc_buf_pages(struct Buf *buf)
+{
+  struct Pageframe *pf;
+  int t;
+  
+  for (t = 0; t < (CLUSTER_SZ / PAGE_SIZE); t++) {
+    if ((pf = get_spare_pageframe()) != NULL) {
+      pf->flags |= PGF_WIRED;
+    } else if ((pf = alloc_pageframe_flags(PAGE_SIZE, PGF_WIRED)) == NULL) {
+      break;
+    }
+    
+    pmap_cache_enter((vm_addr)buf->data + t * PAGE_SIZE, pf->physical_addr);
+    pf->buf = buf;
+  }
+
+  buf_page_cnt += t;
+
+  if (t < (CLUSTER_SZ / PAGE_SIZE)) {
+    if ((pf = free_buf_pages(buf)) != NULL) {
+      put_spare_pageframe(pf);
+    }
+    return -ENOMEM;
+  }
+  
+  return 0;
+}
+
+
+/* @brief   Unmap the pages of a buf's cluster
+ *
+ * @param   buf, buf to unmap, no longer on the avail list or hash
+ * @return  The first pageframe of the cluster, the remainder become spare
+ *          pages of the cache
+ */
+struct Pageframe *free_buf_pages(struct Buf *buf)
+{
+  struct Pageframe *pf;
+  struct Pageframe *first = NULL;
+  vm_addr pa;
+  
+  for (int t = 0; t < (CLUSTER_SZ / PAGE_SIZE); t++) {
+    if (pmap_cache_extract((vm_addr)buf->data + t * PAGE_SIZE, &pa) != 0) {
+      continue;
+    }
+    
+    pf = pmap_pa_to_pf(pa);
+    pmap_cache_remove((vm_addr)buf->data + t * PAGE_SIZE);
+    pf->flags &= ~PGF_WIRED;
+    pf->buf = NULL;
+    buf_page_cnt--;
+
+    if (first == NULL) {
+      first = pf;
+    } else {
+      put_spare_pageframe(pf);
+    }
+  }
+  
+  return first;
+}
+
+
+/* @brief   Take the page of the least recently used clean buf
+ *
+ * @return  A pageframe from the cache or NULL if no clean buf is available
+ *
+ * Called by alloc_pageframe() when there are no free 4k pages. Spare pages
+ * are handed back first. Bufs on the avail list are ordered least recently
+ * used first. Dirty bufs are skipped, they are written out by bdflush or
+ * getblk before they can be reused. Bufs mapped into a process by mmap() are
+ * also skipped.
+ */
+struct Pageframe *reclaim_cache_pageframe(void)
+{
+  struct Buf *buf;
+  struct Pageframe *pf;
+  
+  if ((pf = get_spare_pageframe()) != NULL) {
+    return pf;
+  }
+  
+  buf = LIST_HEAD(&buf_avail_list);
+  
+  while (buf != NULL && ((buf->flags & (B_DELWRI | B_ASYNC)) || buf->mapped_cnt > 0)) {
+    buf = LIST_NEXT(buf, free_link);
+  }
+  
+  if (buf == NULL) {
+    return NULL;
+  }
+
+  LIST_REM_ENTRY(&buf_avail_list, buf, free_link);
+
+  if (buf->vnode != NULL) {
+    bunhash(buf);
+  }
+
+  buf->flags = B_FREE;
+  LIST_ADD_TAIL(&buf_empty_list, buf, free_link);
+  return free_buf_pages(buf);
+}
+
+
+/* @brief   Keep a page given up by a buf for reuse
+ *
+ * @param   pf, unmapped 4k pageframe no longer part of any buf
+ *
+ * free_pageframe() does not yet return pages to the free lists. Pages are
+ * instead kept here and reused by alloc_buf_pages(), or handed back to the
+ * page allocator by reclaim_cache_pageframe() when memory runs out.
+ */
+void put_spare_pageframe(struct Pageframe *pf)
+{
+  KASSERT(pf->size == PAGE_SIZE);
+  KASSERT(pf->reference_cnt == 0);
+
+  pf->flags &= ~PGF_WIRED;
+  pf->buf = NULL;
+  LIST_ADD_TAIL(&buf_spare_pf_list, pf, link);
+}
+
+
+/* @brief   Take a spare page kept by put_spare_pageframe()
+ *
+ * @return  pageframe or NULL if there are no spare pages
+ */
+struct Pageframe *get_spare_pageframe(void)
+{
+  struct Pageframe *pf;
+
+  if ((pf = LIST_HEAD(&buf_spare_pf_list)) != NULL) {
+    LIST_REM_HEAD(&buf_spare_pf_list, link);
+  }
+
+  return pf;
+}
+
+
+/* @brief   Dynamically change the size of the filesystem cache
+ *
+ * @param   page_limit, maximum number of pages the cache may grow to
+ * @return  The new page limit
+ *
+ * The limit is clamped to the number of bufs in the buf_table. Lowering the
+ * limit stops the cache growing, getblk() then recycles bufs instead. Pages
+ * above the limit are not evicted as free_pageframe() does not yet return
+ * pages to the free lists, they are only given back to the page allocator
+ * by reclaim_cache_pageframe() when memory runs out.
+ */
+int resize_cache(int page_limit)
+{
+  if (page_limit < CACHE_MIN_BUFS * (CLUSTER_SZ / PAGE_SIZE)) {
+    page_limit = CACHE_MIN_BUFS * (CLUSTER_SZ / PAGE_SIZE);
+  } else if (page_limit > max_buf * (CLUSTER_SZ / PAGE_SIZE)) {
+    page_limit = max_buf * (CLUSTER_SZ / PAGE_SIZE);
+  }
+  
+  buf_page_limit = page_limit;
+  return buf_page_limit;
 }
 
 
@@ -592,6 +1170,7 @@ int sys_bdflush(int fd)
   struct Buf *buf;
   uint64_t now;
 	int count = 0;
+	int sc;
 	struct Process *current;
 	
 	Info("bdflush(%d)", fd);
@@ -608,7 +1187,13 @@ int sys_bdflush(int fd)
 	
   while (sb->softclock < now) { 
     while((buf = find_delayed_write_buf(sb, sb->softclock)) != NULL) {
-       vfs_write_async(sb, buf);
+       buf = gather_delayed_writes(sb, buf);
+       
+       // The bufs stay dirty on failure, retry on a later call
+       if ((sc = bwrite_run(sb, buf)) != 0) {
+         return sc;
+       }
+       
        count++;      
     }
    	
@@ -620,14 +1205,69 @@ int sys_bdflush(int fd)
 }
 
 
-/* @brief		Release any resources of a delayed write buffer during replymsg
+/* @brief		Complete an asynchronous read or write of bufs during replymsg
  *
- *   // only do this if replyport is null
-
+ * @param   msg, message embedded at the start of the first buf of the request
+ * @return  0 on success
+ *
+ * Called by sys_replymsg() for messages with no reply port. The reply status
+ * is the number of bytes transferred for the whole run of bufs linked by
+ * cluster_next. A read-ahead buf becomes valid if the handler returned any
+ * data for it, the remainder of a short cluster is zeroed as in bread().
+ * A buf that was not written in full, by an error or a short write, stays
+ * dirty and is written again later.
  */
 int bdflush_brelse(struct Msg *msg)
 {
-  brelse((struct Buf *)msg);
+  struct Buf *head;
+  struct Buf *buf;
+  struct Buf *next;
+  struct VNode *vnode;
+  ssize_t remaining;
+  int t;
+  
+  head = (struct Buf *)msg;
+  remaining = msg->reply_status;
+  
+  for (buf = head, t = 0; buf != NULL; buf = next, t++) {
+    next = buf->cluster_next;
+    buf->cluster_next = NULL;
+    
+    if (buf->flags & B_READAHEAD) {
+      if (remaining <= 0) {
+        buf->flags |= B_ERROR;
+      } else {
+        if (remaining < CLUSTER_SZ) {
+          memset(buf->data + remaining, 0, CLUSTER_SZ - remaining);
+        }
+      
+        buf->flags |= B_VALID;
+      }
+    
+      buf->flags &= ~(B_READ | B_ASYNC | B_READAHEAD);
+    } else if (buf->flags & B_WRITE) {
+      vnode = buf->vnode;
+      
+      if (--vnode->write_pending_cnt == 0) {
+        TaskWakeupAll(&vnode->rendez);
+      }
+
+      if (remaining < (ssize_t)head->siov[1 + t].size) {
+        Error("async write failed: %d", msg->reply_status);
+        vnode->flags |= V_WRITE_ERROR;
+        remaining -= CLUSTER_SZ;
+        bdwrite(buf);
+        continue;
+      }
+      
+      buf->flags &= ~B_WRITE;
+    }
+    
+    remaining -= CLUSTER_SZ;
+    brelse(buf);
+  }
+  
+  return 0;
 }
 
 
@@ -637,8 +1277,8 @@ int bdflush_brelse(struct Msg *msg)
  * @param   softclock_ticks,  softclock time to search for delwri blocks
  * @return  buf or NULL if no entries in the delayed-write queue
  *
- * This does not remove the Buf from the delayed write timing wheel and is
- * not marked as busy. The Buf is removed by calling unhash_delayed_write_buf().
+ * The Buf is removed from the delayed write timing wheel and the avail list
+ * and is marked as busy by unhash_delayed_write_buf().
  */
 struct Buf *find_delayed_write_buf(struct SuperBlock *sb, uint64_t softclock)
 {
@@ -650,15 +1290,141 @@ struct Buf *find_delayed_write_buf(struct SuperBlock *sb, uint64_t softclock)
   buf = LIST_HEAD(&sb->delwri_timing_wheel[hash]);
   
   while (buf != NULL) {  
-    if (buf->expiration_time <= softclock) {
-		  LIST_REM_ENTRY(&sb->delwri_timing_wheel[hash], buf, delwri_hash_link);
-		  buf->flags |= B_BUSY;
+    if (buf->expiration_time <= softclock && (buf->flags & B_BUSY) == 0) {
+      unhash_delayed_write_buf(sb, buf);
       return buf;
     }
     
-    LIST_NEXT(buf, delwri_hash_link);
+    buf = LIST_NEXT(buf, delwri_hash_link);
   }
   
   return NULL;
 }
 
+
+/* @brief   Take a dirty buf off the delayed write timing wheel for writing
+ *
+ * @param   sb, superblock the buf's file belongs to
+ * @param   buf, dirty buf that is not busy
+ *
+ * The buf is removed from the timing wheel, its file's dirty list and the
+ * avail list and marked busy until the write completes. 
+ */
+void unhash_delayed_write_buf(struct SuperBlock *sb, struct Buf *buf)
+{
+  KASSERT((buf->flags & B_BUSY) == 0);
+  KASSERT((buf->flags & (B_DELWRI | B_ASYNC)) != 0);
+  
+  remove_delayed_write_buf(buf);
+  LIST_REM_ENTRY(&buf_avail_list, buf, free_link);
+
+  buf->flags |= B_BUSY | B_WRITE;
+  buf->cluster_next = NULL;
+}
+
+
+/* @brief   Insert a dirty buf onto the delayed write timing wheel
+ *
+ * @param   buf, busy buf that has been written to
+ * @param   expiration_time, softclock time at which to write the buf
+ *
+ * A buf already on the timing wheel is moved to its new expiration time,
+ * otherwise it is also added to its file's dirty list.
+ */
+void hash_delayed_write_buf(struct Buf *buf, uint64_t expiration_time)
+{
+  struct SuperBlock *sb;
+  struct VNode *vnode;
+  uint32_t hash;
+
+  vnode = buf->vnode;
+  sb = vnode->superblock;
+
+  if (buf->flags & (B_DELWRI | B_ASYNC)) {
+    hash = buf->expiration_time % NR_DELWRI_BUCKETS;
+    LIST_REM_ENTRY(&sb->delwri_timing_wheel[hash], buf, delwri_hash_link);
+  } else {
+    LIST_ADD_TAIL(&vnode->dirty_buf_list, buf, dirty_link);
+  }
+  
+  buf->expiration_time = expiration_time;
+  hash = buf->expiration_time % NR_DELWRI_BUCKETS;
+  LIST_ADD_TAIL(&sb->delwri_timing_wheel[hash], buf, delwri_hash_link);
+}
+
+
+/* @brief   Remove a buf from the delayed write timing wheel and its file's dirty list
+ *
+ * @param   buf, buf to remove, nothing is done if the buf is not dirty
+ */
+void remove_delayed_write_buf(struct Buf *buf)
+{
+  struct SuperBlock *sb;
+  struct VNode *vnode;
+  uint32_t hash;
+  
+  if ((buf->flags & (B_DELWRI | B_ASYNC)) == 0) {
+    return;
+  }
+  
+  vnode = buf->vnode;
+  sb = vnode->superblock;
+  
+  hash = buf->expiration_time % NR_DELWRI_BUCKETS;
+  LIST_REM_ENTRY(&sb->delwri_timing_wheel[hash], buf, delwri_hash_link);
+  LIST_REM_ENTRY(&vnode->dirty_buf_list, buf, dirty_link);
+  buf->flags &= ~(B_DELWRI | B_ASYNC);
+}
+
+
+/* @brief   Extend a dirty buf into a run of adjacent dirty bufs of the same file
+ *
+ * @param   sb, superblock the buf's file belongs to
+ * @param   buf, busy dirty buf already removed from the timing wheel
+ * @return  first buf of the run, linked by cluster_next
+ *
+ * Dirty bufs either side of buf that are not busy are taken off the timing
+ * wheel early so that the run can be written with a single CMD_WRITE of up
+ * to MAX_CLUSTERS_PER_REQ clusters.
+ */
+struct Buf *gather_delayed_writes(struct SuperBlock *sb, struct Buf *buf)
+{
+  struct Buf *head;
+  struct Buf *tail;
+  struct Buf *adj;
+  struct VNode *vnode;
+  int nbufs;
+  
+  vnode = buf->vnode;
+  head = buf;
+  tail = buf;
+  nbufs = 1;
+  
+  while (nbufs < MAX_CLUSTERS_PER_REQ && tail->cluster_offset + CLUSTER_SZ < vnode->size) {
+    adj = findblk(vnode, tail->cluster_offset + CLUSTER_SZ);
+    
+    if (adj == NULL || (adj->flags & B_BUSY) || (adj->flags & (B_DELWRI | B_ASYNC)) == 0) {
+      break;
+    }
+    
+    unhash_delayed_write_buf(sb, adj);
+    tail->cluster_next = adj;
+    tail = adj;
+    nbufs++;
+  }
+  
+  while (nbufs < MAX_CLUSTERS_PER_REQ && head->cluster_offset >= CLUSTER_SZ) {
+    adj = findblk(vnode, head->cluster_offset - CLUSTER_SZ);
+    
+    if (adj == NULL || (adj->flags & B_BUSY) || (adj->flags & (B_DELWRI | B_ASYNC)) == 0) {
+      break;
+    }
+    
+    unhash_delayed_write_buf(sb, adj);
+    adj->cluster_next = head;
+    head = adj;
+    nbufs++;
+  }
+  
+  return head;
+}
@@ -15,8 +15,12 @@
  */
 
 /* @brief   Functions for using the Directory Name Lookup Cache
- *          FIXME: These have been removed until vnodes and their reference counting
- *          have been debugged.
+ *
+ * The DNLC maps a directory vnode and a filename to the vnode of the file,
+ * saving a lookup message to the filesystem handler for each pathname
+ * component. Negative entries with a NULL vnode record names that do not
+ * exist. Entries do not hold references, they are purged when a vnode is
+ * recycled for a different file.
  */
 
 //#define KDEBUG
@@ -30,153 +34,153 @@
 #include <sys/mount.h>
 
 
+// Static prototypes
+static uint32_t dname_calc_hash(struct VNode *dir, char *name);
+static struct DName *dname_find(struct VNode *dir, char *name, uint32_t hash);
+static void dname_unlink(struct DName *dname);
+
+
 /* @brief   Lookup a file in the Directory Name Lookup Cache
  *
- * Looks up a vnode in the DNLC based on parent directory vnode
- * and the filename. Stores the resulting vnode pointer in vnp.
+ * @param   dir, vnode of the directory containing the file
+ * @param   name, filename to lookup
+ * @param   vnp, set to the cached vnode or NULL for a negative entry
+ * @return  0 if the name is in the cache, -1 if it is not
  *
- * NOTE: For mount points or devices the "covered vnode" should be stored.
- *
- * TODO:  Add LOOKUP_NOCACHE flag handling  (should be in superblock->flags)
+ * The vnode is not referenced or locked, the caller gets it with
+ * vnode_get(). For mount points the covered vnode is stored.
  */
-
 int dname_lookup(struct VNode *dir, char *name, struct VNode **vnp)
 {
-  int t;
-  int sz;
-  int key;
+  uint32_t hash;
   struct DName *dname;
 
+  *vnp = NULL;
+
   if (dir->superblock->flags & MNT_NODNLC) {
-    *vnp = NULL;
     return -1;
   }
 
-  if ((sz = StrLen(name) + 1) > DNAME_SZ) {
-    *vnp = NULL;
+  if (StrLen(name) + 1 > DNAME_SZ) {
     return -1;
   }
 
-  for (key = 0, t = 0; t < sz && name[t] != '\0'; t++) {
-    key += name[t];
-  }
+  hash = dname_calc_hash(dir, name);
   
-  key %= DNAME_HASH;
-
-  dname = LIST_HEAD(&dname_hash[key]);
-
-  while (dname != NULL) {
-    if (dname->dir_vnode == dir && StrCmp(dname->name, name) == 0) {
-      // TODO: Replace with inode_nr, do a VNodeGet
-      *vnp = dname->vnode;
-      vnode_inc_ref(*vnp);
-      return 0;
-    }
-
-    dname = LIST_NEXT(dname, hash_link);
+  if ((dname = dname_find(dir, name, hash)) == NULL) {
+    return -1;
   }
 
-  *vnp = NULL;
-  return -1;
+  LIST_REM_ENTRY(&dname_lru_list, dname, lru_link);
+  LIST_ADD_TAIL(&dname_lru_list, dname, lru_link);
+
+  *vnp = dname->vnode;
+  return 0;
 }
 
 
 /* @brief   Add a filename and associated vnode to the Directory Name Lookup Cache
  *
- * Replaces existing entry, useful when negative caching and removing or adding file.
- * TODO: (Perhaps assert we are not replacing existing vnode with another valid
- * vnode).
+ * @param   dir, vnode of the directory containing the file
+ * @param   vn, vnode of the file or NULL to add a negative entry
+ * @param   name, filename
+ * @return  0 on success, -1 if the name cannot be cached
+ *
+ * Replaces an existing entry, e.g. a negative entry of a file being created.
+ * The least recently used entry is reused if the cache is full.
  */
 int dname_enter(struct VNode *dir, struct VNode *vn, char *name)
 {
-  int t;
-  int sz;
-  int key;
+  uint32_t hash;
   struct DName *dname;
 
   if (dir->superblock->flags & MNT_NODNLC) {
     return -1;
   }
 
-  if ((sz = StrLen(name) + 1) > DNAME_SZ) {
+  if (StrLen(name) + 1 > DNAME_SZ) {
     return -1;
   }
   
-  for (key = 0, t = 0; t < sz && name[t] != '\0'; t++) {
-    key += name[t];
-  }
+  hash = dname_calc_hash(dir, name);
   
-  key %= DNAME_HASH;
-
-  dname = LIST_HEAD(&dname_hash[key]);
-
-  while (dname != NULL) {
-    if (dname->dir_vnode == dir && StrCmp(dname->name, name) == 0) {
-      dname->hash_key = key;
-      dname->dir_vnode = dir;
-      dname->vnode = vn;
-      return 0;
+  if ((dname = dname_find(dir, name, hash)) != NULL) {
+    if (dname->vnode != NULL) {
+      LIST_REM_ENTRY(&dname->vnode->vnode_list, dname, vnode_link);
     }
+    
+    dname->vnode = vn;
 
-    dname = LIST_NEXT(dname, hash_link);
+    if (vn != NULL) {
+      LIST_ADD_TAIL(&vn->vnode_list, dname, vnode_link);
+    }
+    
+    LIST_REM_ENTRY(&dname_lru_list, dname, lru_link);
+    LIST_ADD_TAIL(&dname_lru_list, dname, lru_link);
+    return 0;
   }
 
   dname = LIST_HEAD(&dname_lru_list);
 
-  LIST_REM_HEAD(&dname_lru_list, lru_link);
-
   if (dname->hash_key != -1) {
-    LIST_REM_ENTRY(&dname_hash[dname->hash_key], dname, hash_link);
+    dname_unlink(dname);
   }
 
-  dname->hash_key = key;
+  LIST_REM_ENTRY(&dname_lru_list, dname, lru_link);
+
+  dname->hash = hash;
+  dname->hash_key = hash & (DNAME_HASH - 1);
   dname->dir_vnode = dir;
   dname->vnode = vn;
   StrLCpy(dname->name, name, DNAME_SZ);
 
   LIST_ADD_TAIL(&dname_lru_list, dname, lru_link);
-  LIST_ADD_HEAD(&dname_hash[key], dname, hash_link);
+  LIST_ADD_HEAD(&dname_hash[dname->hash_key], dname, hash_link);
+  LIST_ADD_TAIL(&dir->directory_list, dname, directory_link);
+
+  if (vn != NULL) {
+    LIST_ADD_TAIL(&vn->vnode_list, dname, vnode_link);
+  }
+  
   return 0;
 }
 
 
 /* @brief   Remove an entry from the Directory Name Lookup Cache
+ *
+ * @param   dir, vnode of the directory containing the file
+ * @param   name, filename being removed
+ * @return  0 on success, -1 if the name was not cached
+ *
+ * All other entries of the removed vnode are purged too, in case it is a
+ * directory or its vnode is reused by a later file with the same inode.
  */
 int dname_remove(struct VNode *dir, char *name)
 {
-  int t;
-  int sz;
-  int key;
+  uint32_t hash;
   struct DName *dname;
   
   if (dir->superblock->flags & MNT_NODNLC) {
     return -1;
   }
 
-  if ((sz = StrLen(name) + 1) > DNAME_SZ) {
+  if (StrLen(name) + 1 > DNAME_SZ) {
     return -1;
   }
 
-  for (key = 0, t = 0; t < sz && name[t] != '\0'; t++) {
-    key += name[t];
+  hash = dname_calc_hash(dir, name);
+  
+  if ((dname = dname_find(dir, name, hash)) == NULL) {
+    return -1;
   }
 
-  key %= DNAME_HASH;
-  dname = LIST_HEAD(&dname_hash[key]);
-
-  while (dname != NULL) {
-    if (StrCmp(dname->name, name) == 0) {
-      LIST_REM_ENTRY(&dname_hash[key], dname, hash_link);
-      dname->hash_key = -1;
-      LIST_REM_ENTRY(&dname_lru_list, dname, lru_link);
-      LIST_ADD_HEAD(&dname_lru_list, dname, lru_link);
-      return 0;
-    }
-
-    dname = LIST_NEXT(dname, hash_link);
+  if (dname->vnode != NULL) {
+    dname_purge_vnode(dname->vnode);
+  } else {
+    dname_unlink(dname);
   }
-
-  return -1;
+  
+  return 0;
 }
 
 
@@ -184,39 +188,39 @@ int dname_remove(struct VNode *dir, char *name)
  *
  * Removes any DNLC entry associated with a vnode, whether it is
  * a directory_vnode or the vnode it points to,
- * For example "/dir" "/dir/." "/dir/another/.." all point to same vnode
+ * For example "/dir" "/dir/." "/dir/another/.." all point to same vnode.
+ * Only the entries on the vnode's own lists are visited.
  */
 void dname_purge_vnode(struct VNode *vnode)
 {
-  int t;
-
-  for (t = 0; t < NR_DNAME; t++) {
-    if (dname_table[t].hash_key != -1 &&
-        (dname_table[t].vnode == vnode || dname_table[t].dir_vnode == vnode)) {
-      LIST_REM_ENTRY(&dname_hash[dname_table[t].hash_key], &dname_table[t],
-                     hash_link);
-      dname_table[t].hash_key = -1;
-      LIST_REM_ENTRY(&dname_lru_list, &dname_table[t], lru_link);
-      LIST_ADD_HEAD(&dname_lru_list, &dname_table[t], lru_link);
-    }
+  struct DName *dname;
+  
+  while ((dname = LIST_HEAD(&vnode->vnode_list)) != NULL) {
+    dname_unlink(dname);
+  }
+
+  while ((dname = LIST_HEAD(&vnode->directory_list)) != NULL) {
+    dname_unlink(dname);
   }
 }
 
 
 /* @brief   Remove all DNLC entries related to a specific superblock
  *
- * @param   sb,
+ * @param   sb, superblock being freed
+ *
+ * Called by free_superblock() when a filesystem is unmounted.
  */
 void dname_purge_superblock(struct SuperBlock *sb)
 {
   for (int t = 0; t < NR_DNAME; t++) {
-    if (dname_table[t].hash_key != -1 &&
-        (dname_table[t].vnode->superblock == sb)) {
-      LIST_REM_ENTRY(&dname_hash[dname_table[t].hash_key], &dname_table[t],
-                     hash_link);
-      dname_table[t].hash_key = -1;
-      LIST_REM_ENTRY(&dname_lru_list, &dname_table[t], lru_link);
-      LIST_ADD_HEAD(&dname_lru_list, &dname_table[t], lru_link);
+    if (dname_table[t].hash_key == -1) {
+      continue;
+    }
+    
+    if (dname_table[t].dir_vnode->superblock == sb
+        || (dname_table[t].vnode != NULL && dname_table[t].vnode->superblock == sb)) {
+      dname_unlink(&dname_table[t]);
     }
   }
 }
@@ -230,10 +234,71 @@ void dname_purge_superblock(struct SuperBlock *sb)
 void dname_purge_all(void)
 {
   for (int t = 0; t < NR_DNAME; t++) {
-    dname_table[t].hash_key = -1;
-    dname_table[t].vnode = NULL;
+    if (dname_table[t].hash_key != -1) {
+      dname_unlink(&dname_table[t]);
+    }
   }
+}
 
-  LIST_INIT(&dname_lru_list);
+
+/* @brief   Calculate the hash of a filename within a directory
+ *
+ * FNV-1a hash of the name, mixed with the address of the directory vnode
+ * so that common names such as "bin" or "lib" in different directories
+ * land in different buckets.
+ */
+static uint32_t dname_calc_hash(struct VNode *dir, char *name)
+{
+  uint32_t h = 2166136261u;
+  
+  while (*name != '\0') {
+    h ^= (uint8_t)*name++;
+    h *= 16777619u;
+  }
+  
+  h ^= (uint32_t)dir * 0x9E3779B1u;
+  h ^= h >> 16;
+  return h;
 }
 
+
+/* @brief   Find an entry in the DNLC hash table
+ */
+static struct DName *dname_find(struct VNode *dir, char *name, uint32_t hash)
+{
+  struct DName *dname;
+  
+  dname = LIST_HEAD(&dname_hash[hash & (DNAME_HASH - 1)]);
+
+  while (dname != NULL) {
+    if (dname->hash == hash && dname->dir_vnode == dir && StrCmp(dname->name, name) == 0) {
+      return dname;
+    }
+
+    dname = LIST_NEXT(dname, hash_link);
+  }
+
+  return NULL;
+}
+
+
+/* @brief   Remove an entry from the hash table and vnode lists
+ *
+ * The entry is moved to the head of the LRU list to be reused first.
+ */
+static void dname_unlink(struct DName *dname)
+{
+  LIST_REM_ENTRY(&dname_hash[dname->hash_key], dname, hash_link);
+  LIST_REM_ENTRY(&dname->dir_vnode->directory_list, dname, directory_link);
+  
+  if (dname->vnode != NULL) {
+    LIST_REM_ENTRY(&dname->vnode->vnode_list, dname, vnode_link);
+  }
+  
+  dname->hash_key = -1;
+  dname->dir_vnode = NULL;
+  dname->vnode = NULL;
+  
+  LIST_REM_ENTRY(&dname_lru_list, dname, lru_link);
+  LIST_ADD_HEAD(&dname_lru_list, dname, lru_link);
+}
@@ -38,6 +38,7 @@ char execargs_buf[MAX_ARGS_SZ];
 int do_exec(int fd, struct execargs *_args);
 static int check_elf_headers(int fd);
 static int load_process(struct Process *proc, int fd, void **entry_point);
+static int map_segment(int fd, Elf32_PHdr *phdr, uint32_t prot);
 ssize_t read_file (int fd, off_t offset, void *vaddr, size_t sz);
 ssize_t kread_file (int fd, off_t offset, void *vaddr, size_t sz);
 
@@ -134,6 +135,7 @@ int do_exec(int fd, struct execargs *_args)
   // FIXME: CloseOnExec (current_process);
   // FIXME: USigExec (current_process);
 
+  knote(&current->knote_list, NOTE_EXEC);
   arch_init_exec(current, entry_point, stack_pointer, &args);
   return 0;
 }
@@ -419,6 +421,16 @@ static int load_process(struct Process *proc, int fd, void **entry_point) {
 
 		Info ("section sec_addr:%08x sec_mem_sz:%08x", sec_addr, sec_mem_sz);
 
+    // Demand page the segment from the file cache if file and memory pages align
+    if ((phdr.p_offset % PAGE_SIZE) == (phdr.p_vaddr % PAGE_SIZE)) {
+      if ((rc = map_segment(fd, &phdr, sec_prot)) != 0) {
+        Error("Failed to map segment");
+        return rc;
+      }
+      
+      continue;
+    }
+
     if (sec_mem_sz != 0) {
       ret_addr = sys_virtualalloc(sec_addr, sec_mem_sz, PROT_READWRITE | PROT_EXEC | MAP_FIXED);
 
@@ -444,6 +456,79 @@ static int load_process(struct Process *proc, int fd, void **entry_point) {
 }
 
 
+/* @brief   Map a PT_LOAD segment of an executable
+ *
+ * @param   fd, file descriptor of the executable
+ * @param   phdr, program header of the segment
+ * @param   prot, protections of the segment
+ * @return  0 on success, negative errno on failure
+ *
+ * Whole pages of file data are mapped MAP_PRIVATE with mmap and are read on
+ * first touch by page_fault(). Read-only pages are the file cache's pages and
+ * are shared by all processes running the executable, writable pages are
+ * copy-on-write. Read-only pages already in the cache are mapped now. The
+ * page holding the end of the file data is read in when followed by bss so
+ * that the rest of it is zero. Remaining bss pages are anonymous memory.
+ */
+static int map_segment(int fd, Elf32_PHdr *phdr, uint32_t prot)
+{
+  vm_addr base;
+  vm_addr file_end;
+  vm_addr map_end;
+  vm_addr mem_end;
+  off_t offset;
+  void *ret_addr;
+  
+  base = ALIGN_DOWN(phdr->p_vaddr, PAGE_SIZE);
+  file_end = phdr->p_vaddr + phdr->p_filesz;
+  mem_end = ALIGN_UP(phdr->p_vaddr + phdr->p_memsz, PAGE_SIZE);
+  offset = phdr->p_offset - (phdr->p_vaddr - base);
+
+  if (phdr->p_memsz > phdr->p_filesz) {
+    map_end = ALIGN_DOWN(file_end, PAGE_SIZE);
+  } else {
+    map_end = ALIGN_UP(file_end, PAGE_SIZE);
+  }
+
+  if (map_end > base) {
+    ret_addr = sys_mmap((void *)base, map_end - base, prot, MAP_PRIVATE | MAP_FIXED, fd, offset);
+    
+    if ((vm_addr)ret_addr != base) {
+      Error("Failed to mmap segment");
+      return -ENOMEM;
+    }
+
+    // The file cannot be written while pages not yet copied are mapped
+    map_text_file(&get_current_process()->as, base);
+
+    // Text and read-only data of an executable already running are shared now
+    if (!(prot & PROT_WRITE)) {
+      prefault_mapped_file(&get_current_process()->as, base, map_end - base);
+    }
+  }
+  
+  if (mem_end > map_end) {
+    ret_addr = sys_virtualalloc((void *)map_end, mem_end - map_end, PROT_READWRITE | PROT_EXEC | MAP_FIXED);
+
+    if (ret_addr == NULL) {
+      Error("Failed to alloc fixed mem");
+      return -ENOMEM;
+    }
+    
+    if (file_end > map_end) {
+      if (read_file(fd, offset + (map_end - base), (void *)map_end, file_end - map_end) != file_end - map_end) {
+        Error("Failed to read file");
+        return -EIO;
+      }
+    }
+
+    sys_virtualprotect((void *)map_end, mem_end - map_end, prot);
+  }
+  
+  return 0;
+}
+
+
 /*
  *
  */
@@ -181,6 +181,9 @@ int do_close(struct Process *proc, int fd)
         } else {
           pipe->writer_cnt--;
         }
+        
+        // Other end sees EOF or a broken pipe
+        knote(&vnode->knote_list, NOTE_READABLE | NOTE_WRITABLE);
       }
     }
 
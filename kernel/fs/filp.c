@@ -107,6 +107,7 @@ struct Filp *alloc_filp(void)
   filp->reference_cnt = 1;
   filp->type = FILP_TYPE_UNDEF;
   memset(&filp->u, 0, sizeof filp->u);
+  memset(&filp->readahead, 0, sizeof filp->readahead);
   return filp;
 }
 
@@ -56,6 +56,10 @@ struct Rendez buf_list_rendez;
 
 buf_list_t buf_hash[BUF_HASH];
 buf_list_t buf_avail_list;
+buf_list_t buf_empty_list;
+int buf_page_cnt;
+int buf_page_limit;
+pageframe_list_t buf_spare_pf_list;     // Pages given up by bufs, reused before allocating
 
 /*
  * Directory Name Lookup Cache
@@ -74,7 +78,14 @@ kqueue_list_t kqueue_free_list;
 int max_knote;
 struct KNote *knote_table;
 knote_list_t knote_free_list;
-knote_list_t knote_hash[KNOTE_HASH_SZ];
+knote_list_t fs_knote_list;           // EVFILT_FS knotes for mount and unmount events
+
+/*
+ * Messages sent with sys_sendrec_async
+ */
+int max_asyncmsg;
+struct AsyncMsg *asyncmsg_table;
+asyncmsg_list_t asyncmsg_free_list;
 
 /*
  * TODO: VNode for sending system logs to a user-mode /procfs driver
@@ -50,7 +50,9 @@ static void InitFSLists(void)
   LIST_INIT(&free_superblock_list);
   LIST_INIT(&kqueue_free_list);
   LIST_INIT(&knote_free_list);
+  LIST_INIT(&fs_knote_list);
   LIST_INIT(&isr_handler_free_list);
+  LIST_INIT(&asyncmsg_free_list);
 
   // TODO: Need pagetables allocated for this file cache?
   // TODO Replace NR_VNODE, NR_FILP, NR_DNAME with computed variables max_vnode,
@@ -58,6 +60,12 @@ static void InitFSLists(void)
   // Perhaps get some params from kernel command line?
 
   for (int t = 0; t < NR_VNODE; t++) {
+    vnode_table[t].superblock = NULL;
+    LIST_INIT(&vnode_table[t].buf_list);
+    LIST_INIT(&vnode_table[t].dirty_buf_list);
+    LIST_INIT(&vnode_table[t].vnode_list);
+    LIST_INIT(&vnode_table[t].directory_list);
+    vnode_table[t].write_pending_cnt = 0;
     LIST_ADD_TAIL(&vnode_free_list, &vnode_table[t], vnode_entry);
   }
 
@@ -90,9 +98,10 @@ static void InitFSLists(void)
     LIST_ADD_TAIL(&isr_handler_free_list, &isr_handler_table[t], free_link);
   }
 
-  for (int t = 0; t < KNOTE_HASH_SZ; t++) {
-    LIST_INIT(&knote_hash[t]);
-  }  
+  for (int t = 0; t < max_asyncmsg; t++) {
+    asyncmsg_table[t].in_use = false;
+    LIST_ADD_TAIL(&asyncmsg_free_list, &asyncmsg_table[t], free_link);
+  }
 }
 
 
@@ -104,19 +113,26 @@ static void InitCache(void)
   vm_addr va;
 
   LIST_INIT(&buf_avail_list);
+  LIST_INIT(&buf_empty_list);
+  LIST_INIT(&buf_spare_pf_list);
 
+  buf_page_cnt = 0;
+  buf_page_limit = max_buf * (CLUSTER_SZ / PAGE_SIZE);
   va = CACHE_BASE_VA;
 
   for (int t = 0; t < max_buf; t++) {
     InitRendez(&buf_table[t].rendez);
-    buf_table[t].flags = 0;
+    buf_table[t].flags = B_FREE;
     buf_table[t].vnode = NULL;
-    buf_table[t].cluster_offset = 0;
+    buf_table[t].cluster_offset = -1;
     buf_table[t].data = (void *)va;
+    buf_table[t].mapped_cnt = 0;
+    buf_table[t].cluster_next = NULL;
 
     va += CLUSTER_SZ;
 
-    LIST_ADD_TAIL(&buf_avail_list, &buf_table[t], free_link);
+    // Pages are only mapped into a buf when getblk() grows the cache
+    LIST_ADD_TAIL(&buf_empty_list, &buf_table[t], free_link);
   }
 
   for (int t = 0; t < BUF_HASH; t++) {
@@ -26,6 +26,20 @@
 #include <kernel/globals.h>
 #include <kernel/dbg.h>
 #include <kernel/kqueue.h>
+#include <kernel/timer.h>
+#include <kernel/vm.h>
+
+
+// Static prototypes
+static int apply_kevent_change(struct KQueue *kqueue, struct kevent *ev);
+static bool knote_still_active(struct KNote *knote);
+static void activate_knote(struct KNote *knote, int hint);
+static bool knote_filter_event(struct KNote *knote, int hint);
+static bool knote_vnode_ready(struct VNode *vnode, int filter);
+static void knote_event(struct KNote *knote, struct kevent *ev);
+static int knote_timer_start(struct KNote *knote, intptr_t period);
+static void knote_timer_callback(struct Timer *timer);
+static void grow_knote_hash(struct KQueue *kqueue);
 
 
 /* @brief   Create a kqueue object in the current process
@@ -55,32 +69,53 @@ int sys_kqueue(void)
  * @param   nevents, size of eventlist array
  * @param   timeout, maximum time to wait to receive an event
  * @return  number of events copied into eventlist buffer or negative errno on error
+ *
+ * Changes and events are copied in and out KEVENT_BATCH_SZ at a time.
+ * EVFILT_READ and EVFILT_WRITE knotes are level-triggered and are queued
+ * again while the vnode stays ready, unless added with EV_CLEAR. Events
+ * that are no longer true by the time they are returned, e.g. messages
+ * already taken by an earlier getmsgv(), are dropped.
  */
 int sys_kevent(int fd, const struct kevent *changelist, int nchanges,
            struct	kevent *eventlist, int nevents, const struct timespec *_timeout)
 {
-  int nevents_returned;
-  struct kevent ev;
+  int nevents_returned = 0;
+  int batch_sz;
+  struct kevent evbuf[KEVENT_BATCH_SZ];
   struct KQueue *kqueue;
   struct KNote *knote;
   struct Process *current;
   struct timespec timeout;
+  knote_list_t requeue_list;
+  uint64_t expiration_us = 0;
   bool timeout_valid = false;
   bool timedout = false;
-  int sc;
+  int sc = 0;
   
   Info("sys_kevent(%d, nchanges:%d, nevents:%d", fd, nchanges, nevents);
   
   current = get_current_process();
 
   if (_timeout != NULL) {
-    CopyIn(&timeout, _timeout, sizeof timeout);
+    if (CopyIn(&timeout, _timeout, sizeof timeout) != 0) {
+      return -EFAULT;
+    }
+
+    if (timeout.tv_sec < 0 || timeout.tv_nsec < 0 || timeout.tv_nsec >= 1000000000) {
+      return -EINVAL;
+    }
+    
+    expiration_us = arch_read_hrclock() + timespec_to_microsecs(&timeout);
     timeout_valid = true;
     _timeout = NULL;
   }
   
   kqueue = get_kqueue(current, fd);
   
+  if (kqueue == NULL) {
+    return -EBADF;
+  }
+  
   while (kqueue->busy == true) {
     TaskSleep(&kqueue->busy_rendez);
   }
@@ -88,108 +123,102 @@ int sys_kevent(int fd, const struct kevent *changelist, int nchanges,
   
   // Processing of adding/removing/enabling and disabling events.  
   if (nchanges > 0 && changelist != NULL) {
-    for (int t = 0; t < nchanges; t++) {      
-      CopyIn(&ev, &changelist[t], sizeof ev);
+    for (int t = 0; t < nchanges; t += batch_sz) {
+      batch_sz = (nchanges - t < KEVENT_BATCH_SZ) ? nchanges - t : KEVENT_BATCH_SZ;
       
-      if (ev.filter < 0 || ev.filter >= EVFILT_SYSCOUNT
-          || ((ev.flags & (EV_ADD | EV_DELETE)) == (EV_ADD | EV_DELETE)) 
-          || ((ev.flags & (EV_ENABLE | EV_DISABLE)) == (EV_ENABLE | EV_DISABLE))) {
-        sc = -EINVAL;
-        goto exit;      
+      if (CopyIn(evbuf, &changelist[t], batch_sz * sizeof (struct kevent)) != 0) {
+        sc = -EFAULT;
+        goto exit;
       }
-      
-      knote = get_knote(kqueue, &ev);
 
-      if (ev.flags & EV_ADD) {
-        if (knote == NULL) {
-          if((ev.flags & EV_DISABLE) == 0) {
-            ev.flags |= EV_ENABLE;
-          }
-                    
-          knote = alloc_knote(kqueue, &ev);
-    
-          if (knote == NULL) {
-            sc = -ENOMEM;
-            goto exit;
-          }          
-        } else {
-          sc = -EEXIST;
-          goto exit;
-        }
-     }
-              
-     if (ev.flags & EV_DELETE) {
-        if (knote != NULL) {
-          disable_knote(kqueue, knote);
-          free_knote(kqueue, knote);
-          knote = NULL;
-          continue;        
-        } else {
-          sc = -ENOENT;
+      for (int b = 0; b < batch_sz; b++) {
+        if ((sc = apply_kevent_change(kqueue, &evbuf[b])) != 0) {
           goto exit;
         }
       }
-            
-      if (knote != NULL) {
-        if (ev.flags & EV_ENABLE) {
-          enable_knote(kqueue, knote);
-        }
-        
-        if (ev.flags & EV_DISABLE) {
-          disable_knote(kqueue, knote);
-        }
-      }
     }
   }
 
   changelist = NULL;
   
   // Processing of returned events.  
-  nevents_returned = 0;
-
   if (nevents > 0 && eventlist != NULL) {
-    while (LIST_HEAD(&kqueue->pending_list) == NULL) {
-      if (timeout_valid == true) {
-        if (TaskTimedSleep(&kqueue->event_rendez, &timeout) != 0) {
-          timedout = true;
-          break;         
-        }        
-      } else {
-        TaskSleep(&kqueue->event_rendez);
-      }      
-    }
+    LIST_INIT(&requeue_list);
     
-    if (timedout == false) {
-      while (nevents_returned < nevents) {
+    while (nevents_returned == 0 && timedout == false) {
+      while (LIST_HEAD(&kqueue->pending_list) == NULL) {
+        if (timeout_valid == true) {
+          if (arch_read_hrclock() >= expiration_us
+              || TaskSleepUntil(&kqueue->event_rendez, expiration_us) != 0) {
+            timedout = true;
+            break;         
+          }        
+        } else {
+          TaskSleep(&kqueue->event_rendez);
+        }      
+      }
+      
+      batch_sz = 0;
+      
+      while (timedout == false && nevents_returned + batch_sz < nevents) {
         knote = LIST_HEAD(&kqueue->pending_list);
-              
+                
         if (knote == NULL) {
           break;
         }
 
-        memset(&ev, 0, sizeof ev);
-        ev.ident = knote->ident;  
-        ev.filter = knote->filter;          
-        ev.flags  = knote->flags;
-        ev.fflags = knote->fflags;
-        ev.udata = knote->udata;
-        
-        CopyOut(&eventlist[nevents_returned], &ev, sizeof ev);
-        nevents_returned++;
-        
         LIST_REM_HEAD(&kqueue->pending_list, pending_link);
-        knote->pending = false;
         knote->on_pending_list = false;
-                
+        knote->pending = false;
+
+        if (knote_still_active(knote) == false) {
+          knote->hint = 0;
+          continue;
+        }
+        
+        knote_event(knote, &evbuf[batch_sz++]);
+                  
         if (knote->flags & EV_ONESHOT) {
           free_knote(kqueue, knote);
-        }    
+        } else if ((knote->filter == EVFILT_READ || knote->filter == EVFILT_WRITE)
+                   && (knote->flags & EV_CLEAR) == 0) {
+          // Level-triggered, checked again when it reaches the head of the list  
+          LIST_ADD_TAIL(&requeue_list, knote, pending_link);
+          knote->on_pending_list = true;
+          knote->pending = true;
+        }
+        
+        if (batch_sz == KEVENT_BATCH_SZ) {
+          if (CopyOut(&eventlist[nevents_returned], evbuf, batch_sz * sizeof (struct kevent)) != 0) {
+            sc = -EFAULT;
+          }
+
+          nevents_returned += batch_sz;
+          batch_sz = 0;
+        }
+      }
+
+      if (batch_sz > 0) {
+        if (CopyOut(&eventlist[nevents_returned], evbuf, batch_sz * sizeof (struct kevent)) != 0) {
+          sc = -EFAULT;
+        }
+        
+        nevents_returned += batch_sz;
       }
     }
+
+    while ((knote = LIST_HEAD(&requeue_list)) != NULL) {
+      LIST_REM_HEAD(&requeue_list, pending_link);
+      LIST_ADD_TAIL(&kqueue->pending_list, knote, pending_link);
+    }
   }
 
   eventlist = NULL;
 
+  if (sc != 0) {
+    goto exit;
+  }
+  
   kqueue->busy = false;
   TaskWakeup(&kqueue->busy_rendez);  
   
@@ -202,7 +231,8 @@ int sys_kevent(int fd, const struct kevent *changelist, int nchanges,
   return nevents_returned;
 
 exit:
-  // TODO: Any kevent cleanup
+  kqueue->busy = false;
+  TaskWakeup(&kqueue->busy_rendez);  
   
   Info("..sys_event error:%d", sc);
 
@@ -210,6 +240,64 @@ exit:
 }
 
 
+/* @brief   Apply a single change of a kevent() changelist
+ *
+ * @param   kqueue, kqueue being changed
+ * @param   ev, kevent copied in from the changelist
+ * @return  0 on success, negative errno on error
+ */
+static int apply_kevent_change(struct KQueue *kqueue, struct kevent *ev)
+{
+  struct KNote *knote;
+  
+  if (ev->filter < 0 || ev->filter >= EVFILT_SYSCOUNT
+      || ((ev->flags & (EV_ADD | EV_DELETE)) == (EV_ADD | EV_DELETE)) 
+      || ((ev->flags & (EV_ENABLE | EV_DISABLE)) == (EV_ENABLE | EV_DISABLE))) {
+    return -EINVAL;
+  }
+  
+  knote = get_knote(kqueue, ev);
+
+  if (ev->flags & EV_ADD) {
+    if (knote != NULL) {
+      return -EEXIST;
+    }
+    
+    if((ev->flags & EV_DISABLE) == 0) {
+      ev->flags |= EV_ENABLE;
+    }
+              
+    knote = alloc_knote(kqueue, ev);
+
+    if (knote == NULL) {
+      return -ENOMEM;
+    }          
+  }
+            
+  if (ev->flags & EV_DELETE) {
+    if (knote == NULL) {
+      return -ENOENT;
+    }
+    
+    disable_knote(kqueue, knote);
+    free_knote(kqueue, knote);
+    return 0;
+  }
+          
+  if (knote != NULL) {
+    if (ev->flags & EV_ENABLE) {
+      enable_knote(kqueue, knote);
+    }
+    
+    if (ev->flags & EV_DISABLE) {
+      disable_knote(kqueue, knote);
+    }
+  }
+  
+  return 0;
+}
+
+
 /* @brief   Close a kqueue file descriptor
  *
  * @param   proc,
@@ -230,24 +318,20 @@ int close_kqueue(struct Process *proc, int fd)
  * @param   knote_list, list of knotes attached to an object
  * @param   hint, a hint as to why the knote was added
  * @return  0 on success, negative errno on error
+ *
+ * Only the knotes whose filter is interested in the hint are raised, the
+ * EVFILT_READ, EVFILT_WRITE and EVFILT_VNODE knotes of a vnode share its
+ * knote list.
  */
 int knote(knote_list_t *knote_list, int hint)
 {
   struct KNote *knote;
-  struct KQueue *kqueue;
 
   knote = LIST_HEAD(knote_list);
   
   while(knote != NULL) {
-    knote->pending = true;
-    knote->hint = hint;
-
-    if (knote->enabled == true && knote->on_pending_list == false) {        
-      kqueue = knote->kqueue;      
-      LIST_ADD_TAIL(&kqueue->pending_list, knote, pending_link);
-      knote->on_pending_list = true;
-      
-      TaskWakeup(&kqueue->event_rendez);
+    if (knote_filter_event(knote, hint)) {
+      activate_knote(knote, hint);
     }
     
     knote = LIST_NEXT(knote, object_link);
@@ -257,19 +341,224 @@ int knote(knote_list_t *knote_list, int hint)
 }
 
 
+/* @brief   Detach all knotes from an object that is going away
+ *
+ * @param   knote_list, list of knotes attached to the object
+ * @param   hint, a hint as to why the knotes were detached, e.g. NOTE_EXIT
+ *
+ * Each knote is raised a final time with EV_EOF set and is freed once it
+ * has been returned by kevent().
+ */
+void knote_clear(knote_list_t *knote_list, int hint)
+{
+  struct KNote *knote;
+
+  while ((knote = LIST_HEAD(knote_list)) != NULL) {
+    LIST_REM_HEAD(knote_list, object_link);
+    knote->object = NULL;
+    knote->flags |= EV_EOF | EV_ONESHOT;
+    activate_knote(knote, hint);
+  }
+}
+
+
+/* @brief   Mark a knote as pending and queue it if it is enabled
+ */
+static void activate_knote(struct KNote *knote, int hint)
+{
+  struct KQueue *kqueue;
+  bool was_empty;
+
+  knote->pending = true;
+  knote->hint |= hint;
+
+  if (knote->enabled == true && knote->on_pending_list == false) {        
+    kqueue = knote->kqueue;      
+    was_empty = (LIST_HEAD(&kqueue->pending_list) == NULL);
+    LIST_ADD_TAIL(&kqueue->pending_list, knote, pending_link);
+    knote->on_pending_list = true;
+
+    // Only kevent() sleeps on event_rendez, and only while the list is empty
+    if (was_empty) {
+      TaskWakeup(&kqueue->event_rendez);
+    }
+  }
+}
+
+
+/* @brief   Check if the event of a pending knote is still true
+ *
+ * @param   knote, knote about to be returned by kevent()
+ * @return  false if the event has been consumed since the knote was raised
+ *
+ * Avoids returning a message port or readiness event to a server that has
+ * already drained the port or pipe while handling an earlier event.
+ */
+static bool knote_still_active(struct KNote *knote)
+{
+  struct SuperBlock *sb;
+  
+  if (knote->object == NULL) {
+    return true;
+  }
+  
+  switch (knote->filter) {
+    case EVFILT_READ:
+    case EVFILT_WRITE:
+      return knote_vnode_ready(knote->object, knote->filter);
+      
+    case EVFILT_MSGPORT:
+      sb = knote->object;
+      return (kpeekmsg(&sb->msgport) != NULL);
+    
+    default:
+      return true;
+  }
+}
+
+
+/* @brief   Check if a knote's filter is interested in a hint
+ */
+static bool knote_filter_event(struct KNote *knote, int hint)
+{
+  int vnode_hint;
+  
+  switch (knote->filter) {
+    case EVFILT_READ:
+      return (hint & NOTE_READABLE) ? true : false;
+    
+    case EVFILT_WRITE:
+      return (hint & NOTE_WRITABLE) ? true : false;
+      
+    case EVFILT_VNODE:
+      vnode_hint = hint & ~(NOTE_READABLE | NOTE_WRITABLE);
+      return (vnode_hint != 0 && (knote->fflags == 0 || (vnode_hint & knote->fflags)));
+      
+    case EVFILT_PROC:
+      return (hint & knote->fflags & NOTE_PCTRLMASK) ? true : false;
+      
+    case EVFILT_FS:
+      return (knote->fflags == 0 || (hint & knote->fflags));
+      
+    default:
+      return true;
+  }
+}
+
+
+/* @brief   Check if a vnode is ready for reading or writing
+ *
+ * @param   vnode, vnode of a pipe, character device or file
+ * @param   filter, EVFILT_READ or EVFILT_WRITE
+ * @return  true if a read or write would not block
+ *
+ * Character devices report their readiness with sys_knotei(), regular
+ * files are always ready.
+ */
+static bool knote_vnode_ready(struct VNode *vnode, int filter)
+{
+  struct Pipe *pipe;
+  
+  if (S_ISFIFO(vnode->mode)) {
+    pipe = vnode->pipe;
+    
+    if (filter == EVFILT_READ) {
+      return (pipe->data_sz > 0 || pipe->writer_cnt == 0);
+    } else {
+      return (pipe->free_sz >= PIPE_BUF || pipe->reader_cnt == 0);
+    }
+  } else if (S_ISCHR(vnode->mode)) {
+    if (filter == EVFILT_READ) {
+      return (vnode->poll_events & POLLIN) ? true : false;
+    } else {
+      return (vnode->poll_events & POLLOUT) ? true : false;
+    }
+  }
+  
+  return true;
+}
+
+
+/* @brief   Fill in the kevent returned for a pending knote
+ *
+ * @param   knote, knote being returned to the caller of kevent()
+ * @param   ev, kevent to fill in
+ *
+ * Pipes report the number of bytes that can be read or written and EV_EOF
+ * once the other end is closed. Timers report the number of expirations
+ * since the knote was last returned.
+ */
+static void knote_event(struct KNote *knote, struct kevent *ev)
+{
+  struct VNode *vnode;
+  struct Pipe *pipe;
+  
+  memset(ev, 0, sizeof *ev);
+  ev->ident = knote->ident;  
+  ev->filter = knote->filter;          
+  ev->flags  = knote->flags;
+  ev->fflags = knote->fflags;
+  ev->data = knote->data;
+  ev->udata = knote->udata;
+
+  switch (knote->filter) {
+    case EVFILT_READ:
+    case EVFILT_WRITE:
+      vnode = knote->object;
+      
+      if (vnode != NULL && S_ISFIFO(vnode->mode)) {
+        pipe = vnode->pipe;
+        
+        if (knote->filter == EVFILT_READ) {
+          ev->data = (void *)pipe->data_sz;
+          
+          if (pipe->writer_cnt == 0) {
+            ev->flags |= EV_EOF;
+          }
+        } else {
+          ev->data = (void *)pipe->free_sz;
+          
+          if (pipe->reader_cnt == 0) {
+            ev->flags |= EV_EOF;
+          }
+        }
+      }
+      break;
+      
+    case EVFILT_VNODE:
+    case EVFILT_FS:
+      ev->fflags = (knote->fflags != 0) ? (knote->hint & knote->fflags) : knote->hint;
+      break;
+      
+    case EVFILT_PROC:
+      ev->fflags = knote->hint & knote->fflags & NOTE_PCTRLMASK;
+      break;
+      
+    case EVFILT_TIMER:
+      knote->data = NULL;
+      break;
+      
+    default:
+      break;
+  }
+  
+  knote->hint = 0;
+}
+
+
 /*
  *
  */
 struct KNote *get_knote(struct KQueue *kq, struct kevent *ev)
 {
-  uint16_t hash;
+  int hash;
   struct KNote *knote;
   
   hash = knote_calc_hash(kq, ev->ident, ev->filter);
-  knote = LIST_HEAD(&knote_hash[hash]);
+  knote = LIST_HEAD(&kq->hash[hash]);
   
   while (knote != NULL) {
-    if (knote->kqueue == kq && knote->ident == ev->ident && knote->filter == ev->filter) {
+    if (knote->ident == ev->ident && knote->filter == ev->filter) {
       return knote;
     }
 
@@ -375,6 +664,14 @@ struct KQueue *alloc_kqueue(void)
   
   LIST_INIT(&kqueue->knote_list);
   LIST_INIT(&kqueue->pending_list);
+
+  for (int t = 0; t < KQUEUE_HASH_MIN_SZ; t++) {
+    LIST_INIT(&kqueue->hash_min[t]);
+  }
+
+  kqueue->hash = kqueue->hash_min;
+  kqueue->hash_sz = KQUEUE_HASH_MIN_SZ;
+  kqueue->knote_cnt = 0;
   
   return kqueue;
 }
@@ -385,10 +682,21 @@ struct KQueue *alloc_kqueue(void)
  */
 void free_kqueue(struct KQueue *kqueue)
 {
+  struct KNote *knote;
+  
   kqueue->reference_cnt--;
   
   if (kqueue->reference_cnt == 0) {
-    // TODO: We need to detach any knotes from the kqueue before freeing it.
+    while ((knote = LIST_HEAD(&kqueue->knote_list)) != NULL) {
+      free_knote(kqueue, knote);
+    }
+
+    if (kqueue->hash != kqueue->hash_min) {
+      kfree_page(kqueue->hash);
+      kqueue->hash = kqueue->hash_min;
+      kqueue->hash_sz = KQUEUE_HASH_MIN_SZ;
+    }
+    
     LIST_ADD_HEAD(&kqueue_free_list, kqueue, free_link);
   }
 }
@@ -405,6 +713,8 @@ struct KNote *alloc_knote(struct KQueue *kqueue, struct kevent *ev)
   struct SuperBlock *sb;
   struct VNode *vnode;
   struct ISRHandler *isrhandler;
+  struct AsyncMsg *amsg;
+  struct Process *proc;
   struct Process *current;
   
   current = get_current_process();
@@ -430,17 +740,24 @@ struct KNote *alloc_knote(struct KQueue *kqueue, struct kevent *ev)
   knote->enabled = false;
   knote->pending = false;
   knote->on_pending_list = false;  // FIXME: Can't we get this if pending and enabled is true ?
+  knote->hint = 0;
   
   knote->object = NULL;
+  knote->timer.armed = false;
+  knote->timer.bottom_half = false;
+
+  if (kqueue->knote_cnt >= kqueue->hash_sz * KQUEUE_HASH_LOAD) {
+    grow_knote_hash(kqueue);
+  }
 
   LIST_ADD_TAIL(&kqueue->knote_list, knote, kqueue_link);  
   hash = knote_calc_hash(kqueue, knote->ident, knote->filter);
-  LIST_ADD_TAIL(&knote_hash[hash], knote, hash_link);
+  LIST_ADD_TAIL(&kqueue->hash[hash], knote, hash_link);
+  kqueue->knote_cnt++;
     
   switch (knote->filter) {
     case EVFILT_READ:
     case EVFILT_WRITE:
-    // TODO: Add EVFILT_FS for mount/unmount events    
     case EVFILT_VNODE:
       vnode = get_fd_vnode(current, knote->ident);
       
@@ -452,12 +769,30 @@ struct KNote *alloc_knote(struct KQueue *kqueue, struct kevent *ev)
       }
       break;
       
+    case EVFILT_FS:
+      knote->object = &fs_knote_list;
+      LIST_ADD_TAIL(&fs_knote_list, knote, object_link);
+      break;
+      
     case EVFILT_AIO:
       sc = -ENOSYS;
       break;
 
     case EVFILT_PROC:
-      sc = -ENOSYS;
+      proc = GetProcess(knote->ident);
+      
+      if (proc == NULL || proc->in_use == false) {
+        sc = -ESRCH;
+      } else if (proc->state == PROC_STATE_ZOMBIE) {
+        // Already exited, report it as soon as the knote is enabled
+        knote->data = (void *)proc->exit_status;
+        knote->flags |= EV_EOF | EV_ONESHOT;
+        knote->pending = true;
+        knote->hint = NOTE_EXIT;
+      } else {
+        knote->object = proc;
+        LIST_ADD_TAIL(&proc->knote_list, knote, object_link);
+      }
       break;
       
     case EVFILT_SIGNAL:    
@@ -465,7 +800,7 @@ struct KNote *alloc_knote(struct KQueue *kqueue, struct kevent *ev)
       break;
       
     case EVFILT_TIMER:
-      sc = -ENOSYS;
+      sc = knote_timer_start(knote, (intptr_t)ev->data);
       break;
       
     case EVFILT_NETDEV:
@@ -497,6 +832,17 @@ struct KNote *alloc_knote(struct KQueue *kqueue, struct kevent *ev)
       }
       
       break;
+
+    case EVFILT_MSGREPLY:
+      amsg = get_asyncmsg(current, knote->ident);
+      
+      if (amsg) {
+        knote->object = amsg;
+        LIST_ADD_TAIL(&amsg->knote_list, knote, object_link);
+      } else {
+        sc = -EINVAL;
+      }
+      break;
       
     default:
       sc = -ENOSYS;
@@ -518,24 +864,24 @@ struct KNote *alloc_knote(struct KQueue *kqueue, struct kevent *ev)
  * @param   kqueue,
  * @param   knote,
  *
- * Removes the knote from the kqueue and the object's knote list 
+ * Removes the knote from the kqueue and the object's knote list. Knotes
+ * detached by knote_clear() no longer have an object.
  */
 void free_knote(struct KQueue *kqueue, struct KNote *knote)
 {
   int hash;
+  int_state_t int_state;
   struct SuperBlock *sb;
   struct VNode *vnode;
   struct ISRHandler *isrhandler;
-  struct Process *current;
-  
-  current = get_current_process();
+  struct AsyncMsg *amsg;
+  struct Process *proc;
   
   switch (knote->filter) {
     case EVFILT_READ:
     case EVFILT_WRITE:
-    // TODO: ADd EVFILT_FS for mount/unmount events
     case EVFILT_VNODE:
-      vnode = get_fd_vnode(current, knote->ident);
+      vnode = knote->object;
       
       if (vnode) {
         knote->object = NULL;
@@ -543,16 +889,32 @@ void free_knote(struct KQueue *kqueue, struct KNote *knote)
       }
       break;
       
+    case EVFILT_FS:
+      if (knote->object) {
+        knote->object = NULL;
+        LIST_REM_ENTRY(&fs_knote_list, knote, object_link);
+      }
+      break;
+      
     case EVFILT_AIO:
       break;
 
     case EVFILT_PROC:
+      proc = knote->object;
+      
+      if (proc) {
+        knote->object = NULL;
+        LIST_REM_ENTRY(&proc->knote_list, knote, object_link);
+      }
       break;
       
     case EVFILT_SIGNAL:    
       break;
       
     case EVFILT_TIMER:
+      int_state = SpinLockIRQSave(&timer_slock);
+      disarm_timer(&knote->timer);
+      SpinUnlockIRQRestore(int_state, &timer_slock);
       break;
       
     case EVFILT_NETDEV:
@@ -562,7 +924,7 @@ void free_knote(struct KQueue *kqueue, struct KNote *knote)
       break;
       
     case EVFILT_IRQ:
-      isrhandler = get_isrhandler(current, knote->ident);
+      isrhandler = knote->object;
       
       if (isrhandler) {
         knote->object = NULL;
@@ -571,13 +933,26 @@ void free_knote(struct KQueue *kqueue, struct KNote *knote)
       break;
       
     case EVFILT_MSGPORT:
-      sb = get_superblock(current, knote->ident);
+      sb = knote->object;
       
       if (sb) {
         knote->object = NULL;
         LIST_REM_ENTRY(&sb->msgport.knote_list, knote, object_link);
       }
       break;
+
+    case EVFILT_MSGREPLY:
+      amsg = knote->object;
+      
+      if (amsg) {
+        knote->object = NULL;
+        LIST_REM_ENTRY(&amsg->knote_list, knote, object_link);
+        
+        if (amsg->replied && LIST_HEAD(&amsg->knote_list) == NULL) {
+          free_asyncmsg(amsg);
+        }
+      }
+      break;
       
     default:
       break;
@@ -592,7 +967,8 @@ void free_knote(struct KQueue *kqueue, struct KNote *knote)
   LIST_REM_ENTRY(&kqueue->knote_list, knote, kqueue_link);  
 
   hash = knote_calc_hash(kqueue, knote->ident, knote->filter);
-  LIST_REM_ENTRY(&knote_hash[hash], knote, hash_link);
+  LIST_REM_ENTRY(&kqueue->hash[hash], knote, hash_link);
+  kqueue->knote_cnt--;
 
   LIST_ADD_HEAD(&knote_free_list, knote, link);
 }
@@ -600,22 +976,15 @@ void free_knote(struct KQueue *kqueue, struct KNote *knote)
 
 /* @brief   Enable an existing knote
  *
- * TODO: Check if we need to raise any pending events,
- * e.g. if file has data in buffer for reading or
- * if message is already on message port.
- *
- * check if knote was previously on pending list, else
- * also check if object's state would raise a pending event.
+ * If an event arrived while the knote was disabled it is queued, otherwise
+ * the state of the object is checked in case it would already raise an
+ * event, e.g. data in a pipe or a message already on a message port.
  */
 void enable_knote(struct KQueue *kqueue, struct KNote *knote)
 {
-  struct Process *current;
   struct SuperBlock *sb;
   struct VNode *vnode;
-  struct ISRHandler *isrhandler;
-  struct MsgPort *msgport;
-  
-  current = get_current_process();
+  struct AsyncMsg *amsg;
   
   if (knote->enabled == true) {
     return;
@@ -639,51 +1008,27 @@ void enable_knote(struct KQueue *kqueue, struct KNote *knote)
   {
     case EVFILT_READ:
     case EVFILT_WRITE:
-    // TODO: ADd EVFILT_FS for mount/unmount events
-    case EVFILT_VNODE:
-      vnode = get_fd_vnode(current, knote->ident);
+      vnode = knote->object;
       
-      if (vnode) {
+      if (vnode && knote_vnode_ready(vnode, knote->filter)) {
+        activate_knote(knote, (knote->filter == EVFILT_READ) ? NOTE_READABLE : NOTE_WRITABLE);
       }
       break;
       
-    case EVFILT_AIO:
-      break;
-
-    case EVFILT_PROC:
-      break;
-      
-    case EVFILT_SIGNAL:    
-      break;
-      
-    case EVFILT_TIMER:
-      break;
-      
-    case EVFILT_NETDEV:
-      break;
-      
-    case EVFILT_USER:
-      break;
-      
-    case EVFILT_IRQ:
-      isrhandler = get_isrhandler(current, knote->ident);
-      
-      if (isrhandler) {
-      }      
-      break;
-      
     case EVFILT_MSGPORT:
       // Check if there is already a message on port
-      sb = get_superblock(current, knote->ident);
+      sb = knote->object;
       
-      if (sb) {
-        msgport = &sb->msgport;
-  
-        if (kpeekmsg(msgport) != NULL) {
-          knote->pending = true;           
-          LIST_ADD_TAIL(&kqueue->pending_list, knote, pending_link);
-          knote->on_pending_list = true;
-        }        
+      if (sb && kpeekmsg(&sb->msgport) != NULL) {
+        activate_knote(knote, NOTE_MSG);
+      }
+      break;
+
+    case EVFILT_MSGREPLY:
+      amsg = knote->object;
+      
+      if (amsg && amsg->replied) {
+        activate_knote(knote, NOTE_MSG);
       }
       break;
       
@@ -713,9 +1058,132 @@ void disable_knote(struct KQueue *kqueue, struct KNote *knote)
 
 
 /* @brief   Calculate a hash value for looking up a knote
+ *
+ * Multiplicative hash of the ident and filter so that the small, dense
+ * file descriptor numbers of a process spread over all of the buckets.
  */
 int knote_calc_hash(struct KQueue *kq, int ident, int filter)
 {
-  return ((ident << 8) | filter) % KNOTE_HASH_SZ;
+  uint32_t h;
+  
+  h = ((uint32_t)ident * 0x9E3779B1u) ^ ((uint32_t)filter * 0x85EBCA6Bu);
+  h ^= h >> 16;
+  return h & (kq->hash_sz - 1);
 }
 
+
+/* @brief   Grow the knote hash of a kqueue
+ *
+ * @param   kqueue, kqueue whose hash has reached its load factor
+ *
+ * The buckets embedded in the kqueue are replaced by a page of buckets and
+ * the knotes are rehashed. Nothing is done if the hash already fills a page
+ * or no page is available, lookups then fall back to longer chains.
+ */
+static void grow_knote_hash(struct KQueue *kqueue)
+{
+  knote_list_t *hash;
+  struct KNote *knote;
+  int h;
+  
+  if (kqueue->hash != kqueue->hash_min) {
+    return;
+  }
+  
+  if ((hash = kmalloc_page()) == NULL) {
+    return;
+  }
+  
+  kqueue->hash = hash;
+  kqueue->hash_sz = PAGE_SIZE / sizeof (knote_list_t);
+  
+  for (int t = 0; t < kqueue->hash_sz; t++) {
+    LIST_INIT(&hash[t]);
+  }
+  
+  knote = LIST_HEAD(&kqueue->knote_list);
+  
+  while (knote != NULL) {
+    h = knote_calc_hash(kqueue, knote->ident, knote->filter);
+    LIST_ADD_TAIL(&hash[h], knote, hash_link);
+    knote = LIST_NEXT(knote, kqueue_link);
+  }
+}
+
+
+/* @brief   Arm the timer of an EVFILT_TIMER knote
+ *
+ * @param   knote, knote of an EVFILT_TIMER filter
+ * @param   period, period of the timer in the units given by the
+ *          NOTE_SECONDS, NOTE_USECONDS or NOTE_NSECONDS fflags, defaults
+ *          to milliseconds
+ * @return  0 on success, negative errno on error
+ *
+ * The timer is periodic unless the knote was added with EV_ONESHOT.
+ */
+static int knote_timer_start(struct KNote *knote, intptr_t period)
+{
+  int_state_t int_state;
+  uint64_t period_us;
+  
+  if (period <= 0) {
+    return -EINVAL;
+  }
+
+  if (knote->fflags & NOTE_SECONDS) {
+    period_us = (uint64_t)period * 1000000;
+  } else if (knote->fflags & NOTE_USECONDS) {
+    period_us = period;
+  } else if (knote->fflags & NOTE_NSECONDS) {
+    period_us = ((uint64_t)period + 999) / 1000;
+  } else {
+    period_us = (uint64_t)period * 1000;
+  }
+
+  knote->data = NULL;
+  knote->timer_period_us = period_us;
+  knote->timer.callback = knote_timer_callback;
+  knote->timer.arg = knote;
+  knote->timer.process = get_current_process();
+  knote->timer.bottom_half = true;    // knote lists are protected by the BKL
+
+  int_state = SpinLockIRQSave(&timer_slock);
+  knote->timer_next_us = arch_read_hrclock() + period_us;
+  arm_timeout(&knote->timer, knote->timer_next_us);
+  SpinUnlockIRQRestore(int_state, &timer_slock);
+
+  return 0;
+}
+
+
+/* @brief   Timer callback of an EVFILT_TIMER knote
+ *
+ * Called by the timer bottom half. The data of the knote counts the
+ * expirations, including any periods missed while the system was busy,
+ * until it is returned by kevent().
+ */
+static void knote_timer_callback(struct Timer *timer)
+{
+  int_state_t int_state;
+  struct KNote *knote;
+  uint64_t now;
+  uint64_t expirations = 1;
+  
+  knote = timer->arg;
+  now = arch_read_hrclock();
+  
+  if (now > knote->timer_next_us) {
+    expirations += (now - knote->timer_next_us) / knote->timer_period_us;
+  }
+  
+  knote->timer_next_us += expirations * knote->timer_period_us;
+  knote->data = (void *)((intptr_t)knote->data + (intptr_t)expirations);
+
+  if ((knote->flags & EV_ONESHOT) == 0) {
+    int_state = SpinLockIRQSave(&timer_slock);
+    arm_timeout(timer, knote->timer_next_us);
+    SpinUnlockIRQRestore(int_state, &timer_slock);
+  }
+  
+  activate_knote(knote, 0);
+}
@@ -323,6 +323,10 @@ bool is_last_component(struct lookupdata *ld)
  *
  * Update lock on new component, release lock on old component
  *
+ * The DNLC is checked before sending a lookup message to the filesystem
+ * handler. The result of the message, including a name that does not
+ * exist, is added to the DNLC.
+ *
  * @param lookup - Lookup state
  * @param name - Filename to lookup
  * @return 
@@ -330,6 +334,7 @@ bool is_last_component(struct lookupdata *ld)
 int walk_component(struct lookupdata *ld)
 {
   struct VNode *covered_vnode;
+  struct VNode *cached_vnode;
   struct VNode *vnode_mounted_here;
   int rc;
 
@@ -365,9 +370,30 @@ int walk_component(struct lookupdata *ld)
   }
   
   KASSERT(ld->parent != NULL);
+
+  if (dname_lookup(ld->parent, ld->last_component, &cached_vnode) == 0) {
+    if (cached_vnode == NULL) {
+      return -ENOENT;
+    } else if (cached_vnode == ld->parent) {
+      vnode_inc_ref(cached_vnode);
+      ld->vnode = cached_vnode;
+    } else {
+      ld->vnode = vnode_get(cached_vnode->superblock, cached_vnode->inode_nr);
+    }
+  }
+  
+  if (ld->vnode == NULL) {
+    rc = vfs_lookup(ld->parent, ld->last_component, &ld->vnode);
     
-  if ((rc = vfs_lookup(ld->parent, ld->last_component, &ld->vnode)) != 0) {
-    return rc;
+    if (rc == -ENOENT) {
+      dname_enter(ld->parent, NULL, ld->last_component);
+    }
+    
+    if (rc != 0) {
+      return rc;
+    }
+
+    dname_enter(ld->parent, ld->vnode, ld->last_component);
   }
   
   vnode_mounted_here = ld->vnode->vnode_mounted_here;
@@ -0,0 +1,775 @@
+/*
+ * Copyright 2014  Marven Gilhespie
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Memory mapped files.
+ *
+ * Pages of a mapped file are the pages of the bufs in the VFS file cache,
+ * they are mapped into the process on demand by page_fault(). A buf with
+ * pages mapped into a process is not recycled by getblk() or reclaimed
+ * until it is unmapped, the pageframe's reference_cnt counts the mappings
+ * of a page and the buf's mapped_cnt the mappings of all of its pages.
+ *
+ * MAP_PRIVATE mappings with PROT_WRITE map the buf pages copy-on-write, a
+ * write fault copies the page into an anonymous MEM_ALLOC page. MAP_SHARED
+ * mappings with PROT_WRITE are mapped read-only until the first write, which
+ * marks the buf as a delayed-write. Pages still writable when unmapped are
+ * marked as delayed-writes again so later changes reach the file.
+ *
+ * Buf pages are also loaned to servers by the message passing system calls
+ * for IOVs flagged IOV_ZEROCOPY. A loaned page is a MEM_FILE page outside
+ * of any file mapping. It is mapped copy-on-write and pins its buf in the
+ * same way until it is unmapped or copied by a write fault. A loan is not a
+ * snapshot, it reflects later writes to the cached file until the process
+ * writes to the page.
+ *
+ * The segments of an executable are private mappings marked MF_TEXT by
+ * exec. Pages not yet copied would see writes to the file, so writes and
+ * truncation of a file mapped as text fail with -ETXTBSY.
+ */
+
+//#define KDEBUG
+
+#include <kernel/dbg.h>
+#include <kernel/error.h>
+#include <kernel/filesystem.h>
+#include <kernel/globals.h>
+#include <kernel/proc.h>
+#include <kernel/types.h>
+#include <kernel/utility.h>
+#include <kernel/vm.h>
+#include <string.h>
+#include <sys/mman.h>
+
+
+// Static prototypes
+static struct MappedFile *find_mapped_file(struct AddressSpace *as, vm_addr addr);
+static struct MappedFile *alloc_mapped_file(struct AddressSpace *as);
+static bits32_t file_page_flags(struct MappedFile *mf, bits32_t access);
+static int copy_file_page(struct AddressSpace *as, bits32_t prot,
+                          vm_addr addr, vm_addr src_pa, bool replace);
+static int loan_page_fault(struct AddressSpace *as, vm_addr addr, bits32_t access);
+static int dirty_file_page(struct MappedFile *mf, vm_addr addr, vm_addr pa);
+
+
+/* @brief   Map a file into the address space of the current process
+ *
+ * @param   _addr, hint or fixed address (with MAP_FIXED) to map the file at
+ * @param   len, length of the mapping
+ * @param   prot, PROT_READ, PROT_WRITE, PROT_EXEC protections
+ * @param   flags, MAP_SHARED or MAP_PRIVATE and optionally MAP_FIXED or MAP_ANON
+ * @param   fd, file descriptor of a regular file to map
+ * @param   offset, page-aligned offset within the file
+ * @return  address of the mapping or negative errno cast to a pointer on failure
+ *
+ * MAP_ANON mappings are allocated with sys_virtualalloc(). No pages of a
+ * file mapping are mapped until they are accessed.
+ */
+void *sys_mmap(void *_addr, size_t len, int prot, int flags, int fd, off_t offset)
+{
+  struct Process *current;
+  struct AddressSpace *as;
+  struct VNode *vnode;
+  struct MappedFile *mf;
+  vm_addr addr;
+
+  Info("sys_mmap(addr:%08x, len:%d, prot:%08x, flags:%08x, fd:%d, offset:%d)",
+        (uint32_t)_addr, len, prot, flags, fd, (int)offset);
+
+  current = get_current_process();
+  as = &current->as;
+
+  if (len == 0) {
+    return (void *)-EINVAL;
+  }
+
+  if (flags & MAP_ANON) {
+    addr = (vm_addr)sys_virtualalloc(_addr, len, (prot & PROT_MASK) | (flags & MAP_FIXED));
+    return (addr != (vm_addr)NULL) ? (void *)addr : (void *)-ENOMEM;
+  }
+
+  if ((flags & (MAP_SHARED | MAP_PRIVATE)) == 0
+      || (flags & (MAP_SHARED | MAP_PRIVATE)) == (MAP_SHARED | MAP_PRIVATE)) {
+    return (void *)-EINVAL;
+  }
+
+  if (offset < 0 || (offset % PAGE_SIZE) != 0) {
+    return (void *)-EINVAL;
+  }
+
+  if ((vnode = get_fd_vnode(current, fd)) == NULL) {
+    return (void *)-EBADF;
+  }
+
+  if (!S_ISREG(vnode->mode)) {
+    return (void *)-ENODEV;
+  }
+
+  if (is_allowed(vnode, R_OK) != 0) {
+    return (void *)-EACCES;
+  }
+
+  if ((flags & MAP_SHARED) && (prot & PROT_WRITE) && is_allowed(vnode, W_OK) != 0) {
+    return (void *)-EACCES;
+  }
+
+  if ((flags & MAP_SHARED) && (prot & PROT_WRITE) && vnode->text_cnt > 0) {
+    return (void *)-ETXTBSY;
+  }
+
+  if ((mf = alloc_mapped_file(as)) == NULL) {
+    return (void *)-ENOMEM;
+  }
+
+  addr = ALIGN_DOWN((vm_addr)_addr, PAGE_SIZE);
+  len = ALIGN_UP(len, PAGE_SIZE);
+  addr = segment_create(as, addr, len, SEG_TYPE_FILE, flags & MAP_FIXED);
+
+  if (addr == (vm_addr)NULL) {
+    return (void *)-ENOMEM;
+  }
+
+  vnode_inc_ref(vnode);
+
+  mf->base = addr;
+  mf->size = len;
+  mf->vnode = vnode;
+  mf->offset = offset;
+  mf->flags = (prot & PROT_MASK) | (flags & (MAP_SHARED | MAP_PRIVATE));
+
+  Info("%08x = sys_mmap", addr);
+  return (void *)addr;
+}
+
+
+/* @brief   Unmap an area of the address space
+ *
+ * @param   _addr, start address of the area to unmap
+ * @param   len, length of the area to unmap
+ * @return  0 on success, negative errno on failure
+ *
+ * Unmaps any mapped file pages and anonymous memory within the area. File
+ * mappings partially covered by the area are trimmed or split.
+ */
+int sys_munmap(void *_addr, size_t len)
+{
+  struct Process *current;
+  struct AddressSpace *as;
+  struct MappedFile *mf;
+  struct Pageframe *pf;
+  vm_addr addr;
+  vm_addr ceiling;
+  vm_addr va;
+  vm_addr pa;
+  bits32_t flags;
+  bool split = false;
+
+  current = get_current_process();
+  as = &current->as;
+  addr = ALIGN_DOWN((vm_addr)_addr, PAGE_SIZE);
+  len = ALIGN_UP(len, PAGE_SIZE);
+  ceiling = addr + len;
+
+  if (len == 0 || ceiling < addr || ceiling > VM_USER_CEILING) {
+    return -EINVAL;
+  }
+
+  // Unmapping the middle of a file mapping needs a free entry for the tail
+  for (int t = 0; t < NMAPPEDFILE; t++) {
+    mf = &as->mapped_file_table[t];
+
+    if (mf->vnode != NULL && mf->base < addr && mf->base + mf->size > ceiling) {
+      split = true;
+    }
+  }
+
+  if (split && find_mapped_file(as, (vm_addr)NULL) == NULL) {
+    return -ENOMEM;
+  }
+
+  for (va = addr; va < ceiling; va += PAGE_SIZE) {
+    if (pmap_extract(as, va, &pa, &flags) != 0) {
+      continue;
+    }
+
+    if ((flags & MEM_MASK) == MEM_FILE) {
+      unmap_file_page(as, va, pa, flags);
+      pmap_remove(as, va);
+    } else if ((flags & MEM_MASK) == MEM_ALLOC) {
+      pmap_remove(as, va);
+      pf = pmap_pa_to_pf(pa);
+      pf->reference_cnt--;
+
+      if (pf->reference_cnt == 0) {
+        free_pageframe(pf);
+      }
+    } else {
+      pmap_remove(as, va);
+    }
+  }
+
+  release_mapped_files(as, addr, len);
+  pmap_flush_tlbs();
+  segment_free(as, addr, len);
+  return 0;
+}
+
+
+/* @brief   Handle a page fault within a mapped file
+ *
+ * @param   as, address space of the faulting process
+ * @param   addr, page-aligned address of the fault
+ * @param   access, PROT_READ, PROT_WRITE or PROT_EXEC access that faulted
+ * @return  0 on success, -1 if the fault cannot be handled
+ *
+ * Called by page_fault() for pages that are not present or are MEM_FILE
+ * pages. This can sleep waiting for the file cache to read the page.
+ */
+int file_page_fault(struct AddressSpace *as, vm_addr addr, bits32_t access)
+{
+  struct MappedFile *mf;
+  struct Buf *buf;
+  vm_addr pa;
+  bits32_t page_flags;
+  off64_t file_offset;
+  off64_t cluster_base;
+  int sc;
+
+  if ((mf = find_mapped_file(as, addr)) == NULL) {
+    return loan_page_fault(as, addr, access);
+  }
+
+  if ((access & mf->flags & PROT_MASK) != access) {
+    return -1;
+  }
+
+  if (pmap_extract(as, addr, &pa, &page_flags) == 0) {
+    if ((page_flags & MEM_MASK) != MEM_FILE || !(access & PROT_WRITE)) {
+      return -1;
+    }
+
+    if (page_flags & MAP_COW) {
+      return copy_file_page(as, mf->flags & PROT_MASK, addr, pa, true);
+    }
+
+    if (dirty_file_page(mf, addr, pa) != 0) {
+      return -1;
+    }
+
+    return pmap_protect(as, addr, page_flags | PROT_WRITE);
+  }
+
+  file_offset = mf->offset + (addr - mf->base);
+
+  if (file_offset >= mf->vnode->size) {
+    return -1;
+  }
+
+  cluster_base = ALIGN_DOWN(file_offset, CLUSTER_SZ);
+
+  if ((buf = bread(mf->vnode, cluster_base)) == NULL) {
+    return -1;
+  }
+
+  pmap_cache_extract((vm_addr)buf->data + (file_offset - cluster_base), &pa);
+
+  if ((mf->flags & MAP_PRIVATE) && (access & PROT_WRITE)) {
+    sc = copy_file_page(as, mf->flags & PROT_MASK, addr, pa, false);
+    brelse(buf);
+    return sc;
+  }
+
+  page_flags = file_page_flags(mf, access);
+
+  if (pmap_enter(as, addr, pa, page_flags) != 0) {
+    brelse(buf);
+    return -1;
+  }
+
+  ref_file_page(pa);
+
+  if (page_flags & PROT_WRITE && !(page_flags & MAP_COW)) {
+    bdwrite(buf);
+  } else {
+    brelse(buf);
+  }
+
+  return 0;
+}
+
+
+/* @brief   Map the pages of a file mapping that are already in the file cache
+ *
+ * @param   as, address space
+ * @param   addr, start of area within a file mapping
+ * @param   len, length of area
+ *
+ * Pages are mapped as a read fault would map them, so the pages of a running
+ * executable's text are shared by a later exec of it without a fault per page.
+ * Pages not in the cache or that are busy are left to page_fault().
+ */
+void prefault_mapped_file(struct AddressSpace *as, vm_addr addr, vm_size len)
+{
+  struct MappedFile *mf;
+  struct Buf *buf;
+  vm_addr va;
+  vm_addr pa;
+  bits32_t page_flags;
+  off64_t file_offset;
+  off64_t cluster_base;
+
+  if ((mf = find_mapped_file(as, addr)) == NULL || !(mf->flags & PROT_READ)) {
+    return;
+  }
+
+  for (va = ALIGN_DOWN(addr, PAGE_SIZE); va < addr + len && va < mf->base + mf->size; va += PAGE_SIZE) {
+    if (pmap_extract(as, va, &pa, &page_flags) == 0) {
+      continue;
+    }
+
+    file_offset = mf->offset + (va - mf->base);
+
+    if (file_offset >= mf->vnode->size) {
+      break;
+    }
+
+    cluster_base = ALIGN_DOWN(file_offset, CLUSTER_SZ);
+    buf = findblk(mf->vnode, cluster_base);
+
+    if (buf == NULL || (buf->flags & (B_VALID | B_BUSY)) != B_VALID) {
+      continue;
+    }
+
+    pmap_cache_extract((vm_addr)buf->data + (file_offset - cluster_base), &pa);
+
+    if (pmap_enter(as, va, pa, file_page_flags(mf, PROT_READ)) != 0) {
+      break;
+    }
+
+    ref_file_page(pa);
+  }
+}
+
+
+/* @brief   Release a buf page that is being unmapped from an address space
+ *
+ * @param   as, address space the page is mapped in
+ * @param   va, address of the page
+ * @param   pa, physical address of the page
+ * @param   flags, page flags of the MEM_FILE mapping
+ *
+ * The caller removes the mapping with pmap_remove(). A writable page of a
+ * shared mapping is marked as a delayed-write.
+ */
+void unmap_file_page(struct AddressSpace *as, vm_addr va, vm_addr pa, bits32_t flags)
+{
+  struct MappedFile *mf;
+  struct Pageframe *pf;
+
+  if ((flags & (PROT_WRITE | MAP_COW)) == PROT_WRITE
+      && (mf = find_mapped_file(as, va)) != NULL) {
+    dirty_file_page(mf, va, pa);
+  }
+
+  pf = pmap_pa_to_pf(pa);
+  pf->reference_cnt--;
+
+  if (pf->buf != NULL && --pf->buf->mapped_cnt == 0) {
+    TaskWakeupAll(&buf_list_rendez);
+  }
+}
+
+
+/* @brief   Count a new user mapping of a buf page
+ *
+ * @param   pa, physical address of the page
+ */
+void ref_file_page(vm_addr pa)
+{
+  struct Pageframe *pf;
+
+  pf = pmap_pa_to_pf(pa);
+  pf->reference_cnt++;
+
+  if (pf->buf != NULL) {
+    pf->buf->mapped_cnt++;
+  }
+}
+
+
+/* @brief   Remove the file mappings within an area of an address space
+ *
+ * @param   as, address space
+ * @param   addr, start of area
+ * @param   len, length of area
+ *
+ * Pages must already have been unmapped. sys_munmap() checks there is a free
+ * entry if a mapping has to be split.
+ */
+void release_mapped_files(struct AddressSpace *as, vm_addr addr, vm_size len)
+{
+  struct MappedFile *mf;
+  struct MappedFile *tail;
+  vm_addr ceiling;
+  vm_addr mf_ceiling;
+
+  ceiling = addr + len;
+
+  for (int t = 0; t < NMAPPEDFILE; t++) {
+    mf = &as->mapped_file_table[t];
+    mf_ceiling = mf->base + mf->size;
+
+    if (mf->vnode == NULL || ceiling <= mf->base || addr >= mf_ceiling) {
+      continue;
+    }
+
+    if (addr <= mf->base && ceiling >= mf_ceiling) {
+      if (mf->flags & MF_TEXT) {
+        mf->vnode->text_cnt--;
+      }
+
+      vnode_put(mf->vnode);
+      mf->vnode = NULL;
+    } else if (addr <= mf->base) {
+      mf->offset += ceiling - mf->base;
+      mf->size = mf_ceiling - ceiling;
+      mf->base = ceiling;
+    } else if (ceiling >= mf_ceiling) {
+      mf->size = addr - mf->base;
+    } else if ((tail = alloc_mapped_file(as)) != NULL) {
+      if (mf->flags & MF_TEXT) {
+        mf->vnode->text_cnt++;
+      }
+
+      vnode_inc_ref(mf->vnode);
+      tail->base = ceiling;
+      tail->size = mf_ceiling - ceiling;
+      tail->vnode = mf->vnode;
+      tail->offset = mf->offset + (ceiling - mf->base);
+      tail->flags = mf->flags;
+      mf->size = addr - mf->base;
+    }
+  }
+}
+
+
+/* @brief   Copy the file mappings of a process during fork
+ *
+ * @param   new_as, address space of the child
+ * @param   old_as, address space of the parent
+ */
+void fork_mapped_files(struct AddressSpace *new_as, struct AddressSpace *old_as)
+{
+  for (int t = 0; t < NMAPPEDFILE; t++) {
+    new_as->mapped_file_table[t] = old_as->mapped_file_table[t];
+
+    if (new_as->mapped_file_table[t].vnode != NULL) {
+      if (new_as->mapped_file_table[t].flags & MF_TEXT) {
+        new_as->mapped_file_table[t].vnode->text_cnt++;
+      }
+
+      vnode_inc_ref(new_as->mapped_file_table[t].vnode);
+    }
+  }
+}
+
+
+/* @brief   Mark a file mapping as the text of an executable
+ *
+ * @param   as, address space
+ * @param   addr, address within the mapping
+ * @return  0 on success, -EINVAL if addr is not within a file mapping
+ *
+ * Writes to the file and truncating it fail with -ETXTBSY until every text
+ * mapping of it has been unmapped.
+ */
+int map_text_file(struct AddressSpace *as, vm_addr addr)
+{
+  struct MappedFile *mf;
+
+  if ((mf = find_mapped_file(as, addr)) == NULL) {
+    return -EINVAL;
+  }
+
+  if ((mf->flags & MF_TEXT) == 0) {
+    mf->flags |= MF_TEXT;
+    mf->vnode->text_cnt++;
+  }
+
+  return 0;
+}
+
+
+/* @brief   Find the mapped file containing an address
+ *
+ * @param   as, address space
+ * @param   addr, address to find or NULL to find a free entry
+ * @return  mapped file entry or NULL if not found
+ */
+static struct MappedFile *find_mapped_file(struct AddressSpace *as, vm_addr addr)
+{
+  struct MappedFile *mf;
+
+  for (int t = 0; t < NMAPPEDFILE; t++) {
+    mf = &as->mapped_file_table[t];
+
+    if (addr == (vm_addr)NULL) {
+      if (mf->vnode == NULL) {
+        return mf;
+      }
+    } else if (mf->vnode != NULL && addr >= mf->base && addr < mf->base + mf->size) {
+      return mf;
+    }
+  }
+
+  return NULL;
+}
+
+
+/* @brief   Allocate a free mapped file entry
+ */
+static struct MappedFile *alloc_mapped_file(struct AddressSpace *as)
+{
+  return find_mapped_file(as, (vm_addr)NULL);
+}
+
+
+/* @brief   Get the page flags to map a buf page of a file mapping with
+ *
+ * @param   mf, file mapping
+ * @param   access, access that caused the page to be mapped
+ * @return  MEM_FILE page flags
+ *
+ * Writable private pages are copy-on-write. Shared pages stay read-only
+ * until written so that the buf can be marked as a delayed-write.
+ */
+static bits32_t file_page_flags(struct MappedFile *mf, bits32_t access)
+{
+  bits32_t page_flags;
+
+  page_flags = MEM_FILE | (mf->flags & PROT_MASK);
+
+  if ((mf->flags & MAP_PRIVATE) && (page_flags & PROT_WRITE)) {
+    page_flags |= MAP_COW;
+  } else if ((mf->flags & MAP_SHARED) && !(access & PROT_WRITE)) {
+    page_flags &= ~PROT_WRITE;
+  }
+
+  return page_flags;
+}
+
+
+/* @brief   Handle a write fault on a loaned buf page
+ *
+ * @param   as, address space
+ * @param   addr, page aligned address of the fault
+ * @param   access, access that caused the fault
+ * @return  0 on success, -1 if the fault is not on a loaned page
+ */
+static int loan_page_fault(struct AddressSpace *as, vm_addr addr, bits32_t access)
+{
+  vm_addr pa;
+  bits32_t page_flags;
+
+  if (pmap_extract(as, addr, &pa, &page_flags) != 0) {
+    return -1;
+  }
+
+  if ((page_flags & MEM_MASK) != MEM_FILE || !(page_flags & MAP_COW)
+      || (access & page_flags & PROT_MASK) != access) {
+    return -1;
+  }
+
+  return copy_file_page(as, page_flags & PROT_MASK, addr, pa, true);
+}
+
+
+/* @brief   Loan a page of a buf to a process instead of copying it
+ *
+ * @param   as, address space of the process
+ * @param   va, page aligned user address to copy the page to
+ * @param   kva, page aligned address of the page within a buf
+ * @return  0 on success, -1 if the page has to be copied instead
+ *
+ * The buf page replaces the writable anonymous page or earlier loan at va.
+ * Later writes to the buf through the file cache are seen by the process
+ * until it writes to the page, a write fault then copies it.
+ */
+int loan_buf_page(struct AddressSpace *as, vm_addr va, vm_addr kva)
+{
+  struct Pageframe *pf;
+  vm_addr pa;
+  vm_addr old_pa;
+  bits32_t old_flags;
+
+  if (pmap_extract(as, va, &old_pa, &old_flags) != 0 || !(old_flags & PROT_WRITE)) {
+    return -1;
+  }
+
+  if (pmap_cache_extract(kva, &pa) != 0) {
+    return -1;
+  }
+
+  if ((old_flags & MEM_MASK) == MEM_ALLOC) {
+    pmap_remove(as, va);
+    pf = pmap_pa_to_pf(old_pa);
+    pf->reference_cnt--;
+
+    if (pf->reference_cnt == 0) {
+      free_pageframe(pf);
+    }
+  } else if ((old_flags & MEM_MASK) == MEM_FILE && find_mapped_file(as, va) == NULL) {
+    unmap_file_page(as, va, old_pa, old_flags);
+    pmap_remove(as, va);
+  } else {
+    return -1;
+  }
+
+  if (pmap_enter(as, va, pa, MEM_FILE | (old_flags & PROT_MASK) | MAP_COW) != 0) {
+    return -1;
+  }
+
+  ref_file_page(pa);
+  return 0;
+}
+
+
+/* @brief   Lend a process's page to a buf instead of copying it
+ *
+ * @param   as, address space of the process
+ * @param   va, page aligned user address to copy the page from
+ * @param   kva, page aligned address of the page within a buf
+ * @return  0 on success, -1 if the page has to be copied instead
+ *
+ * An unshared anonymous page replaces the buf's page and stays mapped in the
+ * process as a loan of the buf page. The buf's unmapped old page is kept as
+ * a spare page of the file cache, see put_spare_pageframe(). As with
+ * loan_buf_page() the process sees later writes to the buf.
+ */
+int lend_user_page(struct AddressSpace *as, vm_addr va, vm_addr kva)
+{
+  struct Pageframe *pf;
+  struct Pageframe *old_pf;
+  vm_addr pa;
+  vm_addr old_pa;
+  bits32_t flags;
+
+  if (pmap_extract(as, va, &pa, &flags) != 0 || (flags & MEM_MASK) != MEM_ALLOC) {
+    return -1;
+  }
+
+  pf = pmap_pa_to_pf(pa);
+
+  if (pf->reference_cnt != 1 || pf->size != PAGE_SIZE) {
+    return -1;
+  }
+
+  if (pmap_cache_extract(kva, &old_pa) != 0) {
+    return -1;
+  }
+
+  old_pf = pmap_pa_to_pf(old_pa);
+
+  if (old_pf->reference_cnt != 0) {
+    return -1;
+  }
+
+  if (pmap_protect(as, va, MEM_FILE | (flags & PROT_MASK) | MAP_COW) != 0) {
+    return -1;
+  }
+
+  pmap_cache_remove(kva);
+  pmap_cache_enter(kva, pa);
+  pf->flags |= PGF_WIRED;
+  pf->buf = old_pf->buf;
+  pf->buf->mapped_cnt++;
+  put_spare_pageframe(old_pf);
+  return 0;
+}
+
+
+/* @brief   Map a private copy of a file page
+ *
+ * @param   as, address space
+ * @param   prot, protections of the copy
+ * @param   addr, address to map the copy at
+ * @param   src_pa, physical address of the buf page to copy
+ * @param   replace, true if src_pa is currently mapped at addr
+ * @return  0 on success, -1 on failure
+ */
+static int copy_file_page(struct AddressSpace *as, bits32_t prot,
+                          vm_addr addr, vm_addr src_pa, bool replace)
+{
+  struct Pageframe *pf;
+  bits32_t page_flags;
+
+  if ((pf = alloc_pageframe_flags(PAGE_SIZE, 0)) == NULL) {
+    return -1;
+  }
+
+  memcpy((void *)pmap_pf_to_va(pf), (void *)pmap_pa_to_va(src_pa), PAGE_SIZE);
+
+  if (replace) {
+    pmap_extract(as, addr, &src_pa, &page_flags);
+    unmap_file_page(as, addr, src_pa, page_flags);
+    pmap_remove(as, addr);
+  }
+
+  if (pmap_enter(as, addr, pf->physical_addr, MEM_ALLOC | prot) != 0) {
+    free_pageframe(pf);
+    return -1;
+  }
+
+  pf->reference_cnt = 1;
+  return 0;
+}
+
+
+/* @brief   Mark the buf of a shared file page as a delayed-write
+ *
+ * @param   mf, shared file mapping
+ * @param   addr, address of the page within the mapping
+ * @param   pa, physical address of the mapped page
+ * @return  0 on success, -1 if the page is no longer part of the file's cache
+ *
+ * The buf may have been discarded from the cache by a truncate while mapped.
+ */
+static int dirty_file_page(struct MappedFile *mf, vm_addr addr, vm_addr pa)
+{
+  struct Buf *buf;
+  off64_t file_offset;
+  off64_t cluster_base;
+  vm_addr buf_pa;
+
+  file_offset = mf->offset + (addr - mf->base);
+  cluster_base = ALIGN_DOWN(file_offset, CLUSTER_SZ);
+
+  if (findblk(mf->vnode, cluster_base) == NULL) {
+    return -1;
+  }
+
+  buf = getblk(mf->vnode, cluster_base);
+
+  if (pmap_cache_extract((vm_addr)buf->data + (file_offset - cluster_base), &buf_pa) != 0
+      || buf_pa != pa) {
+    brelse(buf);
+    return -1;
+  }
+
+  bdwrite(buf);
+  return 0;
+}
+
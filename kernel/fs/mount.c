@@ -90,6 +90,10 @@ int sys_createmsgport(char *_path, uint32_t flags, struct stat *_stat, int backl
     return -EFAULT;
   }
 
+  if (backlog_sz < 1 || backlog_sz > MAX_MSG_BACKLOG) {
+    return -EINVAL;
+  }
+
   if (root_vnode != NULL) {
     if ((error = lookup(_path, 0, &ld)) != 0) {
       return error;
@@ -142,9 +146,12 @@ int sys_createmsgport(char *_path, uint32_t flags, struct stat *_stat, int backl
   InitRendez(&sb->rendez);
 
   init_msgport(&sb->msgport);
-  init_msgbacklog(&sb->msgbacklog, backlog_sz);
   sb->msgport.context = sb;
 
+  if ((error = init_msgbacklog(&sb->msgbacklog, backlog_sz)) != 0) {
+    goto exit;
+  }
+
   sb->root = mount_root_vnode;
   sb->flags = flags;
   sb->reference_cnt = 1;
@@ -194,7 +201,8 @@ int sys_createmsgport(char *_path, uint32_t flags, struct stat *_stat, int backl
 
   vnode_inc_ref(mount_root_vnode);
   vnode_unlock(mount_root_vnode);
-  
+
+  knote(&fs_knote_list, NOTE_MOUNT);  
   return fd;
 
 exit:
@@ -270,7 +278,7 @@ int sys_renamemsgport(char *_new_path, char *_old_path)
   new_vnode->vnode_mounted_here->vnode_covered = new_vnode;  
   old_vnode->vnode_mounted_here = NULL;
     
-//  dname_purge_all();     FIXME:
+  dname_purge_all();
 
   vnode_put (old_vnode);   // release 
   vnode_put (new_vnode);   // release
@@ -336,7 +344,7 @@ int sys_pivotroot(char *_new_root, char *_old_root)
 
   // TODO: Do we need to do any reference counting tricks, esp for current_vnode?
   
-//  dname_purge_all();     FIXME:
+  dname_purge_all();
   vnode_put (old_root_vnode);
   vnode_put (new_root_vnode);
 
@@ -385,6 +393,7 @@ int close_mount(struct Process *proc, int fd)
   */
   
   free_fd_superblock(proc, fd);
+  knote(&fs_knote_list, NOTE_UNMOUNT);
 
   return 0;
 }
@@ -498,6 +507,8 @@ void free_superblock(struct SuperBlock *sb)
   
   if (sb->reference_cnt == 0) {
     // TODO: Wakeup anything block on rendez ?
+    dname_purge_superblock(sb);
+    fini_msgbacklog(&sb->msgbacklog);
     LIST_ADD_TAIL(&free_superblock_list, sb, link);
   }
 }
@@ -37,13 +37,30 @@
 #include <kernel/kqueue.h>
 
 
-/* @brief   Send a knote event to a vnode in the kernel
+// Static prototypes
+static int receive_msg(struct SuperBlock *sb, msgid_t *msgid, void *addr, size_t buf_sz);
+static int reply_msg(struct SuperBlock *sb, msgid_t msgid, int status, void *addr,
+                     size_t buf_sz, struct Process **sender);
+static int copyout_iov(struct Msg *msg, struct IOV *iov, void *dst, void *src, size_t sz);
+static int copyin_iov(struct Msg *msg, struct IOV *iov, void *dst, void *src, size_t sz);
+static int kcallmsg(struct MsgPort *msgport, struct Msg *msg);
+static int copyin_sendrec_iov(struct VNode *vnode, struct fsreq *req, 
+                              int siov_cnt, struct IOV *siov, struct IOV *_siov,
+                              int riov_cnt, struct IOV *riov, struct IOV *_riov);
+static int asyncmsg_complete(struct Msg *msg);
+
+
+/* @brief   Report the readiness of a device to the kernel
  *
  * @param   fd, file descriptor of mount on which the file exists
  * @param   ino_nr, inode number of the file
- * @param   hint, hint of why this is being notified. *
+ * @param   hint, POLLIN and POLLOUT readiness of the device
  * @return  0 on success, negative errno on error
  *
+ * Called by drivers (as pollnotify in libc) whenever the readiness of a
+ * device changes. Raises the EVFILT_READ and EVFILT_WRITE knotes of the
+ * vnode and is remembered for when a knote is enabled.
+ *
  * Perhaps change it to sys_setvnodeattrs(fd, ino_nr, flags);
  */
 int sys_knotei(int fd, int ino_nr, long hint)
@@ -65,7 +82,9 @@ int sys_knotei(int fd, int ino_nr, long hint)
     return -EINVAL;
   }
     
-  knote(&vnode->knote_list, hint);  
+  vnode->poll_events = hint;
+  knote(&vnode->knote_list, ((hint & POLLIN) ? NOTE_READABLE : 0)
+                            | ((hint & POLLOUT) ? NOTE_WRITABLE : 0));  
   vnode_put(vnode);
   return 0;
 }
@@ -88,14 +107,8 @@ int sys_knotei(int fd, int ino_nr, long hint)
 int sys_getmsg(int fd, msgid_t *_msgid, void *addr, size_t buf_sz)
 {
   struct SuperBlock *sb;  
-  struct MsgPort *msgport;
-  struct Msg *msg;
   msgid_t msgid;
-  off_t offset;
   int nbytes_read;
-  int nbytes_to_xfer;
-  int remaining;
-  int i;
   struct Process *current;
 
   current = get_current_process();  
@@ -105,26 +118,198 @@ int sys_getmsg(int fd, msgid_t *_msgid, void *addr, size_t buf_sz)
     return -EINVAL;
   }
   
+  sb->msgport.server = current;
+  nbytes_read = receive_msg(sb, &msgid, addr, buf_sz);
+
+  if (nbytes_read == -ENOMSG) {
+    return 0;
+  } else if (nbytes_read < 0) {
+    return nbytes_read;
+  }
+  
+  CopyOut (_msgid, &msgid, sizeof msgid);
+  return nbytes_read;
+}
+
+
+/* @brief   Get several messages from a mount's message port
+ *
+ * @param   fd, file descriptor of mount created by sys_mount()
+ * @param   _vec, user array of msgvec, buf and buf_sz of each entry are the
+ *          buffer to read the initial part of a message into
+ * @param   cnt, number of entries in the array, up to MAX_MSGVEC
+ * @return  number of messages received or negative errno on error
+ *
+ * The msgid of each message received is stored in its entry and status is
+ * set to the number of bytes read. Non-blocking, returns 0 if no messages are
+ * pending. A server can drain a burst of requests with one system call. If
+ * the array cannot be copied back the messages received are replied to with
+ * -EIO so that their senders and backlog slots are not lost.
+ */
+int sys_getmsgv(int fd, struct msgvec *_vec, int cnt)
+{
+  struct SuperBlock *sb;  
+  struct msgvec vec[MAX_MSGVEC];
+  struct Process *current;
+  struct Process *sender;
+  int sc;
+  int n;
+
+  current = get_current_process();  
+  sb = get_superblock(current, fd);
+  
+  if (sb == NULL || cnt < 0 || cnt > MAX_MSGVEC) {
+    return -EINVAL;
+  }
+  
+  if (CopyIn(vec, _vec, cnt * sizeof *vec) != 0) {
+    return -EFAULT;
+  }
+  
+  sb->msgport.server = current;
+  sc = 0;
+  
+  for (n = 0; n < cnt; n++) {
+    if ((sc = receive_msg(sb, &vec[n].msgid, vec[n].buf, vec[n].buf_sz)) < 0) {
+      break;
+    }
+
+    vec[n].status = sc;
+  }
+  
+  if (n == 0 && sc == -EAGAIN) {
+    return -EAGAIN;
+  }
+
+  if (CopyOut(_vec, vec, n * sizeof *vec) != 0) {
+    // The server cannot learn the msgids, fail the messages already taken
+    for (int t = 0; t < n; t++) {
+      reply_msg(sb, vec[t].msgid, -EIO, NULL, 0, &sender);
+    }
+    
+    return -EFAULT;
+  }
+  
+  return n;
+}
+
+
+/* @brief   Reply to a message
+ *
+ * @param   fd, file descriptor of mounted file system created with sys_createmsgport()
+ * @param   msgid, unique message identifier returned by sys_getmsg()
+ * @param   status, error status to return to caller (0 on success or negative errno)
+ * @param   addr, address of buffer to write from
+ * @param   buf_sz, size of buffer to write from
+ * @return  0 on success, negative errno on error 
+ */
+int sys_replymsg(int fd, msgid_t msgid, int status, void *addr, size_t buf_sz)
+{
+  struct Process *current;
+  struct SuperBlock *sb;
+  struct Process *sender;
+  int sc;
+    
+  current = get_current_process();  
+  sb = get_superblock(current, fd);
+
+  if (sb == NULL) {
+    return -EINVAL;
+  }
+  
+  if ((sc = reply_msg(sb, msgid, status, addr, buf_sz, &sender)) != 0) {
+    return sc;
+  }
+
+  // Switch straight back to a sender waiting for the reply
+  if (sender != NULL) {
+    TaskYieldTo(sender);
+  }
+  
+  return 0;
+}
+
+
+/* @brief   Reply to several messages
+ *
+ * @param   fd, file descriptor of mounted file system created with sys_createmsgport()
+ * @param   _vec, user array of msgvec holding the msgid, status and reply
+ *          buffer of each message to reply to
+ * @param   cnt, number of entries in the array, up to MAX_MSGVEC
+ * @return  number of messages replied to or negative errno on error
+ *
+ * Replies stop at the first entry that fails. Unlike sys_replymsg() the
+ * server keeps the CPU so it can carry on with the next batch of messages.
+ */
+int sys_replymsgv(int fd, struct msgvec *_vec, int cnt)
+{
+  struct Process *current;
+  struct SuperBlock *sb;
+  struct msgvec vec[MAX_MSGVEC];
+  struct Process *sender;
+  int sc;
+  int n;
+    
+  current = get_current_process();  
+  sb = get_superblock(current, fd);
+
+  if (sb == NULL || cnt < 0 || cnt > MAX_MSGVEC) {
+    return -EINVAL;
+  }
+  
+  if (CopyIn(vec, _vec, cnt * sizeof *vec) != 0) {
+    return -EFAULT;
+  }
+
+  for (n = 0; n < cnt; n++) {
+    sc = reply_msg(sb, vec[n].msgid, vec[n].status, vec[n].buf, vec[n].buf_sz, &sender);
+    
+    if (sc != 0) {
+      return (n > 0) ? n : sc;
+    }
+  }
+  
+  return n;
+}
+
+
+/* @brief   Take the next message from a mount's message port
+ *
+ * @param   sb, superblock of the mount
+ * @param   msgid, location to store the msgid assigned to the message
+ * @param   addr, user address of buffer to read the initial part of message into
+ * @param   buf_sz, size of buffer to read into
+ * @return  number of bytes read, -ENOMSG if no message is pending or
+ *          -EAGAIN if the backlog is full
+ */
+static int receive_msg(struct SuperBlock *sb, msgid_t *msgid, void *addr, size_t buf_sz)
+{
+  struct MsgPort *msgport;
+  struct Msg *msg;
+  off_t offset;
+  int nbytes_read;
+  int nbytes_to_xfer;
+  int remaining;
+  int i;
+
   msgport = &sb->msgport;
   
   // Check if we have a backlog slot free?
   // Allocate msgid slot for backlog (sb->msgport_backlog_table);
-  msgid = alloc_msgid(&sb->msgbacklog);
+  *msgid = alloc_msgid(&sb->msgbacklog);
   
-  if (msgid < 0) {
+  if (*msgid == (msgid_t)-1) {
   	return -EAGAIN;
   }
   
   msg = kgetmsg(msgport);
 
   if (msg == NULL) {
-    free_msgid(&sb->msgbacklog, msgid);
-    return 0;
+    free_msgid(&sb->msgbacklog, *msgid);
+    return -ENOMSG;
   }  
   
-  assign_msgid(&sb->msgbacklog, msgid, msg);
-  
-  CopyOut (_msgid, &msgid, sizeof msgid);
+  assign_msgid(&sb->msgbacklog, *msgid, msg);
 
   nbytes_read = 0;
   
@@ -136,7 +321,7 @@ int sys_getmsg(int fd, msgid_t *_msgid, void *addr, size_t buf_sz)
       remaining = buf_sz - offset;
       nbytes_to_xfer = (msg->siov[i].size < remaining) ? msg->siov[i].size : remaining;
 
-      CopyOut(addr + nbytes_read, msg->siov[i].addr, nbytes_to_xfer);
+      copyout_iov(msg, &msg->siov[i], addr + nbytes_read, msg->siov[i].addr, nbytes_to_xfer);
       nbytes_read += nbytes_to_xfer;
       offset += nbytes_to_xfer;
       i++;
@@ -147,20 +332,19 @@ int sys_getmsg(int fd, msgid_t *_msgid, void *addr, size_t buf_sz)
 }
 
 
-/* @brief   Reply to a message
+/* @brief   Reply to a message of a mount's message port
  *
- * @param   fd, file descriptor of mounted file system created with sys_createmsgport()
+ * @param   sb, superblock of the mount
  * @param   msgid, unique message identifier returned by sys_getmsg()
  * @param   status, error status to return to caller (0 on success or negative errno)
- * @param   addr, address of buffer to write from
+ * @param   addr, user address of buffer to write from
  * @param   buf_sz, size of buffer to write from
+ * @param   sender, location to store the process waiting for the reply, or NULL
  * @return  0 on success, negative errno on error 
  */
-int sys_replymsg(int fd, msgid_t msgid, int status, void *addr, size_t buf_sz)
+static int reply_msg(struct SuperBlock *sb, msgid_t msgid, int status, void *addr,
+                     size_t buf_sz, struct Process **sender)
 {
-  struct Process *current;
-  struct SuperBlock *sb;
-  struct MsgPort *msgport;
   struct Msg *msg;
   int nbytes_to_write;
   int nbytes_written;
@@ -168,16 +352,9 @@ int sys_replymsg(int fd, msgid_t msgid, int status, void *addr, size_t buf_sz)
   int iov_remaining;
   int i;
   int sc;
-    
-  current = get_current_process();  
-  sb = get_superblock(current, fd);
 
-  if (sb == NULL) {
-    return -EINVAL;
-  }
+  *sender = NULL;
   
-  msgport = &sb->msgport;
-
   if ((msg = msgid_to_msg(&sb->msgbacklog, msgid)) == NULL) {
     return -EINVAL;
   }
@@ -195,7 +372,8 @@ int sys_replymsg(int fd, msgid_t msgid, int status, void *addr, size_t buf_sz)
       remaining = buf_sz - nbytes_written;
       nbytes_to_write = (msg->riov[i].size < remaining) ? msg->riov[i].size : remaining;
 
-      sc = CopyIn(msg->riov[i].addr + msg->riov[i].size - iov_remaining,
+      sc = copyin_iov(msg, &msg->riov[i],
+             msg->riov[i].addr + msg->riov[i].size - iov_remaining,
              addr + nbytes_written, nbytes_to_write);
        
       if (sc != 0) {
@@ -208,13 +386,15 @@ int sys_replymsg(int fd, msgid_t msgid, int status, void *addr, size_t buf_sz)
     }
   }
   
+	free_msgid(&sb->msgbacklog, msgid);
+
   if (msg->reply_port != NULL) {
+    *sender = msg->sender;
   	kreplymsg(msg);
  	} else {
- 		bdflush_brelse(msg);
+ 		msg->complete(msg);
  	}
  	
-	free_msgid(&sb->msgbacklog, msgid);
   return 0;
 }
 
@@ -264,7 +444,7 @@ int sys_readmsg(int fd, msgid_t msgid, void *addr, size_t buf_sz, off_t offset)
       buf_remaining = buf_sz - nbytes_read;
       nbytes_to_read = (buf_remaining < iov_remaining) ? buf_remaining : iov_remaining;
 
-      CopyOut(addr + nbytes_read,
+      copyout_iov(msg, &msg->siov[i], addr + nbytes_read,
               msg->siov[i].addr + msg->siov[i].size - iov_remaining,
               nbytes_to_read);
 
@@ -326,7 +506,8 @@ int sys_writemsg(int fd, msgid_t msgid, void *addr, size_t buf_sz, off_t offset)
       buf_remaining = buf_sz - nbytes_written;
       nbytes_to_write = (iov_remaining < buf_remaining) ? iov_remaining : buf_remaining;
 
-      sc = CopyIn(msg->riov[i].addr + msg->riov[i].size - iov_remaining,
+      sc = copyin_iov(msg, &msg->riov[i],
+             msg->riov[i].addr + msg->riov[i].size - iov_remaining,
              addr + nbytes_written, nbytes_to_write);
        
       if (sc != 0) {
@@ -344,17 +525,187 @@ int sys_writemsg(int fd, msgid_t msgid, void *addr, size_t buf_sz, off_t offset)
 
 
 /* @brief   Blocking send and receive message to a RPC service
+ *
+ * @param   fd, file descriptor of a file on the server's mount
+ * @param   siov_cnt, number of IOVs to send
+ * @param   _siov, user address of IOVs to send
+ * @param   riov_cnt, number of IOVs to receive the reply into
+ * @param   _riov, user address of IOVs to receive the reply into
+ * @return  reply status from the server or negative errno on failure
  *
  * This is intended for custom RPC messages that don't follow the predefined
  * filesystem commands.  The kernel will prefix messages with a fsreq IOV with
  * cmd=CMD_SENDREC before being sent to the server. 
+ *
+ * The server reads and writes the IOVs directly in the caller's address
+ * space. The CPU is handed straight to the server if it is waiting for the
+ * message and straight back to the caller when the server replies.
  */
-int sys_sendrec(int fd, int siov_cnt, struct IOV *siov, int riov_cnt, struct IOV *riov)
+int sys_sendrec(int fd, int siov_cnt, struct IOV *_siov, int riov_cnt, struct IOV *_riov)
 {
-  return -ENOSYS;
+  struct Process *current;
+  struct VNode *vnode;
+  struct fsreq req = {0};
+  struct IOV siov[1 + MAX_SENDREC_IOV];
+  struct IOV riov[MAX_SENDREC_IOV];
+  struct Msg msg;
+  int sc;
+  
+  current = get_current_process();  
+
+  if (siov_cnt < 0 || siov_cnt > MAX_SENDREC_IOV
+      || riov_cnt < 0 || riov_cnt > MAX_SENDREC_IOV) {
+    return -EINVAL;
+  }
+  
+  if ((vnode = get_fd_vnode(current, fd)) == NULL) {
+    return -EBADF;
+  }
+
+  if ((sc = copyin_sendrec_iov(vnode, &req, siov_cnt, siov, _siov, riov_cnt, riov, _riov)) != 0) {
+    return sc;
+  }
+
+  msg.siov_cnt = 1 + siov_cnt;
+  msg.siov = siov;
+  msg.riov_cnt = riov_cnt;
+  msg.riov = riov;  
+  msg.as = &current->as;
+  
+  return kcallmsg(&vnode->superblock->msgport, &msg);
 }
 
- 
+
+/* @brief   Send a message to a RPC service without waiting for the reply
+ *
+ * @param   kq, file descriptor of the kqueue to deliver the reply event to
+ * @param   fd, file descriptor of a file on the server's mount
+ * @param   siov_cnt, number of IOVs to send
+ * @param   _siov, user address of IOVs to send
+ * @param   riov_cnt, number of IOVs to receive the reply into
+ * @param   _riov, user address of IOVs to receive the reply into
+ * @return  ident of the EVFILT_MSGREPLY event or negative errno on failure
+ *
+ * Returns as soon as the message is queued on the server's port. The reply
+ * is delivered as a one-shot EVFILT_MSGREPLY event on the kqueue with the
+ * reply status in the event's data field. The IOVs must remain valid until
+ * then. Deleting the event does not cancel the message.
+ */
+int sys_sendrec_async(int kq, int fd, int siov_cnt, struct IOV *_siov, int riov_cnt, struct IOV *_riov)
+{
+  struct Process *current;
+  struct KQueue *kqueue;
+  struct VNode *vnode;
+  struct AsyncMsg *amsg;
+  struct KNote *knote;
+  struct kevent ev;
+  int id;
+  int sc;
+  
+  current = get_current_process();  
+
+  if (siov_cnt < 0 || siov_cnt > MAX_SENDREC_IOV
+      || riov_cnt < 0 || riov_cnt > MAX_SENDREC_IOV) {
+    return -EINVAL;
+  }
+
+  if ((kqueue = get_kqueue(current, kq)) == NULL) {
+    return -EBADF;
+  }
+    
+  if ((vnode = get_fd_vnode(current, fd)) == NULL) {
+    return -EBADF;
+  }
+
+  if ((amsg = LIST_HEAD(&asyncmsg_free_list)) == NULL) {
+    return -EAGAIN;
+  }
+
+  LIST_REM_HEAD(&asyncmsg_free_list, free_link);
+  amsg->in_use = true;
+  amsg->replied = false;
+  amsg->owner = current;
+  LIST_INIT(&amsg->knote_list);
+  memset(&amsg->req, 0, sizeof amsg->req);
+
+  id = amsg - asyncmsg_table;
+
+  sc = copyin_sendrec_iov(vnode, &amsg->req, siov_cnt, amsg->siov, _siov, 
+                          riov_cnt, amsg->riov, _riov);
+  
+  if (sc != 0) {
+    free_asyncmsg(amsg);
+    return sc;
+  }
+
+  EV_SET(&ev, id, EVFILT_MSGREPLY, EV_ADD | EV_ENABLE | EV_ONESHOT, 0, 0, NULL);
+
+  if ((knote = alloc_knote(kqueue, &ev)) == NULL) {
+    free_asyncmsg(amsg);
+    return -ENOMEM;
+  }
+  
+  enable_knote(kqueue, knote);
+
+  amsg->msg.siov_cnt = 1 + siov_cnt;
+  amsg->msg.siov = amsg->siov;
+  amsg->msg.riov_cnt = riov_cnt;
+  amsg->msg.riov = amsg->riov;
+  amsg->msg.as = &current->as;
+
+  ksendmsg_async(&vnode->superblock->msgport, &amsg->msg, asyncmsg_complete);
+  return id;
+}
+
+
+/* @brief   Copy in and prefault the IOVs of a sys_sendrec request
+ *
+ * @param   vnode, vnode of the file the request is sent to
+ * @param   req, fsreq to initialize with cmd=CMD_SENDREC, sent in siov[0]
+ * @param   siov_cnt, number of user IOVs to send
+ * @param   siov, array of 1 + siov_cnt IOVs to initialize
+ * @param   _siov, user address of IOVs to send
+ * @param   riov_cnt, number of user IOVs to receive the reply into
+ * @param   riov, array of riov_cnt IOVs to initialize
+ * @param   _riov, user address of IOVs to receive the reply into
+ * @return  0 on success, negative errno on failure
+ */
+static int copyin_sendrec_iov(struct VNode *vnode, struct fsreq *req, 
+                              int siov_cnt, struct IOV *siov, struct IOV *_siov,
+                              int riov_cnt, struct IOV *riov, struct IOV *_riov)
+{
+  int t;
+  
+  if (CopyIn(&siov[1], _siov, siov_cnt * sizeof(struct IOV)) != 0
+      || CopyIn(&riov[0], _riov, riov_cnt * sizeof(struct IOV)) != 0) {
+    return -EFAULT;
+  }
+  
+  req->cmd = CMD_SENDREC;
+  req->args.sendrec.inode_nr = vnode->inode_nr;
+  
+  for (t = 1; t < 1 + siov_cnt; t++) {
+    siov[t].flags = IOV_USER;
+    req->args.sendrec.siov_sz += siov[t].size;
+  }
+
+  for (t = 0; t < riov_cnt; t++) {
+    riov[t].flags = IOV_USER;
+    req->args.sendrec.riov_sz += riov[t].size;
+  }
+
+  if (prefault_iov(siov_cnt, &siov[1], false) != 0 
+      || prefault_iov(riov_cnt, &riov[0], true) != 0) {
+    return -EFAULT;
+  }
+
+  siov[0].addr = req;
+  siov[0].size = sizeof *req;
+  siov[0].flags = 0;
+  return 0;
+}
+
+
 /* @brief   Send a message to a message port and wait for a reply.
  *
  * TODO:  Need timeout and abort mechanisms into IPC in case server doesn't respond or terminates.
@@ -362,23 +713,67 @@ int sys_sendrec(int fd, int siov_cnt, struct IOV *siov, int riov_cnt, struct IOV
  */
 int ksendmsg(struct MsgPort *msgport, int siov_cnt, struct IOV *siov, int riov_cnt, struct IOV *riov)
 {
-  struct Process *current;
   struct Msg msg;
 	
-  current = get_current_process();
-      
-  msg.reply_port = &current->reply_port;  
   msg.siov_cnt = siov_cnt;
   msg.siov = siov;
   msg.riov_cnt = riov_cnt;
   msg.riov = riov;  
-  msg.reply_status = 0;
+  msg.as = NULL;
      
-  kputmsg(msgport, &msg);   
+  return kcallmsg(msgport, &msg);
+}
+
+
+/* @brief   Send a message and wait for the reply, switching to the server
+ *
+ * @param   msgport, message port to send the message to
+ * @param   msg, message with IOVs set, the remaining fields are initialized here
+ * @return  reply status of the message
+ */
+static int kcallmsg(struct MsgPort *msgport, struct Msg *msg)
+{
+  struct Process *current;
+
+  current = get_current_process();
+
+  msg->reply_port = &current->reply_port;  
+  msg->sender = current;
+  msg->complete = NULL;
+  msg->reply_status = 0;
+  
+  kputmsg(msgport, msg);   
+  
+  if (kpeekmsg(&current->reply_port) == NULL) {
+    TaskSleepHandoff(&current->reply_port.rendez, msgport->server);
+  }
+  
   kwaitport(&current->reply_port, NULL);  
   kgetmsg(&current->reply_port);
 	
-  return msg.reply_status;
+  return msg->reply_status;
+}
+
+
+/* @brief   Send a message to a message port without waiting for the reply
+ *
+ * @param   msgport, message port to send the message to
+ * @param   msg, message with IOVs and address space set
+ * @param   complete, function called with the message when it is replied to
+ * @return  0 on success, negative errno on failure
+ *
+ * The message and its IOVs must remain valid until complete() is called,
+ * the reply status is in msg->reply_status. Used for read-ahead and
+ * delayed writes of the file cache and by sys_sendrec_async().
+ */
+int ksendmsg_async(struct MsgPort *msgport, struct Msg *msg, int (*complete)(struct Msg *msg))
+{
+  msg->reply_port = NULL;
+  msg->sender = NULL;
+  msg->complete = complete;
+  msg->reply_status = 0;
+  
+  return kputmsg(msgport, msg);
 }
 
 
@@ -409,8 +804,8 @@ int kreplymsg(struct Msg *msg)
   KASSERT (msg != NULL);  
   KASSERT (msg->reply_port != NULL);
   
-  msg->port = msg->reply_port;
   reply_port = msg->reply_port;
+  msg->port = reply_port;
   LIST_ADD_TAIL(&reply_port->pending_msg_list, msg, link);
   TaskWakeup(&reply_port->rendez);
   return 0;  
@@ -452,7 +847,7 @@ struct Msg *kpeekmsg(struct MsgPort *msgport)
  */
 int kwaitport(struct MsgPort *msgport, struct timespec *timeout)
 {
-  while (LIST_HEAD(&msgport->pending_msg_list) == NULL) {
+  while (kpeekmsg(msgport) == NULL) {
     if (timeout == NULL) {
       TaskSleep(&msgport->rendez);
     } else {    
@@ -477,6 +872,7 @@ int init_msgport(struct MsgPort *msgport)
   LIST_INIT(&msgport->knote_list);
   InitRendez(&msgport->rendez);
   msgport->context = NULL;
+  msgport->server = NULL;
   return 0;
 }
 
@@ -490,6 +886,7 @@ int init_msgport(struct MsgPort *msgport)
  */
 int fini_msgport(struct MsgPort *msgport)
 {
+  msgport->server = NULL;
   return 0;
 } 
 
@@ -499,30 +896,85 @@ int fini_msgport(struct MsgPort *msgport)
  * @param   msgbacklog, message backlog structure to initialize
  * @param		backlog, maximum number of concurrent messages to allow.
  * @return  0 on success, negative errno on error
+ *
+ * The free bitmap and enough pages of the msgid to msg table for backlog_sz
+ * messages are allocated here, up to MAX_MSG_BACKLOG messages.
  */
 int init_msgbacklog(struct MsgBacklog *backlog, int backlog_sz)
 {
-	backlog->backlog_sz = backlog_sz;
-	backlog->free_bitmap = 0;
-	
-	for (int t=0; t<backlog_sz; t++) {
-		backlog->free_bitmap |= (1<<t);
-	}
-		
-	for (int t=0; t< MAX_MSG_BACKLOG; t++) {
-		backlog->msg[t] = NULL;
-	}
+  int npages;
+  
+  backlog->backlog_sz = 0;
+  backlog->free_bitmap = NULL;
+
+  for (int t = 0; t < MSG_BACKLOG_PAGES; t++) {
+    backlog->msg[t] = NULL;
+  }
+
+  for (int t = 0; t < MSG_SUMMARY_WORDS; t++) {
+    backlog->free_summary[t] = 0;
+  }
+  
+  if (backlog_sz < 1 || backlog_sz > MAX_MSG_BACKLOG) {
+    return -EINVAL;
+  }
+  
+  if ((backlog->free_bitmap = kmalloc_page()) == NULL) {
+    return -ENOMEM;
+  }
+  
+  npages = (backlog_sz + MSGS_PER_PAGE - 1) / MSGS_PER_PAGE;
+  
+  for (int t = 0; t < npages; t++) {
+    if ((backlog->msg[t] = kmalloc_page()) == NULL) {
+      fini_msgbacklog(backlog);
+      return -ENOMEM;
+    }
+  }
+
+  backlog->backlog_sz = backlog_sz;
+
+  for (int t = 0; t < backlog_sz; t++) {
+    backlog->free_bitmap[t / 32] |= (1u << (t % 32));
+    backlog->free_summary[t / 1024] |= (1u << ((t / 32) % 32));
+  }
 	
   return 0;
 }
 
 
+/* @brief   Free the pages allocated by init_msgbacklog
+ *
+ * @param   msgbacklog, message backlog structure to free
+ */
+void fini_msgbacklog(struct MsgBacklog *backlog)
+{
+  for (int t = 0; t < MSG_BACKLOG_PAGES; t++) {
+    if (backlog->msg[t] != NULL) {
+      kfree_page(backlog->msg[t]);
+      backlog->msg[t] = NULL;
+    }
+  }
+  
+  if (backlog->free_bitmap != NULL) {
+    kfree_page(backlog->free_bitmap);
+    backlog->free_bitmap = NULL;
+  }
+
+  for (int t = 0; t < MSG_SUMMARY_WORDS; t++) {
+    backlog->free_summary[t] = 0;
+  }
+
+  backlog->backlog_sz = 0;
+}
+
+
 /* @brief		Assign a msgid to a message in the backlog table
  *
  */
 void assign_msgid(struct MsgBacklog *backlog, msgid_t msgid, struct Msg *msg)
 {
-	backlog->msg[msgid] = msg;
+	backlog->msg[msgid / MSGS_PER_PAGE][msgid % MSGS_PER_PAGE] = msg;
 }
 
 
@@ -539,49 +991,295 @@ void assign_msgid(struct MsgBacklog *backlog, msgid_t msgid, struct Msg *msg)
  */
 struct Msg *msgid_to_msg(struct MsgBacklog *backlog, msgid_t msgid)
 {
-  if (msgid < 0 || msgid >= backlog->backlog_sz) {
+  if (msgid >= backlog->backlog_sz) {
   	return NULL;
   }
   
-  if ((backlog->free_bitmap & (1<<msgid)) != 0) {
+  if ((backlog->free_bitmap[msgid / 32] & (1u << (msgid % 32))) != 0) {
   	return NULL;
   }
   
- return backlog->msg[msgid];
+  return backlog->msg[msgid / MSGS_PER_PAGE][msgid % MSGS_PER_PAGE];
 }
 
 
-/*
+/* @brief   Allocate the lowest free msgid of a message backlog
+ *
+ * @param   backlog, the message backlog to allocate from
+ * @return  msgid on success or -1 if the backlog is full
  *
+ * The summary word locates a word of the bitmap with a free msgid, the
+ * free msgid within that word is found with a second count trailing zeros.
  */
 msgid_t alloc_msgid(struct MsgBacklog *backlog)
 {
-	if (backlog->free_bitmap == 0) {
-		return -1;
-	}
-	
-	for (int t=0; t<backlog->backlog_sz; t++) {
-		if ((backlog->free_bitmap & (1<<t)) != 0) {
-			backlog->free_bitmap &= ~(1<<t);
-			return t;
+  int s;
+  int w;
+  int b;
+  
+	for (s = 0; s < MSG_SUMMARY_WORDS; s++) {
+		if (backlog->free_summary[s] != 0) {
+		  break;
 		}
 	}
-	
-	return -1;
+
+  if (s == MSG_SUMMARY_WORDS) {
+    return -1;
+  }
+  
+  w = s * 32 + __builtin_ctz(backlog->free_summary[s]);
+  b = __builtin_ctz(backlog->free_bitmap[w]);
+  
+  backlog->free_bitmap[w] &= ~(1u << b);
+  
+  if (backlog->free_bitmap[w] == 0) {
+    backlog->free_summary[s] &= ~(1u << (w % 32));
+  }
+  
+  return w * 32 + b;
 }
 
 
-/*
+/* @brief   Return a msgid to the free bitmap of a message backlog
  *
+ * @param   backlog, the message backlog to free the msgid to
+ * @param   msgid, message ID to free
  */
 void free_msgid(struct MsgBacklog *backlog, msgid_t msgid)
 {
-  if (msgid < 0 || msgid >= backlog->backlog_sz) {
+  if (msgid >= backlog->backlog_sz) {
   	return;
   }
   
-  backlog->free_bitmap |= (1<<msgid);
-  backlog->msg[msgid] = NULL;
+  backlog->free_bitmap[msgid / 32] |= (1u << (msgid % 32));
+  backlog->free_summary[msgid / 1024] |= (1u << ((msgid / 32) % 32));
+  backlog->msg[msgid / MSGS_PER_PAGE][msgid % MSGS_PER_PAGE] = NULL;
+}
+
+
+/* @brief   Deliver the reply of a message sent by sys_sendrec_async()
+ *
+ * @param   msg, the message of the AsyncMsg that has been replied to
+ * @return  0 on success
+ *
+ * The AsyncMsg is freed once its EVFILT_MSGREPLY knote has been delivered
+ * or deleted.
+ */
+static int asyncmsg_complete(struct Msg *msg)
+{
+  struct AsyncMsg *amsg;
+  struct KNote *kn;
+  
+  amsg = (struct AsyncMsg *)msg;
+  amsg->replied = true;
+  
+  if (LIST_HEAD(&amsg->knote_list) == NULL) {
+    free_asyncmsg(amsg);
+    return 0;
+  }
+
+  for (kn = LIST_HEAD(&amsg->knote_list); kn != NULL; kn = LIST_NEXT(kn, object_link)) {
+    kn->data = (void *)msg->reply_status;
+  }
+  
+  knote(&amsg->knote_list, NOTE_MSG);
+  return 0;
+}
+
+
+/* @brief   Get a message sent by a process with sys_sendrec_async()
+ *
+ * @param   proc, process that sent the message
+ * @param   id, ident returned by sys_sendrec_async()
+ * @return  the AsyncMsg or NULL if the id is invalid
+ */
+struct AsyncMsg *get_asyncmsg(struct Process *proc, int id)
+{
+  struct AsyncMsg *amsg;
+  
+  if (id < 0 || id >= max_asyncmsg) {
+    return NULL;
+  }
+  
+  amsg = &asyncmsg_table[id];
+  
+  if (amsg->in_use == false || amsg->owner != proc) {
+    return NULL;
+  }
+  
+  return amsg;
+}
+
+
+/* @brief   Return an AsyncMsg to the free list
+ */
+void free_asyncmsg(struct AsyncMsg *amsg)
+{
+  KASSERT(amsg->in_use == true);
+  
+  amsg->in_use = false;
+  amsg->owner = NULL;
+  LIST_ADD_TAIL(&asyncmsg_free_list, amsg, free_link);
+}
+
+
+/* @brief   Detach an exiting process from the messages it sent asynchronously
+ *
+ * @param   proc, process that is exiting
+ *
+ * Messages still waiting for a reply have their user IOVs invalidated so
+ * that the server's reads and writes of them fail, they are freed when the
+ * server replies. Knotes of replies not yet collected are deleted.
+ */
+void abort_asyncmsgs(struct Process *proc)
+{
+  struct AsyncMsg *amsg;
+  struct KNote *knote;
+  
+  for (int t = 0; t < max_asyncmsg; t++) {
+    amsg = &asyncmsg_table[t];
+    
+    if (amsg->in_use == false || amsg->owner != proc) {
+      continue;
+    }
+    
+    amsg->owner = NULL;
+    amsg->msg.as = NULL;
+    
+    // A replied message is freed by free_knote() with its last knote
+    while ((knote = LIST_HEAD(&amsg->knote_list)) != NULL) {
+      free_knote(knote->kqueue, knote);
+    }
+  }
+}
+
+
+/* @brief   Copy part of an IOV out to the current process
+ *
+ * @param   msg, message the IOV belongs to
+ * @param   iov, IOV to copy from
+ * @param   dst, user address to copy to
+ * @param   src, address within the IOV to copy from
+ * @param   sz, number of bytes to copy
+ * @return  0 on success, negative errno on failure
+ *
+ * IOV_USER IOVs are in the sender's address space. Whole pages of an
+ * IOV_ZEROCOPY IOV that are page aligned in both the IOV and the process
+ * are loaned to the process as copy-on-write pages instead of being copied.
+ * Pages that cannot be loaned are copied.
+ */
+static int copyout_iov(struct Msg *msg, struct IOV *iov, void *dst, void *src, size_t sz)
+{
+  struct AddressSpace *as;
+  
+  if (iov->flags & IOV_USER) {
+    if (msg->as == NULL) {
+      return -EFAULT;
+    }
+    
+    return pmap_interprocess_copy(&get_current_process()->as, dst, msg->as, src, sz);
+  }
+  
+  if (iov->flags & IOV_ZEROCOPY) {
+    as = &get_current_process()->as;
+
+    while (sz >= PAGE_SIZE && ((vm_addr)dst % PAGE_SIZE) == 0 && ((vm_addr)src % PAGE_SIZE) == 0) {
+      if (loan_buf_page(as, (vm_addr)dst, (vm_addr)src) != 0) {
+        break;
+      }
+      
+      dst += PAGE_SIZE;
+      src += PAGE_SIZE;
+      sz -= PAGE_SIZE;
+    }
+  }
+  
+  return CopyOut(dst, src, sz);
+}
+
+
+/* @brief   Copy part of an IOV in from the current process
+ *
+ * @param   msg, message the IOV belongs to
+ * @param   iov, IOV to copy to
+ * @param   dst, address within the IOV to copy to
+ * @param   src, user address to copy from
+ * @param   sz, number of bytes to copy
+ * @return  0 on success, negative errno on failure
+ *
+ * IOV_USER IOVs are in the sender's address space. Whole pages of an
+ * IOV_ZEROCOPY IOV that are page aligned in both the IOV and the process
+ * are moved into the IOV's buf, the process keeps them as a copy-on-write
+ * loan. Pages that cannot be moved are copied.
+ */
+static int copyin_iov(struct Msg *msg, struct IOV *iov, void *dst, void *src, size_t sz)
+{
+  struct AddressSpace *as;
+  
+  if (iov->flags & IOV_USER) {
+    if (msg->as == NULL) {
+      return -EFAULT;
+    }
+
+    return pmap_interprocess_copy(msg->as, dst, &get_current_process()->as, src, sz);
+  }
+  
+  if (iov->flags & IOV_ZEROCOPY) {
+    as = &get_current_process()->as;
+
+    while (sz >= PAGE_SIZE && ((vm_addr)dst % PAGE_SIZE) == 0 && ((vm_addr)src % PAGE_SIZE) == 0) {
+      if (lend_user_page(as, (vm_addr)src, (vm_addr)dst) != 0) {
+        break;
+      }
+      
+      dst += PAGE_SIZE;
+      src += PAGE_SIZE;
+      sz -= PAGE_SIZE;
+    }
+  }
+  
+  return CopyIn(dst, src, sz);
+}
+
+
+/* @brief   Fault in the pages of a sender's IOVs
+ *
+ * @param   iov_cnt, number of IOVs
+ * @param   iov, IOVs in the current process's address space
+ * @param   write, true to also break copy-on-write sharing for writing
+ * @return  0 on success, -EFAULT if a page is not accessible
+ *
+ * The server copies to and from the IOVs with pmap_interprocess_copy() which
+ * needs the pages to be present and, for replies, privately writable. The
+ * file cache also uses it so that no page fault occurs while it holds a buf.
+ * Pages are faulted in with fault_in_page(), user data is not touched.
+ */
+int prefault_iov(int iov_cnt, struct IOV *iov, bool write)
+{
+  vm_addr va;
+  vm_addr ceiling;
+  bits32_t access;
+  
+  access = (write) ? PROT_WRITE : PROT_READ;
+  
+  for (int t = 0; t < iov_cnt; t++) {
+    va = (vm_addr)iov[t].addr;
+    ceiling = va + iov[t].size;
+    
+    if (ceiling < va) {
+      return -EFAULT;
+    }
+    
+    while (va < ceiling) {
+      if (fault_in_page(va, access) != 0) {
+        return -EFAULT;
+      }
+      
+      va = ALIGN_DOWN(va, PAGE_SIZE) + PAGE_SIZE;
+    }
+  }
+  
+  return 0;
 }
 
 
@@ -106,8 +106,6 @@ static int do_open(struct lookupdata *ld, int oflags, mode_t mode) {
       vnode_put(dvnode);      
       return err;
     }
-
-//    DNameEnter(dvnode, vnode, ld->last_component);
   } else {
 // FIXME:   if (vnode->vnode_mounted_here != NULL) {
       //	        vnode_put(vnode);
@@ -124,6 +122,9 @@ static int do_open(struct lookupdata *ld, int oflags, mode_t mode) {
       vnode_put(vnode);
       return err;
     }
+    
+    vnode->size = 0;
+    btruncate(vnode);
   }
 
   fd = alloc_fd_filp(current);
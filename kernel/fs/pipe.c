@@ -252,6 +252,7 @@ ssize_t read_from_pipe(struct VNode *vnode, void *_dst, size_t sz)
     nbytes_read += nbytes_to_copy;
    
     TaskWakeupAll (&pipe->rendez);
+    knote(&vnode->knote_list, NOTE_WRITABLE);
   }
 
   Info ("..Pipe read, read:%d, st:%d", nbytes_read, status);    
@@ -334,6 +335,7 @@ ssize_t write_to_pipe(struct VNode *vnode, void *_src, size_t sz)
     nbytes_written += nbytes_to_copy;
 
     TaskWakeupAll (&pipe->rendez);    
+    knote(&vnode->knote_list, NOTE_READABLE);
   }
 
   Info ("..pipe write, wrote:%d, st:%d", nbytes_written, status);
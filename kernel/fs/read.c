@@ -69,7 +69,7 @@ ssize_t sys_read(int fd, void *dst, size_t sz)
   if (S_ISCHR(vnode->mode)) {
     xfered = read_from_char (vnode, dst, sz);
   } else if (S_ISREG(vnode->mode)) {
-    xfered = read_from_cache (vnode, dst, sz, &filp->offset, false);
+    xfered = read_from_cache (vnode, dst, sz, &filp->offset, &filp->readahead, false);
   } else if (S_ISFIFO(vnode->mode)) {
     xfered = read_from_pipe (vnode, dst, sz);  
   } else if (S_ISBLK(vnode->mode)) {
@@ -119,7 +119,7 @@ ssize_t kread(int fd, void *dst, size_t sz) {
   vnode_lock(vnode);
   
   if (S_ISREG(vnode->mode)) {
-    xfered = read_from_cache (vnode, dst, sz, &filp->offset, true);
+    xfered = read_from_cache (vnode, dst, sz, &filp->offset, &filp->readahead, true);
   } else {
     xfered = -EBADF;
   }
@@ -24,22 +24,23 @@
 
 /* @brief   Write all mounted filesystems to disk
  *
- * Send sync message to all mounted filesystems
+ * Writes the dirty cached blocks of every superblock that has a delayed-write
+ * timing wheel and waits for them to complete.
  */
 int sys_sync(void)
 {
-/*
   struct SuperBlock *sb;
+  int sc = 0;
   
-  sb = LIST_HEAD(&mounted_superblock_list);
-  
-  while (sb != NULL) {
-    sc = vfs_syncfs(sb);
-  
-    sb = LIST_NEXT(sb, mounted_superblock_link);
+  for (int t = 0; t < max_superblock; t++) {
+    sb = &superblock_table[t];
+    
+    if (sb->delwri_timing_wheel != NULL && bsyncfs(sb) != 0) {
+      sc = -EIO;
+    }
   }
-*/    
-  return -ENOSYS;
+
+  return sc;
 }
 
 
@@ -49,10 +49,13 @@ int sys_truncate(int fd, size_t sz) {
     goto exit;
   }
 
-  if ((err = vfs_truncate(vnode, 0)) != 0) {
+  if ((err = vfs_truncate(vnode, sz)) != 0) {
     goto exit;
   }
 
+  vnode->size = sz;
+  btruncate(vnode);
+
   // TODO: Check if size has gone up or down.
   knote(&vnode->knote_list, NOTE_EXTEND | NOTE_ATTRIB);
   vnode_unlock(vnode);
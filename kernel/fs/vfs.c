@@ -43,8 +43,8 @@ int vfs_lookup(struct VNode *dvnode, char *name, struct VNode **result)
   struct VNode *vnode;
   struct fsreq req = {0};
   struct fsreply reply = {0};
-  struct IOV siov[2];
-  struct IOV riov[1];
+  struct IOV siov[2] = {0};
+  struct IOV riov[1] = {0};
   size_t name_sz;
   int sc;
 
@@ -126,8 +126,8 @@ int vfs_create(struct VNode *dvnode, char *name, int oflags,
   struct VNode *vnode;
   struct fsreq req = {0};
   struct fsreply reply = {0};
-  struct IOV siov[2];
-  struct IOV riov[1];
+  struct IOV siov[2] = {0};
+  struct IOV riov[1] = {0};
   size_t name_sz;
   int sc;
 
@@ -185,6 +185,7 @@ int vfs_create(struct VNode *dvnode, char *name, int oflags,
   vnode->gid = reply.args.create.gid;
   vnode->mode = reply.args.create.mode;
   vnode->flags = V_VALID;
+  dname_enter(dvnode, vnode, name);
 
   Info("vfs_create result: vnode:%08x, ino:%d", (uint32_t)vnode, vnode->inode_nr);
   *result = vnode;
@@ -198,8 +199,8 @@ ssize_t vfs_read(struct VNode *vnode, void *dst, size_t nbytes, off64_t *offset)
 {
   struct SuperBlock *sb;
   struct fsreq req = {0};
-  struct IOV siov[1];
-  struct IOV riov[1];
+  struct IOV siov[1] = {0};
+  struct IOV riov[1] = {0};
   int nbytes_read;
 
   KASSERT(vnode != NULL);
@@ -245,7 +246,7 @@ ssize_t vfs_write(struct VNode *vnode, void *src, size_t nbytes, off64_t *offset
 {
   struct SuperBlock *sb;
   struct fsreq req = {0};
-  struct IOV siov[2];
+  struct IOV siov[2] = {0};
   int nbytes_written;
 
   Info("vfs_write nbytes:%d, offset:%08x", nbytes, (uint32_t)offset);
@@ -282,46 +283,124 @@ ssize_t vfs_write(struct VNode *vnode, void *src, size_t nbytes, off64_t *offset
 }
 
 
-/* @brief   Write a cached file block asynchronously
+/* @brief   Read a run of cached file blocks asynchronously
+ *
+ * @param   sb, superblock of the file's mount
+ * @param   buf, first buf of a run of adjacent bufs linked by cluster_next
+ * @return  0 on success, negative errno on failure
+ *
+ * The request and IOV list are held in the first buf. The riov lists the
+ * data page of each buf in the run so that the filesystem handler can read
+ * the whole run with one request. The data IOVs are flagged IOV_ZEROCOPY so
+ * that page aligned replies move the handler's pages into the bufs. The
+ * reply is completed by bdflush_brelse().
+ */
+int vfs_read_async(struct SuperBlock *sb, struct Buf *buf)
+{
+  struct VNode *vnode;
+  struct Buf *b;
+  int iov_cnt;
+  int sc;
+  
+  vnode = buf->vnode;
+  iov_cnt = 0;
+  
+  for (b = buf; b != NULL && iov_cnt < MAX_CLUSTERS_PER_REQ; b = b->cluster_next) {
+    buf->siov[1 + iov_cnt].addr = b->data;
+    buf->siov[1 + iov_cnt].size = CLUSTER_SZ;
+    buf->siov[1 + iov_cnt].flags = IOV_ZEROCOPY;
+    iov_cnt++;
+  }
+
+  KASSERT(b == NULL);
+
+  memset(&buf->req, 0, sizeof buf->req);
+  buf->req.cmd = CMD_READ;
+  buf->req.args.read.inode_nr = vnode->inode_nr;
+  buf->req.args.read.offset = buf->cluster_offset;
+  buf->req.args.read.sz = iov_cnt * CLUSTER_SZ;
+
+  buf->siov[0].addr = &buf->req;
+  buf->siov[0].size = sizeof buf->req;
+  buf->siov[0].flags = 0;
+
+  buf->msg.as = NULL;
+  buf->msg.siov_cnt = 1;
+  buf->msg.siov = &buf->siov[0];
+  buf->msg.riov_cnt = iov_cnt;
+  buf->msg.riov = &buf->siov[1];  
+	
+  sc = ksendmsg_async(&sb->msgport, (struct Msg *)buf, bdflush_brelse);
+  return sc;
+}
+
+
+/* @brief   Write a run of cached file blocks asynchronously
+ *
+ * @param   sb, superblock of the file's mount
+ * @param   buf, first buf of a run of adjacent bufs linked by cluster_next
+ * @return  0 on success, negative errno on failure
+ *
+ * The siov lists the fsreq followed by the data page of each buf in the run.
+ * The last page is trimmed to the file size. The data IOVs are flagged
+ * IOV_ZEROCOPY so that page aligned reads loan the buf pages to the handler.
+ * On failure the bufs are untouched and still owned by the caller.
  */
 int vfs_write_async(struct SuperBlock *sb, struct Buf *buf)
 {
   struct VNode *vnode;
+  struct Buf *b;
   size_t nbytes;
+  size_t nbytes_total;
+  int iov_cnt;
   int sc;
-	struct Process *current;
 	
   Info("vfs_write_async buf:%08x, offset:%08x", (uint32_t)buf, (uint32_t)buf->cluster_offset);
-  
-  current = get_current_process();
     
   vnode = buf->vnode;
-  
-  if (vnode->size - buf->cluster_offset < CLUSTER_SZ) {
-    nbytes = vnode->size - buf->cluster_offset;
-  } else {
-    nbytes = CLUSTER_SZ;
-  }    
+  iov_cnt = 0;
+  nbytes_total = 0;
+  
+  for (b = buf; b != NULL && iov_cnt < MAX_CLUSTERS_PER_REQ; b = b->cluster_next) {
+    if (b->cluster_offset >= vnode->size) {
+      nbytes = 0;
+    } else if (vnode->size - b->cluster_offset < CLUSTER_SZ) {
+      nbytes = vnode->size - b->cluster_offset;
+    } else {
+      nbytes = CLUSTER_SZ;
+    }    
+
+    buf->siov[1 + iov_cnt].addr = b->data;
+    buf->siov[1 + iov_cnt].size = nbytes;
+    buf->siov[1 + iov_cnt].flags = IOV_ZEROCOPY;
+    nbytes_total += nbytes;
+    iov_cnt++;
+  }
+
+  KASSERT(b == NULL);
   
   memset(&buf->req, 0, sizeof buf->req);
   buf->req.cmd = CMD_WRITE;
   buf->req.args.write.inode_nr = vnode->inode_nr;
   buf->req.args.write.offset = buf->cluster_offset;
-  buf->req.args.write.sz = nbytes;
+  buf->req.args.write.sz = nbytes_total;
 
   buf->siov[0].addr = &buf->req;
   buf->siov[0].size = sizeof buf->req;
-  buf->siov[1].addr = buf->data;
-  buf->siov[1].size = nbytes;
+  buf->siov[0].flags = 0;
 
-  buf->msg.reply_port = NULL;  
-  buf->msg.siov_cnt = NELEM(buf->siov);
+  buf->msg.as = NULL;
+  buf->msg.siov_cnt = 1 + iov_cnt;
   buf->msg.siov = buf->siov;
   buf->msg.riov_cnt = 0;
   buf->msg.riov = NULL;  
-  buf->msg.reply_status = 0;
 	
-  sc = kputmsg(&sb->msgport, (struct Msg *)buf);
+  sc = ksendmsg_async(&sb->msgport, (struct Msg *)buf, bdflush_brelse);
+  
+  if (sc == 0) {
+    vnode->write_pending_cnt += iov_cnt;
+  }
+  
   return sc;
 }
 
@@ -334,8 +413,8 @@ int vfs_readdir(struct VNode *vnode, void *dst, size_t nbytes, off64_t *cookie)
   struct fsreq req = {0};
   struct fsreply reply = {0};
   struct SuperBlock *sb;
-  struct IOV siov[1];
-  struct IOV riov[2];
+  struct IOV siov[1] = {0};
+  struct IOV riov[2] = {0};
   int nbytes_read;
 
   sb = vnode->superblock;
@@ -373,8 +452,8 @@ int vfs_mknod(struct VNode *dir, char *name, struct stat *stat, struct VNode **r
   struct fsreq req = {0};
   struct fsreply reply = {0};
   struct SuperBlock *sb;
-  struct IOV siov[2];
-  struct IOV riov[1];
+  struct IOV siov[2] = {0};
+  struct IOV riov[1] = {0};
   struct VNode *vnode = NULL;
   int sc;
 
@@ -417,6 +496,7 @@ int vfs_mknod(struct VNode *dir, char *name, struct stat *stat, struct VNode **r
   vnode->gid = reply.args.mknod.gid;
   vnode->mode = reply.args.mknod.mode;
   vnode->flags = V_VALID;
+  dname_enter(dir, vnode, name);
 
   *result = vnode;
   return sc;
@@ -431,8 +511,8 @@ int vfs_mkdir(struct VNode *dir, char *name, struct stat *stat, struct VNode **r
   struct fsreq req = {0};
   struct fsreply reply = {0};
   struct SuperBlock *sb;
-  struct IOV siov[2];
-  struct IOV riov[1];
+  struct IOV siov[2] = {0};
+  struct IOV riov[1] = {0};
   struct VNode *vnode = NULL;
   int sc;
 
@@ -475,6 +555,7 @@ int vfs_mkdir(struct VNode *dir, char *name, struct stat *stat, struct VNode **r
   vnode->gid = reply.args.mknod.gid;
   vnode->mode = reply.args.mknod.mode;
   vnode->flags = V_VALID;
+  dname_enter(dir, vnode, name);
 
   *result = vnode;
   return sc;
@@ -489,8 +570,8 @@ int vfs_rmdir(struct VNode *dvnode, char *name)
   struct fsreq req = {0};
   struct fsreply reply = {0};
   struct SuperBlock *sb;
-  struct IOV siov[2];
-  struct IOV riov[1];
+  struct IOV siov[2] = {0};
+  struct IOV riov[1] = {0};
   int sc;
   
   sb = dvnode->superblock;
@@ -507,6 +588,7 @@ int vfs_rmdir(struct VNode *dvnode, char *name)
   riov[0].addr = &reply;
   riov[0].size = sizeof reply;
 
+  dname_remove(dvnode, name);
   sc = ksendmsg(&sb->msgport, NELEM(siov), siov, NELEM(riov), riov);  
   return sc;
 }
@@ -520,11 +602,15 @@ int vfs_truncate(struct VNode *vnode, size_t size)
   struct fsreq req = {0};
   struct fsreply reply = {0};
   struct SuperBlock *sb;
-  struct IOV siov[1];
-  struct IOV riov[1];  
+  struct IOV siov[1] = {0};
+  struct IOV riov[1] = {0};
   int sc;
   int sz;
 
+  if (vnode->text_cnt > 0) {
+    return -ETXTBSY;
+  }
+
   sb = vnode->superblock;
 
   req.cmd = CMD_TRUNCATE;
@@ -560,8 +646,8 @@ int vfs_chmod(struct VNode *vnode, mode_t mode)
   struct fsreq req = {0};
   struct fsreply reply = {0};
   struct SuperBlock *sb;
-  struct IOV siov[1];
-  struct IOV riov[1];
+  struct IOV siov[1] = {0};
+  struct IOV riov[1] = {0};
   int sc;
   
   sb = vnode->superblock;
@@ -589,8 +675,8 @@ int vfs_chown(struct VNode *vnode, uid_t uid, gid_t gid)
   struct fsreq req = {0};
   struct fsreply reply = {0};
   struct SuperBlock *sb;
-  struct IOV siov[1];
-  struct IOV riov[1];
+  struct IOV siov[1] = {0};
+  struct IOV riov[1] = {0};
   int sc;
   
   sb = vnode->superblock;
@@ -621,8 +707,8 @@ int vfs_unlink(struct VNode *dvnode, char *name)
   struct fsreq req = {0};
   struct fsreply reply = {0};
   struct SuperBlock *sb;
-  struct IOV siov[2];
-  struct IOV riov[1];
+  struct IOV siov[2] = {0};
+  struct IOV riov[1] = {0};
   int sc;
   
   sb = dvnode->superblock;
@@ -639,6 +725,7 @@ int vfs_unlink(struct VNode *dvnode, char *name)
   riov[0].addr = &reply;
   riov[0].size = sizeof reply;
   
+  dname_remove(dvnode, name);
   sc = ksendmsg(&sb->msgport, NELEM(siov), siov, NELEM(riov), riov);
   return sc;
 }
@@ -664,13 +751,14 @@ int vfs_rdlink(struct VNode *vnode, char *buf, size_t sz)
 }
 
 
-/*
+/* @brief   Write a file's dirty cached blocks to its filesystem handler
  *
+ * There is no sync command in the filesystem handler protocol, so this
+ * is only as durable as the handler's own write path.
  */
 int vfs_fsync(struct VNode *vnode)
 {
-	Error("vfs_fsync -ENOTSUP");
-  return -ENOTSUP;
+  return bsync(vnode);
 }
 
 
@@ -681,7 +769,7 @@ int vfs_isatty(struct VNode *vnode)
 {
   struct fsreq req = {0};
   struct SuperBlock *sb;
-  struct IOV siov[1];
+  struct IOV siov[1] = {0};
   int sc;
   
   sb = vnode->superblock;
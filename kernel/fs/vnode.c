@@ -111,10 +111,15 @@ struct VNode *vnode_new(struct SuperBlock *sb, int inode_nr)
   }
 
   LIST_REM_HEAD(&vnode_free_list, vnode_entry);
+  vnode->flags &= ~V_FREE;
 
-  // Remove existing vnode from DNLC and file cache
-  // DNamePurgeVNode(vnode);
-  // BSync(vnode)
+  // Remove existing vnode from the name and file caches
+  if (vnode->superblock != NULL) {
+    dname_purge_vnode(vnode);
+    bsync(vnode);
+    bdiscard(vnode, 0);
+  }
+  
   // TODO: Need to handle case if vnode is not in cache and no free slot availble,
   // release any existing vnode (remember to flush buf cache of file) and reuse it.    
 
@@ -125,6 +130,7 @@ struct VNode *vnode_new(struct SuperBlock *sb, int inode_nr)
   vnode->busy = true;
   vnode->reader_cnt = 0;
   vnode->writer_cnt = 0;
+  vnode->poll_events = 0;
 
   vnode->superblock = sb;
   vnode->flags = 0;
@@ -149,6 +155,9 @@ struct VNode *vnode_new(struct SuperBlock *sb, int inode_nr)
   vnode->nlink = 0;  // hard links count
     
   LIST_INIT(&vnode->buf_list);
+  LIST_INIT(&vnode->dirty_buf_list);
+  vnode->write_pending_cnt = 0;
+  vnode->text_cnt = 0;
   LIST_INIT(&vnode->vnode_list);
   LIST_INIT(&vnode->directory_list);
   LIST_INIT(&vnode->knote_list);
@@ -183,6 +192,7 @@ struct VNode *vnode_get(struct SuperBlock *sb, int inode_nr)
 
       if ((vnode->flags & V_FREE) == V_FREE) {
         LIST_REM_ENTRY(&vnode_free_list, vnode, vnode_entry);
+        vnode->flags &= ~V_FREE;
       }
 
       return vnode;
@@ -212,6 +222,8 @@ void vnode_inc_ref(struct VNode *vnode)
  */
 void vnode_put(struct VNode *vnode)
 {
+  bool unreferenced;
+
   KASSERT(vnode != NULL);
   KASSERT(vnode->superblock != NULL);
   // KASSERT(vnode->busy == true);     // Fails if vnode and parent are same path = "/." then most ops do 2 VNodePuts on same vnode.
@@ -238,6 +250,13 @@ void vnode_put(struct VNode *vnode)
     }
   }
   
+  unreferenced = (vnode->reference_cnt == 0);
+
+  // Knotes must not outlive the last reference, the vnode may be recycled
+  if (unreferenced) {
+    knote_clear(&vnode->knote_list, 0);
+  }
+
   TaskWakeupAll(&vnode->rendez);
 }
 
@@ -256,6 +275,8 @@ void vnode_free(struct VNode *vnode)
 
   vnode->busy = false;
   vnode->reference_cnt = 0;
+
+  knote_clear(&vnode->knote_list, 0);
   TaskWakeupAll(&vnode->rendez);
 }
 
@@ -33,6 +33,7 @@ struct Buf;
 struct Msgport;
 struct ISRHandler;
 struct KQueue;
+struct AddressSpace;
 
 // List types
 LIST_TYPE(Buf, buf_list_t, buf_link_t);
@@ -63,9 +64,9 @@ LIST_TYPE(DelWriMsg, delwrimsg_list_t, delwrimsg_link_t);
 // Sizes
 #define MAX_SYMLINK     32     // Limit of number of symlinks that can be followed
 
-#define NR_DNAME        64     // Number of entries in directory name lookup cache (DNLC)
+#define NR_DNAME        1024   // Number of entries in directory name lookup cache (DNLC)
 #define DNAME_SZ        64
-#define DNAME_HASH      32
+#define DNAME_HASH      512    // Buckets of the DNLC hash table, power of 2
 
 #define NR_DELWRI_BUCKETS  (PAGE_SIZE / sizeof(buf_list_t))
 
@@ -74,9 +75,9 @@ LIST_TYPE(DelWriMsg, delwrimsg_list_t, delwrimsg_link_t);
 #define NR_SUPERBLOCK   128
 #define NR_FILP         1024
 #define NR_VNODE        1024
-#define BUF_HASH        32
+#define BUF_HASH_SHIFT  10
+#define BUF_HASH        (1 << BUF_HASH_SHIFT)   // Buckets in the global (vnode, offset) buf hash
 #define NR_PIPE         64
-#define NR_BUF          1024    // Dynamically allocate ?
 #define NR_MSGID2MSG    256     // Must match NPROCESS or greater
 
 // Buffer size and number of hash table entries
@@ -86,7 +87,8 @@ LIST_TYPE(DelWriMsg, delwrimsg_list_t, delwrimsg_link_t);
 #define CACHE_CEILING_VA            0xD0000000
 
 #define CLUSTER_SZ      4096        // TODO: Enlarge back to 16K ?
-#define NBUF_HASH       128
+#define CACHE_MIN_BUFS  64          // Smallest limit resize_cache() accepts, in bufs
+#define MAX_CLUSTERS_PER_REQ  16    // Most adjacent clusters sent in one CMD_READ or CMD_WRITE
 
 #define MAX_ARGS_SZ     0x10000   // Size of buffers for args and environment variables used during exec 
 
@@ -96,14 +98,18 @@ LIST_TYPE(DelWriMsg, delwrimsg_list_t, delwrimsg_link_t);
 //#define BDFLUSH_SOFTCLOCK_TICKS       50   // time between buckets on delayed-write timing wheels
 #define DELWRI_DELAY_TICKS            500  // Time in ticks to delay a delayed-write
 
+#define READAHEAD_MIN_CLUSTERS        2    // Initial read-ahead window once sequential access is seen
+#define READAHEAD_MAX_CLUSTERS        32   // Largest read-ahead window (128KB with 4K clusters)
+
 
 /* @brief   A single cluster of a file in the file buffer cache
  */
 struct Buf
 {  
   struct Msg msg;
-  struct IOV siov[2];							// fsreq for CMD_WRITE and buf->data
+  struct IOV siov[1 + MAX_CLUSTERS_PER_REQ];  // fsreq followed by data of each buf in the request
   struct fsreq req;
+  struct Buf *cluster_next;       // Next adjacent buf of a multi-cluster async request
 
   struct Rendez rendez;
   bits32_t flags;
@@ -111,16 +117,19 @@ struct Buf
 
   off64_t cluster_offset;					// TODO: Rename to file_offset
   void *data;                     // Address of the page-sized buffer holding cached file data
+  int mapped_cnt;                 // Count of user mappings of the buf's pages
 
   buf_link_t free_link;           // Free list entry
   buf_link_t lookup_link;         // Hash table entry
+  buf_link_t vnode_link;          // Entry on the vnode's buf_list
   buf_link_t delwri_hash_link;    // Delayed write hash table entry  
+  buf_link_t dirty_link;          // Entry on the vnode's dirty_buf_list
   
   uint64_t expiration_time;       // Time that a delayed-write block should be flushed
 };
 
 // Buf.flags
-#define B_FREE      (1 << 0)  // On free list
+#define B_FREE      (1 << 0)  // On empty list, no pages mapped
 #define B_VALID     (1 << 2)  // Valid, on lookup hash list
 #define B_BUSY      (1 << 3)  // Busy
 #define B_ERROR     (1 << 4)  // Buf is not valid (discarded in brelse)
@@ -161,6 +170,7 @@ struct VNode
   int busy;           // For locking fields of VNode
   int reader_cnt;     // For read/write access of character devices
   int writer_cnt;     // For read/write access of character devices
+  short poll_events;  // POLLIN/POLLOUT readiness last reported by a device's driver
 
   struct SuperBlock *superblock;
 
@@ -190,7 +200,10 @@ struct VNode
   vnode_link_t hash_entry;
   vnode_link_t vnode_entry;
   
-  buf_list_t buf_list;
+  buf_list_t buf_list;              // All bufs of this file in the cache
+  buf_list_t dirty_buf_list;        // Bufs on the delayed-write timing wheel
+  int write_pending_cnt;            // Number of bufs with async writes in progress
+  int text_cnt;                     // Number of mappings of the file as executable text
   
   dname_list_t vnode_list;          // List of all dname entries pointing to this vnode
   dname_list_t directory_list;      // List of all entries within this directory
@@ -202,6 +215,7 @@ struct VNode
 #define V_VALID (1 << 2)
 #define V_ROOT (1 << 3)
 #define V_ABORT (1 << 4)
+#define V_WRITE_ERROR (1 << 5)    // An async write failed since the last bwait()
 
 
 /* @brief   SuperBlock data structure for a mounted filesystem.
@@ -241,9 +255,10 @@ struct SuperBlock
  */
 struct DName {
   struct VNode *dir_vnode;
-  struct VNode *vnode;
+  struct VNode *vnode;          // NULL for a negative entry
   char name[DNAME_SZ];
-  int hash_key;
+  uint32_t hash;
+  int hash_key;                 // Bucket in dname_hash or -1 if unused
   
   dname_link_t lru_link;
   dname_link_t hash_link;
@@ -252,6 +267,15 @@ struct DName {
 };
 
 
+/* @brief   Sequential read-ahead state of an open file
+ */
+struct ReadAhead {
+  off64_t next_offset;    // Offset a sequential read is expected to start at
+  off64_t async_offset;   // Cluster-aligned offset up to which read-ahead has been issued
+  int window;             // Number of clusters to read ahead, 0 if access is random
+};
+
+
 /* @brief   File pointer of an open file
  */
 struct Filp {
@@ -269,6 +293,7 @@ struct Filp {
   uint32_t flags;     // Access flags, e.g. O_READ, O_WRITE
   int reference_cnt;
   filp_link_t filp_entry;   // VNode link
+  struct ReadAhead readahead;
 };
 
 // Filp.type
@@ -325,23 +350,45 @@ ssize_t read_from_block (struct VNode *vnode, void *dst, size_t sz, off64_t *off
 ssize_t write_to_block (struct VNode *vnode, void *dst, size_t sz, off64_t *offset);
 
 /* fs/cache.c */
-ssize_t read_from_cache (struct VNode *vnode, void *src, size_t nbytes, off64_t *offset, bool inkernel);
+ssize_t read_from_cache (struct VNode *vnode, void *src, size_t nbytes, off64_t *offset,
+                         struct ReadAhead *ra, bool inkernel);
 ssize_t write_to_cache (struct VNode *vnode, void *src, size_t nbytes, off64_t *offset);
 struct Buf *bread(struct VNode *vnode, uint64_t cluster_base);
 struct Buf *bread_zero(struct VNode *vnode, uint64_t cluster_base);
+int breada(struct VNode *vnode, uint64_t cluster_base, int cluster_cnt);
+int breada_run(struct VNode *vnode, struct Buf *head);
+void start_readahead(struct VNode *vnode, struct ReadAhead *ra, off64_t offset, off64_t end_offset);
 int bwrite(struct Buf *buf);
 int bawrite(struct Buf *buf);
 int bdwrite(struct Buf *buf);
+int bwrite_run(struct SuperBlock *sb, struct Buf *head);
 void brelse(struct Buf *buf);
 struct Buf *getblk(struct VNode *vnode, uint64_t cluster_base);
 struct Buf *findblk(struct VNode *vnode, uint64_t cluster_base);
+uint32_t buf_hash_key(struct VNode *vnode, uint64_t cluster_offset);
+void bhash(struct Buf *buf, struct VNode *vnode, uint64_t cluster_offset);
+void bunhash(struct Buf *buf);
+int bsync(struct VNode *vnode);
+int bsyncfs(struct SuperBlock *sb);
+int bflush(struct VNode *vnode);
+int bwait(struct VNode *vnode);
 int btruncate(struct VNode *vnode);
-size_t resize_cache(size_t free);
+void bdiscard(struct VNode *vnode, off64_t offset);
+int alloc_buf_pages(struct Buf *buf);
+struct Pageframe *free_buf_pages(struct Buf *buf);
+struct Pageframe *reclaim_cache_pageframe(void);
+void put_spare_pageframe(struct Pageframe *pf);
+struct Pageframe *get_spare_pageframe(void);
+int resize_cache(int page_limit);
 int init_superblock_bdflush(struct SuperBlock *sb);
 void deinit_superblock_bdflush(struct SuperBlock *sb);
 int sys_bdflush(int fd);
 int bdflush_brelse(struct Msg *msg);
 struct Buf *find_delayed_write_buf(struct SuperBlock *sb, uint64_t softclock);
+void unhash_delayed_write_buf(struct SuperBlock *sb, struct Buf *buf);
+void hash_delayed_write_buf(struct Buf *buf, uint64_t expiration_time);
+void remove_delayed_write_buf(struct Buf *buf);
+struct Buf *gather_delayed_writes(struct SuperBlock *sb, struct Buf *buf);
 
 
 /* fs/char.c */
@@ -416,6 +463,19 @@ char *path_token(struct lookupdata *ld);
 bool is_last_component(struct lookupdata *ld);
 int walk_component (struct lookupdata *ld);
 
+/* fs/mmap.c */
+void *sys_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int sys_munmap(void *addr, size_t len);
+int file_page_fault(struct AddressSpace *as, vm_addr addr, bits32_t access);
+void prefault_mapped_file(struct AddressSpace *as, vm_addr addr, vm_size len);
+void ref_file_page(vm_addr pa);
+void unmap_file_page(struct AddressSpace *as, vm_addr va, vm_addr pa, bits32_t flags);
+int map_text_file(struct AddressSpace *as, vm_addr addr);
+void release_mapped_files(struct AddressSpace *as, vm_addr addr, vm_size len);
+void fork_mapped_files(struct AddressSpace *new_as, struct AddressSpace *old_as);
+int loan_buf_page(struct AddressSpace *as, vm_addr va, vm_addr kva);
+int lend_user_page(struct AddressSpace *as, vm_addr va, vm_addr kva);
+
 /* fs/mount.c */
 int sys_pivotroot(char *_new_root, char *_old_root);
 int sys_movemount(char *_new_mount, char *old_mount);
@@ -471,6 +531,7 @@ int sys_fsync(int fd);
 /* fs/vfs.c */
 ssize_t vfs_read(struct VNode *vnode, void *buf, size_t nbytes, off64_t *offset);
 ssize_t vfs_write(struct VNode *vnode, void *buf, size_t nbytes, off64_t *offset);
+int vfs_read_async(struct SuperBlock *sb, struct Buf *buf);
 int vfs_write_async(struct SuperBlock *sb, struct Buf *buf);
 int vfs_readdir(struct VNode *vnode, void *buf, size_t bytes, off64_t *cookie);
 int vfs_lookup(struct VNode *dir, char *name, struct VNode **result);
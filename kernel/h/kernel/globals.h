@@ -31,7 +31,9 @@ extern pageframe_list_t free_64k_pf_list;
 /*
  * Timer
  */
-extern timer_list_t timing_wheel[JIFFIES_PER_SECOND];
+extern timer_list_t timing_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+extern timer_list_t hrtimer_list;
+extern timer_list_t hrtimer_expired_list;
 extern struct Rendez timer_rendez;
 
 // extern timer_list_t free_timer_list;
@@ -41,6 +43,7 @@ extern struct Rendez timer_rendez;
 extern volatile spinlock_t timer_slock;
 extern volatile long hardclock_time;
 extern volatile long softclock_time;
+extern bool timer_tick_stopped;
 extern superblock_list_t free_superblock_list;
 
 
@@ -61,7 +64,7 @@ extern isr_handler_list_t isr_handler_list[NIRQ];
  */
 extern int max_cpu;
 extern int cpu_cnt;
-extern struct CPU cpu_table[1];
+extern struct CPU cpu_table[MAX_CPU];
 
 extern int max_process;
 extern struct Process *process_table;
@@ -72,8 +75,8 @@ extern struct Process *root_process;
  * Scheduler
  */
 
-extern process_circleq_t sched_queue[32];
-extern uint32_t sched_queue_bitmap;
+extern struct SchedQueue sched_queue[MAX_CPU];
+extern spinlock_t sched_slock;
 
 extern int bkl_locked;
 extern spinlock_t inkernel_now;
@@ -131,7 +134,11 @@ extern int max_knote;
 extern struct KNote *knote_table;
 extern knote_list_t knote_free_list;
 
-extern knote_list_t knote_hash[KNOTE_HASH_SZ];
+extern knote_list_t fs_knote_list;
+
+extern int max_asyncmsg;
+extern struct AsyncMsg *asyncmsg_table;
+extern asyncmsg_list_t asyncmsg_free_list;
 
 
 /*
@@ -156,6 +163,10 @@ extern struct Buf *buf_table;
 
 extern buf_list_t buf_hash[BUF_HASH];
 extern buf_list_t buf_avail_list;
+extern buf_list_t buf_empty_list;
+extern int buf_page_cnt;
+extern int buf_page_limit;
+extern pageframe_list_t buf_spare_pf_list;
 
 
 
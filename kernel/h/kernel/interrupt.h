@@ -14,6 +14,13 @@ struct ISRHandler;
 // List types
 LIST_TYPE(ISRHandler, isr_handler_list_t, isr_handler_link_t);
 
+
+/*
+ * Inter-processor interrupts, sent with send_ipi()
+ */
+#define IPI_RESCHEDULE  0     // Pick the next process, a process was readied on the CPU
+
+
 /*
  * @brief   Interrupt handler callback
  */
@@ -56,6 +63,7 @@ void interrupt_dpc(void);
 // HAL Board Specific Functions
 void enable_irq(int irq);
 void disable_irq(int irq);
+void send_ipi(int cpu_id, int ipi);
 
 
 
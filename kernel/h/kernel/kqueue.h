@@ -3,6 +3,7 @@
 
 
 #include <kernel/lists.h>
+#include <kernel/timer.h>
 #include <kernel/types.h>
 #include <sys/event.h>
 
@@ -22,7 +23,13 @@ LIST_TYPE(KQueue, kqueue_list_t, kqueue_link_t);
  */
 #define NR_KQUEUE 128
 #define NR_KNOTE  2048
-#define KNOTE_HASH_SZ 64
+#define KQUEUE_HASH_MIN_SZ  16    // Buckets of the hash embedded in a kqueue, power of 2
+#define KQUEUE_HASH_LOAD    2     // Average chain length at which the hash is grown
+#define KEVENT_BATCH_SZ 16   // kevents copied in or out of sys_kevent() at a time
+
+// Kernel hints raising the EVFILT_READ and EVFILT_WRITE knotes of a vnode
+#define NOTE_READABLE   0x01000000
+#define NOTE_WRITABLE   0x02000000
 
 /*
  * KQueue
@@ -37,6 +44,11 @@ struct KQueue
   kqueue_link_t free_link;    
   knote_list_t knote_list;
   knote_list_t pending_list;
+  
+  knote_list_t *hash;             // Knotes indexed by ident and filter
+  int hash_sz;                    // Number of buckets, power of 2
+  int knote_cnt;
+  knote_list_t hash_min[KQUEUE_HASH_MIN_SZ];  // Initial buckets, replaced by a page when grown
 };
 
 
@@ -46,7 +58,7 @@ struct KQueue
 struct KNote
 {
   knote_link_t link;          // free list
-  knote_link_t hash_link;     // hash table lookup;  
+  knote_link_t hash_link;     // kqueue's hash table lookup;  
   knote_link_t kqueue_link;   // kqueue's list of knotes
   knote_link_t pending_link;  // kqueue's list of pending knote events
   knote_link_t object_link;   // List of knotes attached to object being monitored (e.g. vnode, process)
@@ -65,6 +77,10 @@ struct KNote
   void *udata;	              // opaque user data identifier
 	
   void *object;               // opaque pointer to vnode, msgport, isr_handler, process  
+
+  struct Timer timer;         // EVFILT_TIMER expiration
+  uint64_t timer_period_us;   // EVFILT_TIMER period, microseconds
+  uint64_t timer_next_us;     // EVFILT_TIMER next expiration, microseconds
 };
 
 
@@ -80,6 +96,7 @@ int sys_kevent(int kq, const struct kevent	*changelist, int nchanges,
                struct	kevent *eventlist, int nevents, const struct timespec *timeout);
 
 int knote(knote_list_t *note_list, int hint);
+void knote_clear(knote_list_t *knote_list, int hint);
 
 int close_kqueue(struct Process *proc, int fd);
 
@@ -7,10 +7,13 @@
 #include <kernel/sync.h>
 #include <kernel/kqueue.h>
 #include <sys/syscalls.h>
+#include <sys/fsreq.h>
 #include <unistd.h>
 
 
 // Forward declarations
+struct AddressSpace;
+struct AsyncMsg;
 struct Process;
 struct Msg;
 struct MsgBacklog;
@@ -18,9 +21,20 @@ struct MsgPort;
 
 // List types
 LIST_TYPE(Msg, msg_list_t, msg_link_t);
+LIST_TYPE(AsyncMsg, asyncmsg_list_t, asyncmsg_link_t);
 
 // Constants
-#define MAX_MSG_BACKLOG       32
+#define MAX_MSG_BACKLOG       4096    // Max backlog_sz of sys_createmsgport()
+#define MSGS_PER_PAGE         (PAGE_SIZE / sizeof (struct Msg *))
+#define MSG_BACKLOG_PAGES     (MAX_MSG_BACKLOG / MSGS_PER_PAGE)
+#define MSG_BITMAP_WORDS      (MAX_MSG_BACKLOG / 32)
+#define MSG_SUMMARY_WORDS     (MSG_BITMAP_WORDS / 32)
+#define MAX_SENDREC_IOV       8       // Max siov_cnt and riov_cnt of sys_sendrec()
+#define MAX_MSGVEC            16      // Max cnt of sys_getmsgv() and sys_replymsgv()
+#define NR_ASYNCMSG           256     // Messages in flight from sys_sendrec_async()
+
+// Kernel-only IOV flags
+#define IOV_USER              (1<<31) // addr is in the sender's address space, msg->as
 
 
 /* @brief   Kernel Message
@@ -32,6 +46,9 @@ struct Msg
                               // Set to reply_port on reply, so any msgid_to_msg fails after replymsg
                               
   struct MsgPort *reply_port; // The reply port to reply to
+  struct Process *sender;     // Process waiting for the reply, switched to on reply
+  struct AddressSpace *as;    // Address space of the IOV addresses, NULL if kernel
+  int (*complete)(struct Msg *msg); // Called on reply if there is no reply port
   int reply_status;  
   int siov_cnt;
   struct IOV *siov;
@@ -40,14 +57,39 @@ struct Msg
 };
 
 
+/* @brief   Message sent by sys_sendrec_async()
+ *
+ * The IOVs are held here as the sender carries on running. The reply is
+ * delivered to the sender's kqueue as an EVFILT_MSGREPLY event with an
+ * ident of the index of the AsyncMsg in asyncmsg_table.
+ */
+struct AsyncMsg
+{
+  struct Msg msg;             // Must be first, asyncmsg_complete() casts the Msg back
+  asyncmsg_link_t free_link;
+  bool in_use;
+  bool replied;
+  struct Process *owner;      // Process that sent it, NULL once it has exited
+  knote_list_t knote_list;    // EVFILT_MSGREPLY knote on the sender's kqueue
+  struct fsreq req;
+  struct IOV siov[1 + MAX_SENDREC_IOV];
+  struct IOV riov[MAX_SENDREC_IOV];
+};
+
+
 /* @brief		MsgID to Msg lookup table for a message port.
  *
+ * Bit N of free_bitmap is set if msgid N is free. Bit N of free_summary is
+ * set if word N of free_bitmap has any bit set, so a free msgid is found
+ * with two find-first-set operations. The bitmap and the msg tables are
+ * allocated in pages by init_msgbacklog() according to backlog_sz.
  */
 struct MsgBacklog
 {
 	int backlog_sz;
-	uint32_t free_bitmap;
-	struct Msg *msg[MAX_MSG_BACKLOG];
+	uint32_t free_summary[MSG_SUMMARY_WORDS];
+	uint32_t *free_bitmap;
+	struct Msg **msg[MSG_BACKLOG_PAGES];
 };
 
 
@@ -59,6 +101,7 @@ struct MsgPort
   msg_list_t pending_msg_list;
   knote_list_t knote_list;    
   void *context;              // For pointer to superblock or other data
+  struct Process *server;     // Process that last got a message, for direct handoff
 };
 
 
@@ -70,12 +113,16 @@ struct MsgPort
  * Prototypes
  */
 int sys_sendrec(int fd, int siov_cnt, struct IOV *siov, int riov_cnt, struct IOV *riov);
+int sys_sendrec_async(int kq, int fd, int siov_cnt, struct IOV *siov, int riov_cnt, struct IOV *riov);
 int sys_getmsg(int server_fd, msgid_t *msgid, void *buf, size_t buf_sz);
 int sys_replymsg(int server_fd, msgid_t msgid, int status, void *buf, size_t buf_sz);
+int sys_getmsgv(int server_fd, struct msgvec *vec, int cnt);
+int sys_replymsgv(int server_fd, struct msgvec *vec, int cnt);
 int sys_readmsg(int server_fd, msgid_t msgid, void *buf, size_t buf_sz, off_t offset);
 int sys_writemsg(int server_fd, msgid_t msgid, void *buf, size_t buf_sz, off_t offset);
 
 int ksendmsg(struct MsgPort *msgport, int siov_cnt, struct IOV *siov, int riov_cnt, struct IOV *riov);
+int ksendmsg_async(struct MsgPort *msgport, struct Msg *msg, int (*complete)(struct Msg *msg));
 int kputmsg(struct MsgPort *msgport, struct Msg *msg);
 int kreplymsg(struct Msg *msg);
 struct Msg *kgetmsg(struct MsgPort *port);
@@ -83,6 +130,7 @@ struct Msg *kpeekmsg(struct MsgPort *port);
 
 int kwaitport(struct MsgPort *msgport, struct timespec *timeout);
 int seekiov(int iov_cnt, struct IOV *iov, off_t offset, int *i, size_t *iov_remaining);
+int prefault_iov(int iov_cnt, struct IOV *iov, bool write);
 
 void assign_msgid(struct MsgBacklog *backlog, msgid_t msgid, struct Msg *msg);
 struct Msg *msgid_to_msg(struct MsgBacklog *backlog, msgid_t msgid);
@@ -92,6 +140,11 @@ void free_msgid(struct MsgBacklog *backlog, msgid_t msgid);
 int init_msgport(struct MsgPort *msgport);
 int fini_msgport(struct MsgPort *msgport);
 int init_msgbacklog(struct MsgBacklog *msgbacklog, int backlog);
+void fini_msgbacklog(struct MsgBacklog *msgbacklog);
+
+struct AsyncMsg *get_asyncmsg(struct Process *proc, int id);
+void free_asyncmsg(struct AsyncMsg *amsg);
+void abort_asyncmsgs(struct Process *proc);
 
 #endif
 
@@ -69,6 +69,7 @@ typedef struct SysInfo {
 // Scheduler related
 #define SCHED_IDLE -1             // Scheduling policy not defined in C library
 #define SCHED_QUANTA_JIFFIES  5   // Reschedule if task has ran for this many timer ticks
+#define SCHED_CACHE_LINE_SZ   64  // Alignment of the ready queue heads
 
 // Process.flags
 #define PROCF_USER     0          // User process
@@ -124,6 +125,7 @@ struct Process {
   int exit_status;        // Exit() error code
   process_list_t child_list;
   process_link_t child_link;
+  knote_list_t knote_list;  // EVFILT_PROC knotes watching this process
   
   // Move into struct Identity    
   int pid;
@@ -138,6 +140,18 @@ struct Process {
 };
 
 
+/* @brief   Ready queues of a CPU
+ *
+ * Each CPU schedules from its own queues. Bit n of bitmap is set when
+ * queue[n] is not empty. Aligned so CPUs do not share cache lines.
+ */
+struct SchedQueue
+{
+  uint32_t bitmap;
+  process_circleq_t queue[32];
+} __attribute__((aligned(SCHED_CACHE_LINE_SZ)));
+
+
 /*
  * Function Prototypes
  */
@@ -160,18 +174,28 @@ void SchedUnlock(void);
 void Reschedule(void);
 void SchedReady(struct Process *proc);
 void SchedUnready(struct Process *proc);
+void SchedStartProcess(void);
+void SchedExit(void);
 
 void InitRendez(struct Rendez *rendez);
 void TaskSleep(struct Rendez *rendez);
+void TaskSleepHandoff(struct Rendez *rendez, struct Process *next);
+void TaskYieldTo(struct Process *next);
 int TaskTimedSleep(struct Rendez *rendez, struct timespec *ts);
+int TaskSleepUntil(struct Rendez *rendez, uint64_t expiration_us);
 void TaskWakeup(struct Rendez *rendez);
 void TaskWakeupAll(struct Rendez *rendez);
 void TaskWakeupFromISR(struct Rendez *rendez);
 
 void KernelLock(void);
 void KernelUnlock(void);
+void KernelPreemptionPoint(void);
 bool IsKernelLocked(void);
 
+// proc/sysconf.c
+int sys_sysconf(int name);
+int sys_setsysconf(int name, long value);
+
 
 // Architecture-specific
 
@@ -17,6 +17,18 @@ struct Rendez
 };
 
 
+/* Spinlocks
+ *
+ * The BKL is acquired on kernel entry and TaskSleep() releases it. State
+ * shared with interrupt handlers and other CPUs is protected by spinlocks:
+ *
+ *   sched_slock      ready queues, rendez blocked lists and BKL state
+ *   timer_slock      timing_wheel, hrtimer_list and hardclock_time
+ *
+ * Where both are held sched_slock is taken first.
+ */
+
+
 /* @brief   Kernel mutex, to eventually replace the big kernel lock on syscall entry
  */
 #if 0 
@@ -18,6 +18,19 @@ LIST_TYPE(Timer, timer_list_t, timer_list_link_t);
 #define MICROSECONDS_PER_JIFFY  10000ll
 #define NANOSECONDS_PER_JIFFY   10000000ll
 
+// Hierarchical timing wheel, a slot of level n spans TIMER_WHEEL_SLOTS^n jiffies
+#define TIMER_WHEEL_BITS        6
+#define TIMER_WHEEL_SLOTS       (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK        (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS      5
+#define TIMER_MAX_TIMEOUT       ((1ll << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+// Longest time the timer interrupt is stopped for when all CPUs are idle
+#define TIMER_MAX_IDLE_JIFFIES  (60 * JIFFIES_PER_SECOND)
+
+// Timeouts shorter than this are high resolution timers, in microseconds
+#define HRTIMER_MAX_TIMEOUT     (JIFFIES_PER_SECOND * MICROSECONDS_PER_JIFFY)
+
 
 /*
  * Timer
@@ -26,10 +39,14 @@ struct Timer
 {
   timer_list_link_t timer_entry;
   bool armed;
-  long long expiration_time;
+  long long expiration_time;   // Jiffies, or microseconds on the hrtimer_list
   void *arg;
   void (*callback)(struct Timer *timer);
   struct Process *process;
+  timer_list_t *bucket;       // Timing wheel slot or hrtimer_list while armed
+  bool bottom_half;           // Callback is always run by the timer bottom half
+  uint32_t seq;               // Advanced by the owner when a use of the timer ends
+  uint32_t expired_seq;       // seq when last disarmed, checked by callbacks
 };
 
 
@@ -38,14 +55,26 @@ struct Timer
  */
 int sys_alarm(int seconds);
 int sys_sleep(int seconds);
+int sys_nanosleep(struct timespec *_req, struct timespec *_rem);
+int sys_clock_nanosleep(int clock_id, int flags, struct timespec *_req, struct timespec *_rem);
 int SetAlarm();
 int SetTimeout (int milliseconds, void (*callback)(struct Timer *timer), void *arg);
 uint64_t get_hardclock(void);
+void arm_timer(struct Timer *timer);
+void disarm_timer(struct Timer *timer);
+void arm_hrtimer(struct Timer *timer);
+void arm_timeout(struct Timer *timer, uint64_t expiration_us);
+uint64_t timespec_to_microsecs(const struct timespec *ts);
 void TimerTopHalf(void);
 void TimerBottomHalf(void);
+void TimerTickRestart(void);
+void HRTimerTopHalf(void);
 
-// Architecture-specific busy-wait sleep
-int arch_spin_nanosleep(struct timespec *reg);
+// Architecture-specific timer interrupt sources
+uint64_t arch_read_hardclock(void);
+void arch_set_timer_event(uint64_t expiration_time);
+uint64_t arch_read_hrclock(void);
+void arch_set_hrtimer_event(uint64_t expiration_us);
 
 
 #endif
@@ -8,6 +8,8 @@
 
 // Forward declarations
 struct Pageframe;
+struct VNode;
+struct Buf;
 
 // Linked list types
 LIST_TYPE(Pageframe, pageframe_list_t, pageframe_list_link_t);
@@ -19,6 +21,7 @@ LIST_TYPE(Pageframe, pageframe_list_t, pageframe_list_link_t);
 #define MEM_ALLOC     (2 << 28)
 #define MEM_PHYS      (3 << 28)
 #define MEM_FREE      (4 << 28)
+#define MEM_FILE      (5 << 28)    // Page of a buf in the file cache, mapped by mmap()
 
 #define MAP_COW       (1 << 26)
 #define MAP_USER      (1 << 27)
@@ -35,15 +38,20 @@ LIST_TYPE(Pageframe, pageframe_list_t, pageframe_list_link_t);
 #define PGF_KERNEL      (1 << 3)
 #define PGF_USER        (1 << 4)
 #define PGF_PAGETABLE   (1 << 5)
+#define PGF_WIRED       (1 << 6)    // Permanently mapped into a file cache buf
 
 // Number of segments in an address space 
 #define NSEGMENT 32
 
+// Number of mmap() file mappings in an address space
+#define NMAPPEDFILE 16
+
 // Lower bits of AddressSpace.segment_table[]
 #define SEG_TYPE_FREE 0
 #define SEG_TYPE_ALLOC 1
 #define SEG_TYPE_PHYS 2
 #define SEG_TYPE_CEILING 3
+#define SEG_TYPE_FILE 4
 #define SEG_TYPE_MASK 0x0000000f
 #define SEG_ADDR_MASK 0xfffff000
 
@@ -56,6 +64,7 @@ struct Pageframe
   vm_addr physical_addr;
   int reference_cnt;                      // Count of vpage references.
   bits32_t flags;
+  struct Buf *buf;                        // Buf in the file cache owning this page or NULL
   pageframe_list_link_t link;            // cache lru, busy link.  (busy and LRU on separate lists?)
   pageframe_list_link_t free_slab_link;
   struct PmapPageframe pmap_pageframe;
@@ -65,6 +74,24 @@ struct Pageframe
 };
 
 
+/* @brief   A file mapped into an address space with mmap()
+ *
+ * vnode is NULL if the entry is free. Pages are mapped on demand by
+ * page_fault() from the bufs of the file cache.
+ */
+struct MappedFile
+{
+  vm_addr base;
+  vm_size size;
+  struct VNode *vnode;
+  off_t offset;                           // File offset of base
+  bits32_t flags;                         // PROT_ and MAP_SHARED or MAP_PRIVATE
+};
+
+// MappedFile.flags
+#define MF_TEXT       (1 << 30)    // Executable text, counted in the vnode's text_cnt
+
+
 /* @brief   Address space of a process
  *
  * TODO: Convert segments back to list of memregions instead of small array
@@ -77,6 +104,7 @@ struct AddressSpace
   struct Pmap pmap;
   vm_addr segment_table[NSEGMENT];
   int segment_cnt;
+  struct MappedFile mapped_file_table[NMAPPEDFILE];
 };
 
 
@@ -130,6 +158,7 @@ int pmap_interprocess_copy(struct AddressSpace *dst_as, void *dst,
                            size_t sz);
 
 // vm/pagefault.c
+int fault_in_page(vm_addr addr, bits32_t access);
 int page_fault(vm_addr addr, bits32_t access);
 
 // vm/vm.c
@@ -157,6 +186,7 @@ int CopyInString(void *dst, const void *src, size_t max_sz);
 void *kmalloc_page(void);
 void kfree_page(void *vaddr);
 struct Pageframe *alloc_pageframe(vm_size);
+struct Pageframe *alloc_pageframe_flags(vm_size, bits32_t flags);
 void free_pageframe(struct Pageframe *pf);
 void coalesce_slab(struct Pageframe *pf);
 
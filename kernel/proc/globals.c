@@ -42,10 +42,10 @@ struct Process *process_table;
 struct Process *root_process;
 
 /*
- * Scheduler
+ * Scheduler, per-CPU ready queues and the lock protecting them and the BKL
  */
-process_circleq_t sched_queue[32];
-uint32_t sched_queue_bitmap;
+struct SchedQueue sched_queue[MAX_CPU];
+spinlock_t sched_slock;
 int bkl_locked;
 spinlock_t inkernel_now;
 int inkernel_lock;
@@ -72,12 +72,15 @@ isr_handler_list_t pending_isr_dpc_list;
  * Timer
  */
 struct Process *timer_process;
-timer_list_t timing_wheel[JIFFIES_PER_SECOND];
+timer_list_t timing_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+timer_list_t hrtimer_list;
+timer_list_t hrtimer_expired_list;
 struct Rendez timer_rendez;
 
 volatile spinlock_t timer_slock;
 volatile long hardclock_time;
 volatile long softclock_time;
+bool timer_tick_stopped;
 
 // timer_list_t free_timer_list;
 // int max_timer;
@@ -74,6 +74,7 @@ int sys_fork(void)
   SchedReady(proc);
   EnableInterrupts();
 
+  knote(&current->knote_list, NOTE_FORK);
   return GetProcessPid(proc);
 }
 
@@ -87,7 +88,7 @@ void sys_exit(int status)
   struct Process *current;
   struct Process *parent;
   struct Process *child;
-  struct Process *proc;
+  struct KNote *knote;
   
   Info("sys_exit(%d)", status);
   
@@ -98,6 +99,7 @@ void sys_exit(int status)
 
   current->exit_status = status;
 
+  abort_asyncmsgs(current);
   fini_fproc(current);
   cleanup_address_space(&current->as);
 
@@ -126,32 +128,24 @@ void sys_exit(int status)
   if (current->pid == current->pgrp) {
 	  // FIXME: Kill (-current->pgrp, SIGHUP);
   }
+
+  // EVFILT_PROC knotes report the exit status and are detached
+  knote = LIST_HEAD(&current->knote_list);
+  
+  while (knote != NULL) {
+    knote->data = (void *)status;
+    knote = LIST_NEXT(knote, object_link);
+  }
+
+  knote_clear(&current->knote_list, NOTE_EXIT);
     
   TaskWakeup(&parent->rendez);
 
   DisableInterrupts();
   KASSERT(bkl_locked == true);
-  
-  if (bkl_owner != current) {
-      KASSERT(bkl_owner == current);
-  }
-  
-  proc = LIST_HEAD(&bkl_blocked_list);
-
-  if (proc != NULL) {
-    LIST_REM_HEAD(&bkl_blocked_list, blocked_link);
-    proc->state = PROC_STATE_READY;
-    bkl_owner = proc;
-    SchedReady(proc);
-  } else {
-    bkl_locked = false;
-    bkl_owner = NULL;
-  }
+  KASSERT(bkl_owner == current);
 
-  current->state = PROC_STATE_ZOMBIE;
-  SchedUnready(current);
-  Reschedule();
-  EnableInterrupts();
+  SchedExit();
 }
 
 
@@ -358,6 +352,7 @@ struct Process *AllocProcess(void) {
   
   InitRendez(&proc->rendez);
   LIST_INIT(&proc->child_list);
+  LIST_INIT(&proc->knote_list);
 
   return proc;
 }
@@ -23,6 +23,7 @@
 #include <kernel/dbg.h>
 #include <kernel/error.h>
 #include <kernel/globals.h>
+#include <kernel/interrupt.h>
 #include <kernel/msg.h>
 #include <kernel/proc.h>
 #include <kernel/types.h>
@@ -30,6 +31,15 @@
 
 // Static prototypes
 static void TaskTimedSleepCallback(struct Timer *timer);
+static void RescheduleLocked(void);
+static void SwitchTo(struct Process *next);
+static bool CanHandoff(struct Process *next);
+static void HandoffBKL(struct Process *next);
+static void DecayPriority(struct Process *proc);
+static void StealProcess(struct CPU *cpu);
+static void EnqueueProcess(struct Process *proc);
+static void DequeueProcess(struct Process *proc);
+static void ReleaseBKL(void);
 
 
 /* @brief   Perform a task switch
@@ -67,19 +77,44 @@ static void TaskTimedSleepCallback(struct Timer *timer);
  * At this point execution resumes after the "if" statement and the task is
  * switched.
  *
+ * On SMP the ready queues, the BKL state and rendez lists are protected by
+ * sched_slock. The lock is held across the switch and released by the
+ * process switched to, so no other CPU can pick the previous process until
+ * its context has been saved. A process running for the first time releases
+ * it in SchedStartProcess().
+ *
  * FIXME: Can we defer Fair-Share scheduling (e.g. lottery/stride) onto a DPC
  * scheduler task, like the timer task. Effectively this only schedules RTOS
  * round-robin tasks.  If no RTOS tasks, run the DPC task to choose a task.
  */
 void Reschedule(void)
 {
-  context_word_t context[N_CONTEXT_WORD];
-  struct Process *current, *next, *proc;
+  int_state_t int_state;
+  
+  int_state = DisableInterrupts();
+  SpinLock(&sched_slock);
+  RescheduleLocked();
+  SpinUnlock(&sched_slock);
+  RestoreInterrupts(int_state);
+}
+
+
+/* @brief   Pick the next process to run on this CPU and switch to it
+ *
+ * Called with sched_slock held. If this CPU has no ready processes it tries
+ * to take one from another CPU before falling back to its idle process.
+ */
+static void RescheduleLocked(void)
+{
+  struct Process *current, *next;
   struct CPU *cpu;
-  int q;
+  struct SchedQueue *sq;
 
   cpu = get_cpu();
   current = get_current_process();
+  sq = &sched_queue[cpu->cpu_id];
+
+  cpu->reschedule_request = false;
 
   if (current != NULL) {
     current->quanta_used ++;
@@ -87,39 +122,139 @@ void Reschedule(void)
     if (current->sched_policy == SCHED_RR) {
       KASSERT(current->priority >= 16 && current->priority < 32);
 
-      if ((CIRCLEQ_HEAD(&sched_queue[current->priority])) != NULL) {
-        CIRCLEQ_FORWARD(&sched_queue[current->priority], sched_entry);
+      if ((CIRCLEQ_HEAD(&sq->queue[current->priority])) != NULL) {
+        CIRCLEQ_FORWARD(&sq->queue[current->priority], sched_entry);
         current->quanta_used = 0;
       }
-    } else if (current->sched_policy == SCHED_OTHER) {
-      if (current->quanta_used == SCHED_QUANTA_JIFFIES) {      
-        if (current->priority > 1) {
-          CIRCLEQ_REM_HEAD(&sched_queue[current->priority], sched_entry);              
-          current->priority--;
-          CIRCLEQ_ADD_TAIL(&sched_queue[current->priority], current, sched_entry);        
-        } else {
-          CIRCLEQ_FORWARD(&sched_queue[current->priority], sched_entry);          
-        }       
-        current->quanta_used = 0;
-      }     
+    } else if (current->sched_policy == SCHED_OTHER
+               && current->quanta_used >= SCHED_QUANTA_JIFFIES) {
+      DecayPriority(current);
     }
   }
 
-  next = NULL;
+  if (sq->bitmap == 0) {
+    StealProcess(cpu);
+  }
 
-  if (sched_queue_bitmap != 0) {
-    for (q = 31; q >= 0; q--) {
-      if ((sched_queue_bitmap & (1 << q)) != 0)
-        break;
-    }
+  next = NULL;
 
-    next = CIRCLEQ_HEAD(&sched_queue[q]);
+  if (sq->bitmap != 0) {
+    next = CIRCLEQ_HEAD(&sq->queue[31 - __builtin_clz(sq->bitmap)]);
   }
 
   if (next == NULL) {
     next = cpu->idle_process;
   }
 
+  SwitchTo(next);
+}
+
+
+/* @brief   Take a ready process from another CPU's queues
+ *
+ * @param   cpu, CPU with empty ready queues
+ *
+ * Takes the highest priority process that is not running. The owner of the
+ * BKL is left where it is as it may be in an interrupt handler that has yet
+ * to signal the end of the interrupt to this CPU's interface of the GIC.
+ */
+static void StealProcess(struct CPU *cpu)
+{
+  struct CPU *victim;
+  struct SchedQueue *sq;
+  struct Process *proc;
+  struct Process *head;
+  uint32_t bitmap;
+  int q;
+
+  for (int t = 0; t < max_cpu; t++) {
+    victim = &cpu_table[t];
+
+    if (victim == cpu || victim->online == false) {
+      continue;
+    }
+
+    sq = &sched_queue[t];
+    bitmap = sq->bitmap;
+
+    while (bitmap != 0) {
+      q = 31 - __builtin_clz(bitmap);
+      head = CIRCLEQ_HEAD(&sq->queue[q]);
+      proc = head;
+
+      do {
+        if (proc != victim->current_process && proc != bkl_owner) {
+          CIRCLEQ_REM_ENTRY(&sq->queue[q], proc, sched_entry);
+
+          if (CIRCLEQ_HEAD(&sq->queue[q]) == NULL) {
+            sq->bitmap &= ~(1 << q);
+          }
+
+          proc->cpu = cpu;
+          CIRCLEQ_ADD_TAIL(&sched_queue[cpu->cpu_id].queue[q], proc, sched_entry);
+          sched_queue[cpu->cpu_id].bitmap |= (1 << q);
+          return;
+        }
+
+        proc = CIRCLEQ_NEXT(proc, sched_entry);
+      } while (proc != head);
+
+      bitmap &= ~(1 << q);
+    }
+  }
+}
+
+
+/* @brief   Lower the priority of a SCHED_OTHER process that used its quanta
+ *
+ * @param   proc, running process at the head of its ready queue
+ *
+ * The process moves to the tail of the next lower queue, or to the tail of
+ * its own queue at priority 1. The bitmap bits of both queues are kept in
+ * step so that Reschedule() can find the highest queue with a clz.
+ */
+static void DecayPriority(struct Process *proc)
+{
+  struct SchedQueue *sq;
+  int q;
+  
+  sq = &sched_queue[proc->cpu->cpu_id];
+  q = proc->priority;
+  proc->quanta_used = 0;
+
+  if (q <= 1) {
+    CIRCLEQ_FORWARD(&sq->queue[q], sched_entry);          
+    return;
+  }
+  
+  CIRCLEQ_REM_HEAD(&sq->queue[q], sched_entry);              
+
+  if (CIRCLEQ_HEAD(&sq->queue[q]) == NULL) {
+    sq->bitmap &= ~(1 << q);
+  }
+
+  q--;
+  proc->priority = q;
+  CIRCLEQ_ADD_TAIL(&sq->queue[q], proc, sched_entry);
+  sq->bitmap |= (1 << q);
+}
+
+
+/* @brief   Switch the CPU to a process
+ *
+ * @param   next, process to run, must be at the head of its ready queue
+ *
+ * See Reschedule() for how the register context is switched.
+ */
+static void SwitchTo(struct Process *next)
+{
+  context_word_t context[N_CONTEXT_WORD];
+  struct Process *current;
+  struct CPU *cpu;
+
+  cpu = get_cpu();
+  current = get_current_process();
+
   if (next != NULL) {
     next->state = PROC_STATE_RUNNING;
     pmap_switch(next, current);
@@ -129,28 +264,142 @@ void Reschedule(void)
     current->context = &context;
     cpu->current_process = next;
 
+    if (current == cpu->idle_process) {
+      TimerTickRestart();
+    }
+
     if (SetContext(&context[0]) == 0) {
       GetContext(next->context);
     }
   }
 }
 
+
+/* @brief   Check if the CPU and BKL can be handed directly to a process
+ *
+ * @param   next, process to hand off to
+ * @return  true if next is waiting for the BKL on this CPU and no ready
+ *          process on this CPU has a higher priority
+ *
+ * A process blocked on the BKL stays on its CPU, it may be in an interrupt
+ * handler that has yet to signal the end of the interrupt to the GIC.
+ */
+static bool CanHandoff(struct Process *next)
+{
+  struct CPU *cpu;
+
+  cpu = get_cpu();
+
+  if (next == NULL || next == get_current_process()
+      || next->state != PROC_STATE_BKL_BLOCKED || next->cpu != cpu) {
+    return false;
+  }
+
+  // Any ready queue above next's priority
+  if ((sched_queue[cpu->cpu_id].bitmap & ~((2u << next->priority) - 1)) != 0) {
+    return false;
+  }
+
+  return true;
+}
+
+
+/* @brief   Pass the BKL to a process and make it the next to run
+ *
+ * @param   next, process blocked on the BKL on this CPU
+ */
+static void HandoffBKL(struct Process *next)
+{
+  LIST_REM_ENTRY(&bkl_blocked_list, next, blocked_link);
+  next->state = PROC_STATE_READY;
+  bkl_owner = next;
+  EnqueueProcess(next);
+  CIRCLEQ_SET_HEAD(&sched_queue[next->cpu->cpu_id].queue[next->priority], next);
+}
+
+
+/* @brief   Pass the BKL to the next process blocked on it or release it
+ *
+ * Called with sched_slock held. The process given the BKL is readied on
+ * its own CPU.
+ */
+static void ReleaseBKL(void)
+{
+  struct Process *proc;
+
+  proc = LIST_HEAD(&bkl_blocked_list);
+
+  if (proc != NULL) {
+    LIST_REM_HEAD(&bkl_blocked_list, blocked_link);
+    proc->state = PROC_STATE_READY;
+    bkl_owner = proc;
+    EnqueueProcess(proc);
+  } else {
+    bkl_locked = false;
+    bkl_owner = (void *)0xdeadbeef;
+  }
+}
+
+
 /* @brief   Add process to a ready queue based on its scheduling policy and priority.
  */
 void SchedReady(struct Process *proc)
 {
-  struct Process *next;
+  int_state_t int_state;
+  
+  int_state = DisableInterrupts();
+  SpinLock(&sched_slock);
+  EnqueueProcess(proc);
+  SpinUnlock(&sched_slock);
+  RestoreInterrupts(int_state);
+}
+
+
+/* @brief   Removes process from the ready queue.
+ */
+void SchedUnready(struct Process *proc)
+{
+  int_state_t int_state;
+  
+  int_state = DisableInterrupts();
+  SpinLock(&sched_slock);
+  DequeueProcess(proc);
+  SpinUnlock(&sched_slock);
+  RestoreInterrupts(int_state);
+}
+
+
+/* @brief   Release the scheduler lock when a process first runs
+ *
+ * Called from StartForkProcess and StartKernelProcess. A new process does
+ * not return through SwitchTo() so releases sched_slock here instead.
+ */
+void SchedStartProcess(void)
+{
+  SpinUnlock(&sched_slock);
+}
+
+
+/* @brief   Add process to the ready queue of its CPU
+ *
+ * Called with sched_slock held. Sends a reschedule IPI if the process is
+ * readied on another CPU.
+ */
+static void EnqueueProcess(struct Process *proc)
+{
+  struct SchedQueue *sq;
   struct CPU *cpu;
 
-  cpu = get_cpu();
+  cpu = proc->cpu;
+  sq = &sched_queue[cpu->cpu_id];
 
   if (proc->sched_policy == SCHED_RR || proc->sched_policy == SCHED_FIFO) {
-    CIRCLEQ_ADD_TAIL(&sched_queue[proc->priority], proc, sched_entry);
-    sched_queue_bitmap |= (1 << proc->priority);
+    CIRCLEQ_ADD_TAIL(&sq->queue[proc->priority], proc, sched_entry);
+    sq->bitmap |= (1 << proc->priority);
 
   } else if (proc->sched_policy == SCHED_OTHER) {
-    CIRCLEQ_ADD_TAIL(&sched_queue[proc->priority], proc, sched_entry);
-    sched_queue_bitmap |= (1 << proc->priority);
+    CIRCLEQ_ADD_TAIL(&sq->queue[proc->priority], proc, sched_entry);
+    sq->bitmap |= (1 << proc->priority);
 
   } else {
     Error("Ready: Unknown sched policy %d", proc->sched_policy);
@@ -159,29 +408,37 @@ void SchedReady(struct Process *proc)
 
   proc->quanta_used = 0;
   cpu->reschedule_request = true;
+
+  if (cpu != get_cpu() && cpu->online == true) {
+    send_ipi(cpu->cpu_id, IPI_RESCHEDULE);
+  }
 }
 
 
-/* @brief   Removes process from the ready queue.
+/* @brief   Remove process from the ready queue of its CPU
+ *
+ * Called with sched_slock held.
  */
-void SchedUnready(struct Process *proc)
+static void DequeueProcess(struct Process *proc)
 {
+  struct SchedQueue *sq;
   struct CPU *cpu;
 
-  cpu = get_cpu();
+  cpu = proc->cpu;
+  sq = &sched_queue[cpu->cpu_id];
 
   if (proc->sched_policy == SCHED_RR || proc->sched_policy == SCHED_FIFO) {
-    CIRCLEQ_REM_ENTRY(&sched_queue[proc->priority], proc, sched_entry);
-    if (CIRCLEQ_HEAD(&sched_queue[proc->priority]) == NULL) {
-      sched_queue_bitmap &= ~(1 << proc->priority);
+    CIRCLEQ_REM_ENTRY(&sq->queue[proc->priority], proc, sched_entry);
+    if (CIRCLEQ_HEAD(&sq->queue[proc->priority]) == NULL) {
+      sq->bitmap &= ~(1 << proc->priority);
     }
 
     proc->quanta_used = 0;
     
   } else if (proc->sched_policy == SCHED_OTHER) {
-    CIRCLEQ_REM_ENTRY(&sched_queue[proc->priority], proc, sched_entry);
-    if (CIRCLEQ_HEAD(&sched_queue[proc->priority]) == NULL) {
-      sched_queue_bitmap &= ~(1 << proc->priority);
+    CIRCLEQ_REM_ENTRY(&sq->queue[proc->priority], proc, sched_entry);
+    if (CIRCLEQ_HEAD(&sq->queue[proc->priority]) == NULL) {
+      sq->bitmap &= ~(1 << proc->priority);
     }
 
     proc->priority = proc->desired_priority;
@@ -253,22 +510,42 @@ int sys_setschedparams(int policy, int priority)
  * and wakeup tasks blocked on a condition variable (rendez).
  * 
  * Interrupts are disabled upon entry to a syscall in the assembly code.
+ *
+ * The idle process cannot block. If the BKL is held by a process on another
+ * CPU it runs whatever is ready on this CPU until the BKL is released.
  */
 void KernelLock(void)
 {
   struct Process *current;
+  struct CPU *cpu;
+  int_state_t int_state;
 
+  cpu = get_cpu();
   current = get_current_process();
 
+  int_state = DisableInterrupts();
+  SpinLock(&sched_slock);
+
+  if (current == cpu->idle_process) {
+    while (bkl_locked == true) {
+      RescheduleLocked();
+      SpinUnlock(&sched_slock);
+      SpinLock(&sched_slock);
+    }
+  }
+
   if (bkl_locked == false) {
     bkl_locked = true;
     bkl_owner = current;
   } else {
     LIST_ADD_TAIL(&bkl_blocked_list, current, blocked_link);
     current->state = PROC_STATE_BKL_BLOCKED;
-    SchedUnready(current);
-    Reschedule();
+    DequeueProcess(current);
+    RescheduleLocked();
   }
+
+  SpinUnlock(&sched_slock);
+  RestoreInterrupts(int_state);
 }
 
 
@@ -285,23 +562,21 @@ void KernelLock(void)
  *
  * We do not have kernel preemption, effectively all processes blocked on the BKL
  * must run before we can return to user space.
+ *
+ * A process blocked on the BKL is readied on its own CPU, if that is another
+ * CPU this one returns to user mode while it runs there.
  */
 void KernelUnlock(void)
 {
-  struct Process *proc;
-
-  if (bkl_locked == true) {
-    proc = LIST_HEAD(&bkl_blocked_list);   // Pick the next process that is blocked on bkl
-
-    if (proc != NULL) {
-      bkl_locked = true;      // It should be locked already by previous if statement
-      bkl_owner = proc;
+  int_state_t int_state;
 
-      LIST_REM_HEAD(&bkl_blocked_list, blocked_link);
+  int_state = DisableInterrupts();
+  SpinLock(&sched_slock);
 
-      proc->state = PROC_STATE_READY;
-      SchedReady(proc);       // 
-      Reschedule();
+  if (bkl_locked == true) {
+    if (LIST_HEAD(&bkl_blocked_list) != NULL) {
+      ReleaseBKL();
+      RescheduleLocked();
     } else {
       bkl_locked = false;
       bkl_owner = (void *)0xcafef00d;
@@ -309,6 +584,95 @@ void KernelUnlock(void)
   } else {
     KernelPanic();
   }
+
+  SpinUnlock(&sched_slock);
+  RestoreInterrupts(int_state);
+}
+
+
+/* @brief   Let a higher priority process waiting for the BKL run
+ *
+ * The kernel is not preemptible, a process keeps the BKL until it sleeps or
+ * leaves the kernel. Long-running kernel paths call this between units of
+ * work, where no spinlocks are held, to bound the latency of a real-time
+ * process such as a driver woken by an interrupt.
+ *
+ * If a process with a higher priority than the current one is blocked on
+ * the BKL it is given the BKL and the current process is put at the head of
+ * the BKL blocked list, so it continues as soon as the other process leaves
+ * the kernel or sleeps.
+ */
+void KernelPreemptionPoint(void)
+{
+  struct Process *current;
+  struct Process *proc;
+  struct Process *next;
+  int_state_t int_state;
+
+  // Unlocked check, a process blocked after this waits for the next point
+  if (LIST_HEAD(&bkl_blocked_list) == NULL) {
+    return;
+  }
+
+  current = get_current_process();
+
+  int_state = DisableInterrupts();
+  SpinLock(&sched_slock);
+
+  KASSERT(bkl_locked == true);
+  KASSERT(bkl_owner == current);
+
+  next = NULL;
+
+  for (proc = LIST_HEAD(&bkl_blocked_list); proc != NULL; proc = LIST_NEXT(proc, blocked_link)) {
+    if (proc->priority > current->priority
+        && (next == NULL || proc->priority > next->priority)) {
+      next = proc;
+    }
+  }
+
+  if (next != NULL) {
+    LIST_REM_ENTRY(&bkl_blocked_list, next, blocked_link);
+    LIST_ADD_HEAD(&bkl_blocked_list, current, blocked_link);
+    current->state = PROC_STATE_BKL_BLOCKED;
+    DequeueProcess(current);
+
+    next->state = PROC_STATE_READY;
+    bkl_owner = next;
+    EnqueueProcess(next);
+    RescheduleLocked();
+
+    KASSERT(bkl_locked == true);
+    KASSERT(bkl_owner == current);
+  }
+
+  SpinUnlock(&sched_slock);
+  RestoreInterrupts(int_state);
+}
+
+
+/* @brief   Release the BKL and switch away from an exiting process
+ *
+ * Called by sys_exit(). The current process becomes a zombie and is not
+ * run again.
+ */
+void SchedExit(void)
+{
+  struct Process *current;
+
+  current = get_current_process();
+
+  DisableInterrupts();
+  SpinLock(&sched_slock);
+
+  KASSERT(bkl_locked == true);
+  KASSERT(bkl_owner == current);
+
+  ReleaseBKL();
+
+  current->state = PROC_STATE_ZOMBIE;
+  DequeueProcess(current);
+  RescheduleLocked();
 }
 
 
@@ -328,37 +692,107 @@ void InitRendez(struct Rendez *Rendez)
  */
 void TaskSleep(struct Rendez *rendez)
 {
-  struct Process *proc;
   struct Process *current;
   int_state_t int_state;
   
   current = get_current_process();
 
   int_state = DisableInterrupts();
+  SpinLock(&sched_slock);
 
   KASSERT(bkl_locked == true);
   KASSERT(bkl_owner == current);
 
-  proc = LIST_HEAD(&bkl_blocked_list);
+  ReleaseBKL();
+
+  LIST_ADD_TAIL(&rendez->blocked_list, current, blocked_link);
+  current->state = PROC_STATE_RENDEZ_BLOCKED;
+  DequeueProcess(current);
+  RescheduleLocked();
+
+  KASSERT(bkl_locked == true);
+  KASSERT(bkl_owner == current);
+
+  SpinUnlock(&sched_slock);
+  RestoreInterrupts(int_state);
+}
 
-  if (proc != NULL) {
-    LIST_REM_HEAD(&bkl_blocked_list, blocked_link);
-    proc->state = PROC_STATE_READY;
-    bkl_owner = proc;
-    SchedReady(proc);
-  } else {
-    bkl_locked = false;
-    bkl_owner = (void *)0xdeadbeef;
-  }
+
+/* @brief   Sleep on a Rendez condition variable and switch to a process
+ *
+ * @param   rendez, condition variable to sleep on
+ * @param   next, process blocked on the BKL to run next, may be NULL
+ *
+ * Used by synchronous message sends to pass the CPU and BKL straight to the
+ * server that will handle the message, without it waiting its turn on the
+ * BKL blocked list. Behaves as TaskSleep() if next cannot be handed off to.
+ */
+void TaskSleepHandoff(struct Rendez *rendez, struct Process *next)
+{
+  struct Process *current;
+  int_state_t int_state;
+  
+  current = get_current_process();
+
+  int_state = DisableInterrupts();
+  SpinLock(&sched_slock);
+
+  KASSERT(bkl_locked == true);
+  KASSERT(bkl_owner == current);
 
   LIST_ADD_TAIL(&rendez->blocked_list, current, blocked_link);
   current->state = PROC_STATE_RENDEZ_BLOCKED;
-  SchedUnready(current);
-  Reschedule();
+  DequeueProcess(current);
+
+  if (CanHandoff(next)) {
+    HandoffBKL(next);
+    SwitchTo(next);
+  } else {
+    ReleaseBKL();
+    RescheduleLocked();
+  }
+
+  KASSERT(bkl_locked == true);
+  KASSERT(bkl_owner == current);
+
+  SpinUnlock(&sched_slock);
+  RestoreInterrupts(int_state);
+}
+
+
+/* @brief   Yield the CPU and BKL to a process waiting for the BKL
+ *
+ * @param   next, process blocked on the BKL
+ *
+ * Used when replying to a synchronous message to switch straight back to
+ * the sender. The current process is first in line for the BKL when the
+ * sender leaves the kernel. Does nothing if next cannot be handed off to.
+ */
+void TaskYieldTo(struct Process *next)
+{
+  struct Process *current;
+  int_state_t int_state;
+  
+  current = get_current_process();
+
+  int_state = DisableInterrupts();
+  SpinLock(&sched_slock);
 
   KASSERT(bkl_locked == true);
   KASSERT(bkl_owner == current);
 
+  if (CanHandoff(next)) {
+    LIST_ADD_HEAD(&bkl_blocked_list, current, blocked_link);
+    current->state = PROC_STATE_BKL_BLOCKED;
+    DequeueProcess(current);
+    HandoffBKL(next);
+    SwitchTo(next);
+
+    KASSERT(bkl_locked == true);
+    KASSERT(bkl_owner == current);
+  }
+  
+  SpinUnlock(&sched_slock);
   RestoreInterrupts(int_state);
 }
 
@@ -373,7 +807,23 @@ void TaskSleep(struct Rendez *rendez)
  */
 int TaskTimedSleep(struct Rendez *rendez, struct timespec *ts)
 {
-  struct Process *proc;
+  return TaskSleepUntil(rendez, arch_read_hrclock() + timespec_to_microsecs(ts));
+}
+
+
+/* @brief   Sleep on a Rendez condition variable until a time of the system timer
+ *
+ * @param   rendez, condition variable to sleep on
+ * @param   expiration_us, time in microseconds to wake up at if the rendez
+ *          was not signalled
+ * @return  0 on success
+ *          -ETIMEDOUT if a timeout occured
+ *
+ * The timer is armed under sched_slock so that a high resolution timer
+ * expiring in an interrupt on another CPU cannot be missed.
+ */
+int TaskSleepUntil(struct Rendez *rendez, uint64_t expiration_us)
+{
   struct Process *current;
   struct Timer *timer;
   int_state_t int_state;
@@ -382,42 +832,32 @@ int TaskTimedSleep(struct Rendez *rendez, struct timespec *ts)
   current = get_current_process();
 
   int_state = DisableInterrupts();
+  SpinLock(&sched_slock);
 
   KASSERT(bkl_locked == true);
   KASSERT(bkl_owner == current);
 
-  proc = LIST_HEAD(&bkl_blocked_list);
-
-  if (proc != NULL) {
-    LIST_REM_HEAD(&bkl_blocked_list, blocked_link);
-    proc->state = PROC_STATE_READY;
-    bkl_owner = proc;
-    SchedReady(proc);
-  } else {
-    bkl_locked = false;
-    bkl_owner = (void *)0xdeadbeef;
-  }
+  ReleaseBKL();
     
   timer = &current->sleep_timer;  
   timer->process = current;
   timer->arg = rendez;
-  timer->armed = true;
   timer->callback = TaskTimedSleepCallback;
 
   SpinLock(&timer_slock);
-  timer->expiration_time = hardclock_time + (ts->tv_sec * JIFFIES_PER_SECOND + ts->tv_nsec / NANOSECONDS_PER_JIFFY);
+  arm_timeout(timer, expiration_us);
   SpinUnlock(&timer_slock);
-
-  LIST_ADD_TAIL(&timing_wheel[timer->expiration_time % JIFFIES_PER_SECOND], timer, timer_entry);
   
   LIST_ADD_TAIL(&rendez->blocked_list, current, blocked_link);
   current->state = PROC_STATE_RENDEZ_BLOCKED;
-  SchedUnready(current);
-  Reschedule();
+  DequeueProcess(current);
+  RescheduleLocked();
+
+  SpinUnlock(&sched_slock);
+  SpinLock(&timer_slock);
 
   if (timer->armed == true) {
-    LIST_REM_ENTRY(&timing_wheel[timer->expiration_time % JIFFIES_PER_SECOND], timer, timer_entry);
-    timer->armed = false;
+    disarm_timer(timer);
     timer->process = NULL;
     timer->callback = NULL;
     sc = 0;
@@ -425,6 +865,10 @@ int TaskTimedSleep(struct Rendez *rendez, struct timespec *ts)
     sc = -ETIMEDOUT;
   }
 
+  // A callback for this sleep that has not yet run now does nothing
+  timer->seq++;
+  SpinUnlock(&timer_slock);
+
   RestoreInterrupts(int_state);
   return sc;
 }
@@ -435,22 +879,35 @@ int TaskTimedSleep(struct Rendez *rendez, struct timespec *ts)
  * @param   timer, the timeout timer state created by TaskTimedSleep().
  *
  * This is called from the timer bottom half thread, so has the BKL
- * locked until it does a sleep
+ * locked until it does a sleep, or from the hrtimer interrupt handler.
+ *
+ * The callback runs without timer_slock, so the sleeper may already have
+ * returned and be blocked again by the time sched_slock is taken. The
+ * timer's seq then no longer matches the expired_seq recorded when this
+ * sleep's timer expired and the callback does nothing.
  */
 static void TaskTimedSleepCallback(struct Timer *timer)
 {
-  struct Process *proc = timer->process;
-  struct Rendez *rendez = timer->arg;
+  struct Process *proc;
+  struct Rendez *rendez;
   int_state_t int_state;
+  bool stale;
   
   int_state = DisableInterrupts();
+  SpinLock(&sched_slock);
+  SpinLock(&timer_slock);
+  stale = (timer->expired_seq != timer->seq);
+  proc = timer->process;
+  rendez = timer->arg;
+  SpinUnlock(&timer_slock);
 
-  if (proc != NULL && proc->state == PROC_STATE_RENDEZ_BLOCKED) {
+  if (!stale && proc != NULL && proc->state == PROC_STATE_RENDEZ_BLOCKED) {
     LIST_REM_ENTRY(&rendez->blocked_list, proc, blocked_link);
     LIST_ADD_TAIL(&bkl_blocked_list, proc, blocked_link);
     proc->state = PROC_STATE_BKL_BLOCKED;
   }
   
+  SpinUnlock(&sched_slock);
   RestoreInterrupts(int_state);
 }
 
@@ -465,6 +922,7 @@ void TaskWakeup(struct Rendez *rendez)
   int_state_t int_state;
   
   int_state = DisableInterrupts();
+  SpinLock(&sched_slock);
 
   proc = LIST_HEAD(&rendez->blocked_list);
 
@@ -474,6 +932,7 @@ void TaskWakeup(struct Rendez *rendez)
     proc->state = PROC_STATE_BKL_BLOCKED;
   }
 
+  SpinUnlock(&sched_slock);
   RestoreInterrupts(int_state);
 }
 
@@ -485,7 +944,8 @@ void TaskWakeup(struct Rendez *rendez)
 void TaskWakeupFromISR(struct Rendez *rendez)
 {
   struct Process *proc;
-  struct CPU *cpu;
+
+  SpinLock(&sched_slock);
 
   proc = LIST_HEAD(&rendez->blocked_list);
 
@@ -495,8 +955,7 @@ void TaskWakeupFromISR(struct Rendez *rendez)
     proc->state = PROC_STATE_BKL_BLOCKED;
   }
 
-//  cpu = get_cpu();  
-//  cpu->reschedule_request = true;
+  SpinUnlock(&sched_slock);
 }
 
 
@@ -509,23 +968,19 @@ void  TaskWakeupAll(struct Rendez *rendez)
   struct Process *proc;
   int_state_t int_state;
   
-  do {
-    int_state = DisableInterrupts();
-
-    proc = LIST_HEAD(&rendez->blocked_list);
+  int_state = DisableInterrupts();
+  SpinLock(&sched_slock);
 
-    if (proc != NULL) {
-      KASSERT(bkl_locked == true);
+  while ((proc = LIST_HEAD(&rendez->blocked_list)) != NULL) {
+    KASSERT(bkl_locked == true);
       
-      LIST_REM_HEAD(&rendez->blocked_list, blocked_link);
-      LIST_ADD_TAIL(&bkl_blocked_list, proc, blocked_link);
-      proc->state = PROC_STATE_BKL_BLOCKED;
-    }
-
-    proc = LIST_HEAD(&rendez->blocked_list);
-    RestoreInterrupts(int_state);
+    LIST_REM_HEAD(&rendez->blocked_list, blocked_link);
+    LIST_ADD_TAIL(&bkl_blocked_list, proc, blocked_link);
+    proc->state = PROC_STATE_BKL_BLOCKED;
+  }
 
-  } while (proc != NULL);
+  SpinUnlock(&sched_slock);
+  RestoreInterrupts(int_state);
 }
 
 
@@ -539,10 +994,3 @@ int sys_setpriority(void)
 {
 	return 0;
 }
-
-int sys_sysconf(void)
-{
-	Info ("sys_sysconf");
-	return -ENOSYS;
-}
-
@@ -15,25 +15,97 @@
  */
 
 /*
- * Scheduling related functions
+ * System configuration values
  */
 
 //#define KDEBUG
 
 #include <kernel/dbg.h>
 #include <kernel/error.h>
+#include <kernel/filesystem.h>
 #include <kernel/globals.h>
-#include <kernel/msg.h>
 #include <kernel/proc.h>
+#include <kernel/timer.h>
 #include <kernel/types.h>
-#include <kernel/arch.h>
-#include <kernel/fs.h>
+#include <kernel/vm.h>
 #include <unistd.h>
 
-/*
+
+/* @brief   Get a system configuration value
  *
+ * @param   name, _SC_ value to get
+ * @return  Value of the configuration variable or negative errno on failure
  */
 int sys_sysconf(int name)
 {
+  Info("sys_sysconf(%d)", name);
+
+  switch (name) {
+    case _SC_CHILD_MAX:
+      return max_process;
+
+    case _SC_CLK_TCK:
+      return JIFFIES_PER_SECOND;
+
+    case _SC_OPEN_MAX:
+      return OPEN_MAX;
+
+    case _SC_PAGESIZE:
+      return PAGE_SIZE;
+
+    case _SC_NPROCESSORS_CONF:
+      return max_cpu;
+
+    case _SC_NPROCESSORS_ONLN:
+      return cpu_cnt;
+
+    case _SC_PHYS_PAGES:
+      return max_pageframe;
+
+    case _SC_BUF_CACHE_PAGES:
+      return buf_page_cnt;
+
+    case _SC_BUF_CACHE_MAX:
+      return buf_page_limit;
+
+    default:
+      return -EINVAL;
+  }
+}
+
+
+/* @brief   Set a system configuration value
+ *
+ * @param   name, _SC_ value to set, only _SC_BUF_CACHE_MAX can be changed
+ * @param   value, new value of the configuration variable
+ * @return  0 on success, negative errno on failure
+ *
+ * Lowering _SC_BUF_CACHE_MAX stops the file cache growing, it does not
+ * evict cached pages. See resize_cache().
+ */
+int sys_setsysconf(int name, long value)
+{
+  struct Process *current;
+
+  Info("sys_setsysconf(%d, %d)", name, (int)value);
+
+  current = get_current_process();
+
+  if (!(current->flags & PROCF_ALLOW_IO)) {
+    return -EPERM;
+  }
+
+  switch (name) {
+    case _SC_BUF_CACHE_MAX:
+      if (value < 0) {
+        return -EINVAL;
+      }
+
+      resize_cache(value);
+      return 0;
+
+    default:
+      return -EINVAL;
+  }
 }
 
@@ -19,9 +19,9 @@
  *
  * Timer processing, just like interrupts is divided into two parts,
  * The timer top-half is executed within real interrupt handler when
- * an interupt arrives.  It increments the hardclock and performs
- * any adjustments to the hardware timer. The hardclock is the
- * actual system time
+ * an interupt arrives.  It updates the hardclock from the free-running
+ * hardware counter and programs the next timer interrupt. The hardclock
+ * is the actual system time.
  *
  * The bottom half of the timer processing does the actual timer
  * expiration. This is run as the highest priority task in the kernel.
@@ -33,10 +33,25 @@
  * The job of the softclock is to catch up to the hardclock and expire
  * any timers as it does so.
  *
- * A hash table is used to quickly insert and find timers to expire.  This
- * is a hashed timing wheel, with jiffies_per_second entries in the hash table.
- * This means times of 1.342, 45.342, 789.342 etc are all in the same hash
- * bucket.
+ * Timers are kept on a hierarchical timing wheel of TIMER_WHEEL_LEVELS
+ * levels. Each slot of level 0 is a single jiffy, each slot of level n spans
+ * TIMER_WHEEL_SLOTS^n jiffies. A timer is placed on the lowest level that
+ * covers its remaining time and is cascaded down a level when the softclock
+ * reaches its slot, so a long timeout is only touched once per level.
+ *
+ * The timer interrupt is not periodic. While any CPU is running a process
+ * it interrupts every jiffy to time-slice processes. Once all CPUs are idle
+ * it is programmed for when the timing wheel next needs processing, up to
+ * TIMER_MAX_IDLE_JIFFIES ahead, and restarted by TimerTickRestart() when a
+ * CPU leaves its idle process.
+ *
+ * Timeouts shorter than HRTIMER_MAX_TIMEOUT microseconds are high resolution
+ * timers. These are kept on the hrtimer_list sorted by expiration time in
+ * microseconds and driven by a second compare register of the system timer.
+ * Their callbacks are called from the interrupt handler by HRTimerTopHalf()
+ * and so must only wake up processes. Timers with bottom_half set are instead
+ * moved to the hrtimer_expired_list and their callbacks run by the bottom
+ * half, with the BKL held.
  *
  * Further reading:
  *
@@ -50,6 +65,7 @@
 #include <kernel/dbg.h>
 #include <kernel/error.h>
 #include <kernel/globals.h>
+#include <kernel/interrupt.h>
 #include <kernel/proc.h>
 #include <kernel/timer.h>
 #include <kernel/types.h>
@@ -57,6 +73,10 @@
 #include <time.h>
 
 
+// Static prototypes
+static int SleepUntil(uint64_t expiration_us);
+
+
 /* @brief   Returns the system time in seconds and microseconds.
  * 
  * @param   tv_user, returns the system time in seconds and microseconds
@@ -158,17 +178,6 @@ int sys_alarm(int seconds)
 }
 
 
-/*
- *
- */
-void SleepCallback(struct Timer *timer)
-{
-  struct Process *process = timer->process;
-
-  TaskWakeup (&process->rendez);
-}
-
-
 /* @brief   System call to put the current process to sleep
  * 
  * @param   seconds, duration to sleep for
@@ -178,78 +187,103 @@ void SleepCallback(struct Timer *timer)
  */
 int sys_sleep(int seconds)
 {
-  int_state_t int_state;
-  struct Process *current;
-  struct Timer *timer;
-  
-  current = get_current_process();
-    
-  timer = &current->sleep_timer;  
-  timer->process = current;
-  timer->armed = true;
-  timer->callback = SleepCallback;
-
-  int_state = DisableInterrupts();
-  timer->expiration_time = hardclock_time + (seconds * JIFFIES_PER_SECOND);
-  RestoreInterrupts(int_state);
-  
-  LIST_ADD_TAIL(&timing_wheel[timer->expiration_time % JIFFIES_PER_SECOND], timer, timer_entry);
-
-  while (timer->armed == true) {
-    TaskSleep(&current->rendez);
+  if (seconds < 0) {
+    return -EINVAL;
   }
 
-  return 0;
+  return SleepUntil(arch_read_hrclock() + (uint64_t)seconds * 1000000ull);
 }
 
 
+/* @brief   System call to sleep for a number of nanoseconds
+ *
+ * @param   _req, user address of the duration to sleep for
+ * @param   _rem, user address to store the remaining time if interrupted
+ * @return  0 on success, negative errno on error
+ *
+ * Durations under HRTIMER_MAX_TIMEOUT microseconds use a high resolution
+ * timer, longer ones are rounded up to the next jiffy.
+ */
 int sys_nanosleep(struct timespec *_req, struct timespec *_rem)
 {
-  int_state_t int_state;
-  struct Process *current;
-  struct Timer *timer;
-  struct timespec req, rem;
+  struct timespec req;
 
-  current = get_current_process();
-  
   if (CopyIn(&req, _req, sizeof(req)) != 0) {
 	  Info ("sys_nanosleep: EFAULT");
     return -EFAULT;
   }
   
-  // TODO:  spin_nanosleep() for IO processes that need to sleep for less than 10ms
-//  if ((current->flags & PROCF_ALLOW_IO)) {
-    if (req.tv_sec == 0 && req.tv_nsec < 10000000) {
-      if (arch_spin_nanosleep(&req) == 0) {
-	      return 0;
-	    }
-    }
-//  }
-      
-  timer = &current->sleep_timer;  
-  timer->process = current;
-  timer->armed = true;
-  timer->callback = SleepCallback;
+  if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= 1000000000) {
+    return -EINVAL;
+  }
 
-  int_state = DisableInterrupts();
-  
-  timer->expiration_time = hardclock_time + (req.tv_sec * JIFFIES_PER_SECOND)
-                                          + (req.tv_nsec / NANOSECONDS_PER_JIFFY);
-  RestoreInterrupts(int_state);
-  
-  LIST_ADD_TAIL(&timing_wheel[timer->expiration_time % JIFFIES_PER_SECOND], timer, timer_entry);
+  return SleepUntil(arch_read_hrclock() + timespec_to_microsecs(&req));
+}
 
-  while (timer->armed == true) {
-    TaskSleep(&current->rendez);
+
+/* @brief   System call to sleep for a duration or until a time on a clock
+ *
+ * @param   clock_id, clock the sleep is measured against
+ * @param   flags, TIMER_ABSTIME if _req is an absolute time of clock_id
+ * @param   _req, user address of the duration or time to sleep until
+ * @param   _rem, user address to store the remaining time if interrupted
+ * @return  0 on success, negative errno on error
+ *
+ * All clocks currently count from boot using the same system timer so an
+ * absolute time converts directly to microseconds of the system timer.
+ */
+int sys_clock_nanosleep(int clock_id, int flags, struct timespec *_req, struct timespec *_rem)
+{
+  struct timespec req;
+  uint64_t expiration_us;
+
+  switch (clock_id) {
+    case CLOCK_REALTIME:
+    case CLOCK_MONOTONIC:
+    case CLOCK_MONOTONIC_RAW:
+      break;
+    
+    default:
+      return -EINVAL;
   }
 
-  // TODO: if interrupted, work out remaining time and store in _rem
-  Info ("sys_nanosleep awakened");
-  
-  return 0;
+  if (CopyIn(&req, _req, sizeof(req)) != 0) {
+    return -EFAULT;
+  }
+
+  if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= 1000000000) {
+    return -EINVAL;
+  }
+
+  if (flags & TIMER_ABSTIME) {
+    expiration_us = timespec_to_microsecs(&req);
+  } else {
+    expiration_us = arch_read_hrclock() + timespec_to_microsecs(&req);
+  }
+
+  return SleepUntil(expiration_us);
 }
 
 
+/* @brief   Put the current process to sleep until a time of the system timer
+ *
+ * @param   expiration_us, time in microseconds to wake up at
+ * @return  0 on success
+ *
+ * TODO: Abort sleep upon catching signals and return remaining time
+ */
+static int SleepUntil(uint64_t expiration_us)
+{
+  struct Process *current;
+
+  current = get_current_process();
+
+  // Other wakeups of the process's rendez continue the sleep
+  while (TaskSleepUntil(&current->rendez, expiration_us) != -ETIMEDOUT) {
+  }
+
+  return 0;
+}
 
 
 /* @brief   Arm a timer to expire at either a relative or absolute time
@@ -267,14 +301,12 @@ int SetTimeout(int milliseconds, void (*callback)(struct Timer *), void *arg)
 
   timer = &current->timeout_timer;
   
-  int_state = DisableInterrupts();
+  int_state = SpinLockIRQSave(&timer_slock);
 
   if (timer->armed == true) {
 
     remaining = hardclock_time - timer->expiration_time / JIFFIES_PER_SECOND;
-    
-    LIST_REM_ENTRY(&timing_wheel[timer->expiration_time % JIFFIES_PER_SECOND], timer, timer_entry);
-    timer->armed = false;
+    disarm_timer(timer);
   }
   
   if (milliseconds > 0) {
@@ -283,28 +315,218 @@ int SetTimeout(int milliseconds, void (*callback)(struct Timer *), void *arg)
     timer->process = current;    
     timer->callback = callback;
     timer->arg = arg;
-    timer->armed = true;
-
-    LIST_ADD_TAIL(&timing_wheel[timer->expiration_time % JIFFIES_PER_SECOND], timer, timer_entry);
+    arm_timer(timer);
   }
 
-  RestoreInterrupts(int_state);
+  SpinUnlockIRQRestore(int_state, &timer_slock);
 
   return remaining;  
 }
 
 
-/*
- * TODO: Replace with spinlockirqsave around hardclock fetch
+/* @brief   Add a timer to the timing wheel
+ *
+ * @param   timer, timer with its expiration_time set
+ *
+ * Called with timer_slock held. A timer that has already expired is placed
+ * in the slot the bottom half processes next. Timeouts beyond the span of
+ * the wheel are placed at its furthest slot and re-armed when they reach
+ * level 0.
+ */
+void arm_timer(struct Timer *timer)
+{
+  long long expiration_time;
+  long long delta;
+  int level;
+  int slot;
+
+  expiration_time = timer->expiration_time;
+  delta = expiration_time - softclock_time;
+
+  if (delta < 0) {
+    expiration_time = softclock_time;
+    delta = 0;
+  } else if (delta > TIMER_MAX_TIMEOUT) {
+    expiration_time = softclock_time + TIMER_MAX_TIMEOUT;
+    delta = TIMER_MAX_TIMEOUT;
+  }
+
+  for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+    if (delta < (1ll << (TIMER_WHEEL_BITS * (level + 1)))) {
+      break;
+    }
+  }
+
+  slot = (expiration_time >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+  timer->bucket = &timing_wheel[level][slot];
+  LIST_ADD_TAIL(timer->bucket, timer, timer_entry);
+  timer->armed = true;
+}
+
+
+/* @brief   Remove a timer from the timing wheel
+ *
+ * @param   timer, timer to cancel, nothing is done if it is not armed
+ *
+ * Called with timer_slock held. The timer's seq is recorded in expired_seq
+ * so that a callback run after timer_slock is dropped can tell if it is stale.
+ */
+void disarm_timer(struct Timer *timer)
+{
+  if (timer->armed == false) {
+    return;
+  }
+
+  LIST_REM_ENTRY(timer->bucket, timer, timer_entry);
+  timer->bucket = NULL;
+  timer->armed = false;
+  timer->expired_seq = timer->seq;
+}
+
+
+/* @brief   Add a timer to the sorted list of high resolution timers
+ *
+ * @param   timer, timer with its expiration_time set in microseconds of
+ *          the system timer
+ *
+ * Called with timer_slock held. The hrtimer compare register is reprogrammed
+ * if the timer becomes the earliest to expire.
+ */
+void arm_hrtimer(struct Timer *timer)
+{
+  struct Timer *next;
+
+  next = LIST_HEAD(&hrtimer_list);
+
+  while (next != NULL && next->expiration_time <= timer->expiration_time) {
+    next = LIST_NEXT(next, timer_entry);
+  }
+
+  if (next != NULL) {
+    LIST_INSERT_BEFORE(&hrtimer_list, next, timer, timer_entry);
+  } else {
+    LIST_ADD_TAIL(&hrtimer_list, timer, timer_entry);
+  }
+
+  timer->bucket = &hrtimer_list;
+  timer->armed = true;
+
+  if (LIST_HEAD(&hrtimer_list) == timer) {
+    arch_set_hrtimer_event(timer->expiration_time);
+  }
+}
+
+
+/* @brief   Arm a timer to expire at a time of the system timer
+ *
+ * @param   timer, timer to arm
+ * @param   expiration_us, time in microseconds the timer expires at
+ *
+ * Called with timer_slock held. Expiration times closer than
+ * HRTIMER_MAX_TIMEOUT use a high resolution timer, later ones are rounded
+ * up to the next jiffy and placed on the timing wheel.
+ */
+void arm_timeout(struct Timer *timer, uint64_t expiration_us)
+{
+  if (expiration_us < arch_read_hrclock() + HRTIMER_MAX_TIMEOUT) {
+    timer->expiration_time = expiration_us;
+    arm_hrtimer(timer);
+  } else {
+    timer->expiration_time = (expiration_us + MICROSECONDS_PER_JIFFY - 1) / MICROSECONDS_PER_JIFFY;
+    arm_timer(timer);
+  }
+}
+
+
+/* @brief   Convert a timespec to microseconds, rounding up
+ */
+uint64_t timespec_to_microsecs(const struct timespec *ts)
+{
+  return (uint64_t)ts->tv_sec * 1000000ull + (ts->tv_nsec + 999) / 1000;
+}
+
+
+/* @brief   Move the timers of the slots reached by the softclock down a level
+ *
+ * Called with timer_slock held before the level 0 slot of the softclock is
+ * processed. Level n is cascaded each time the levels below it wrap around.
+ */
+static void cascade_timers(void)
+{
+  struct Timer *timer;
+  timer_list_t *bucket;
+  int level;
+  int slot;
+
+  for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+    if ((softclock_time & ((1ll << (TIMER_WHEEL_BITS * level)) - 1)) != 0) {
+      break;
+    }
+
+    slot = (softclock_time >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    bucket = &timing_wheel[level][slot];
+
+    while ((timer = LIST_HEAD(bucket)) != NULL) {
+      LIST_REM_HEAD(bucket, timer_entry);
+      arm_timer(timer);
+    }
+  }
+}
+
+
+/* @brief   Find the next softclock time at which the timing wheel has work
+ *
+ * @return  softclock time of the earliest level 0 timer or cascade of a
+ *          non-empty slot, or softclock_time + TIMER_MAX_TIMEOUT if the
+ *          wheel is empty
+ *
+ * Called with timer_slock held. A cascade may be earlier than the timers it
+ * moves expire, the next event is then found again after the cascade.
+ */
+static long long next_timer_event(void)
+{
+  long long next;
+  long long span;
+  long long revolution;
+  long long t;
+
+  next = softclock_time + TIMER_MAX_TIMEOUT;
+
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    span = 1ll << (TIMER_WHEEL_BITS * level);
+    revolution = span * TIMER_WHEEL_SLOTS;
+
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      if (LIST_HEAD(&timing_wheel[level][slot]) == NULL) {
+        continue;
+      }
+
+      t = (softclock_time & ~(revolution - 1)) + slot * span;
+
+      if (t < softclock_time) {
+        t += revolution;
+      }
+
+      if (t < next) {
+        next = t;
+      }
+    }
+  }
+
+  return next;
+}
+
+
+/* @brief   Get the number of jiffies since boot
  */
 uint64_t get_hardclock(void)
 {
   int_state_t int_state;
   uint64_t now;
   
-  int_state = DisableInterrupts(); 
+  int_state = SpinLockIRQSave(&timer_slock);
   now = hardclock_time;
-  RestoreInterrupts(int_state);
+  SpinUnlockIRQRestore(int_state, &timer_slock);
 
   return now;
 }
@@ -313,29 +535,126 @@ uint64_t get_hardclock(void)
 /* @brief   Timer handling in the timer interrupt service routine
  *
  * Called from within timer interrupt.  Updates the quanta used of all currently
- * running processes and advances the hard_clock (the wall time).
+ * running processes, brings the hardclock (the wall time) up to date and
+ * programs the next timer interrupt.
  *
- * NOTES: For SMP, we may have separate hardware timers for each CPU and use
- * these to increment the quanta used for scheduling. Only a single CPU needs
- * to increment the hardclock time. 
+ * Only the boot CPU receives the timer interrupt. The other CPUs that are
+ * running a process are sent a reschedule IPI each tick so that they
+ * round-robin their own ready queues. If every CPU is idle the tick is
+ * stopped until the timing wheel next has work.
  */
 void TimerTopHalf(void)
 {
-  int_state_t int_state;
+  struct CPU *cpu;
+  struct Process *proc;
+  long long next;
+  bool busy = false;
   
+  cpu = get_cpu();
+
   for (int t = 0; t < max_cpu; t++) {
-    if (cpu_table[t].current_process != NULL) {
-      cpu_table[t].current_process->quanta_used++;
+    proc = cpu_table[t].current_process;
+
+    if (cpu_table[t].online == false || proc == NULL || proc == cpu_table[t].idle_process) {
+      continue;
     }
 
-//    cpu_table[t].reschedule_request = true;     // Unused,
+    proc->quanta_used++;
+    busy = true;
+
+    if (&cpu_table[t] != cpu) {
+      send_ipi(t, IPI_RESCHEDULE);
+    }
+  }
+
+  SpinLock(&timer_slock);
+  hardclock_time = arch_read_hardclock();
+  next = next_timer_event();
+
+  if (busy) {
+    timer_tick_stopped = false;
+    arch_set_timer_event(hardclock_time + 1);
+  } else {
+    timer_tick_stopped = true;
+
+    if (next >= hardclock_time + TIMER_MAX_IDLE_JIFFIES) {
+      next = hardclock_time + TIMER_MAX_IDLE_JIFFIES - 1;
+    }
+
+    // The bottom half processes a softclock time once the hardclock passes it
+    arch_set_timer_event((next < hardclock_time) ? hardclock_time + 1 : next + 1);
   }
 
-//  int_state = DisableInterrupts(); 		// FIXME: Nested interrupts not supported, not needed
-  hardclock_time++;
-//  RestoreInterrupts(int_state);
+  SpinUnlock(&timer_slock);
   
-  TaskWakeupFromISR(&timer_rendez);
+  if (next < hardclock_time) {
+    TaskWakeupFromISR(&timer_rendez);
+  }
+}
+
+
+/* @brief   Expire high resolution timers in the timer interrupt service routine
+ *
+ * Called from within the hrtimer interrupt. Callbacks are called without
+ * timer_slock held as they take sched_slock to wake up processes. Timers
+ * whose callbacks need the BKL are handed to the bottom half. The compare
+ * register is then programmed for the earliest remaining timer.
+ */
+void HRTimerTopHalf(void)
+{
+  struct Timer *timer;
+  bool wakeup = false;
+
+  SpinLock(&timer_slock);
+
+  while ((timer = LIST_HEAD(&hrtimer_list)) != NULL) {
+    if (timer->expiration_time > arch_read_hrclock()) {
+      arch_set_hrtimer_event(timer->expiration_time);
+      break;
+    }
+
+    if (timer->bottom_half) {
+      // Remains armed until the bottom half runs its callback
+      LIST_REM_HEAD(&hrtimer_list, timer_entry);
+      LIST_ADD_TAIL(&hrtimer_expired_list, timer, timer_entry);
+      timer->bucket = &hrtimer_expired_list;
+      wakeup = true;
+      continue;
+    }
+
+    disarm_timer(timer);
+
+    if (timer->callback != NULL) {
+      SpinUnlock(&timer_slock);
+      timer->callback(timer);
+      SpinLock(&timer_slock);
+    }
+  }
+
+  SpinUnlock(&timer_slock);
+
+  if (wakeup) {
+    TaskWakeupFromISR(&timer_rendez);
+  }
+}
+
+
+/* @brief   Restart the timer tick when a CPU switches away from its idle process
+ *
+ * Called by the scheduler with interrupts disabled. The hardclock is brought
+ * up to date as it is not advanced while the tick is stopped.
+ */
+void TimerTickRestart(void)
+{
+  SpinLock(&timer_slock);
+
+  if (timer_tick_stopped == true) {
+    timer_tick_stopped = false;
+    hardclock_time = arch_read_hardclock();
+    arch_set_timer_event(hardclock_time + 1);
+  }
+
+  SpinUnlock(&timer_slock);
 }
 
 
@@ -355,42 +674,65 @@ void TimerBottomHalf(void)
   Info("TimerBottomHalf: hard_clock =%u",(uint32_t)hardclock_time);
   
   struct Timer *timer, *next_timer;
+  timer_list_t *bucket;
+  long long next;
 
   while (1) {
     KASSERT(bkl_locked == true);
     KASSERT(bkl_owner == timer_process);
     
-    TaskSleep(&timer_rendez);
-    
-    int_state = DisableInterrupts(); 
+    int_state = SpinLockIRQSave(&timer_slock);
+
+    while ((timer = LIST_HEAD(&hrtimer_expired_list)) != NULL) {
+      disarm_timer(timer);
+
+      if (timer->callback != NULL) {
+        SpinUnlockIRQRestore(int_state, &timer_slock);
+        timer->callback(timer);
+        int_state = SpinLockIRQSave(&timer_slock);
+      }
+    }
+
     while (softclock_time < hardclock_time) {
-      RestoreInterrupts(int_state);
-      
-      timer = LIST_HEAD(&timing_wheel[softclock_time % JIFFIES_PER_SECOND]);
+      // Skip over the times at which the wheel has nothing to do
+      next = next_timer_event();
+
+      if (next > softclock_time) {
+        softclock_time = (next < hardclock_time) ? next : hardclock_time;
+        continue;
+      }
+
+      cascade_timers();
+
+      bucket = &timing_wheel[0][softclock_time & TIMER_WHEEL_MASK];
+      timer = LIST_HEAD(bucket);
 
       while (timer != NULL) {
         next_timer = LIST_NEXT(timer, timer_entry);
-
-        if (timer->expiration_time <= softclock_time) {          
-          LIST_REM_ENTRY(&timing_wheel[softclock_time % JIFFIES_PER_SECOND], timer, timer_entry);
-          timer->armed = false;
-  
-          if (timer->callback != NULL) {
-            timer->callback(timer);
-          }        
+        disarm_timer(timer);
+
+        if (timer->expiration_time > softclock_time) {
+          // Timeout beyond the span of the wheel, wait another revolution
+          arm_timer(timer);
+        } else if (timer->callback != NULL) {
+          // Callbacks take sched_slock, the bucket may change while unlocked
+          SpinUnlockIRQRestore(int_state, &timer_slock);
+          timer->callback(timer);
+          int_state = SpinLockIRQSave(&timer_slock);
+          next_timer = LIST_HEAD(bucket);
         }
         
         timer = next_timer;
       }
 
       softclock_time++;
-
-      int_state = DisableInterrupts();
     }
+
+    // Interrupts stay disabled until asleep so that a wakeup from the
+    // timer interrupt handlers is not missed
+    SpinUnlock(&timer_slock);
+    TaskSleep(&timer_rendez);
     RestoreInterrupts(int_state);
-    
-    // What if timer interrupt occurs here, does this mean we end up waiting for
-    // an extra JIFFY for the next timer interrupt?
   }
 }
 
@@ -23,6 +23,7 @@
 #include <kernel/arch.h>
 #include <kernel/dbg.h>
 #include <kernel/error.h>
+#include <kernel/filesystem.h>
 #include <kernel/globals.h>
 #include <kernel/lists.h>
 #include <kernel/proc.h>
@@ -65,6 +66,8 @@ int fork_address_space(struct AddressSpace *new_as, struct AddressSpace *old_as)
 //    Info("as:%08x segment_table[%d]=%08x", (uint32_t)new_as, t, new_as->segment_table[t]);    
   }
 
+  fork_mapped_files(new_as, old_as);
+
   for (vpt = VM_USER_BASE_PAGETABLE_ALIGNED; vpt < VM_USER_CEILING;
        vpt += PAGE_SIZE * N_PAGETABLE_PTE) {
     
@@ -88,7 +91,15 @@ int fork_address_space(struct AddressSpace *new_as, struct AddressSpace *old_as)
       }
       
      
-      if ((flags & MEM_PHYS) != MEM_PHYS && (flags & PROT_WRITE)) {
+      if ((flags & MEM_MASK) == MEM_FILE) {
+        // Mapped file page, private mappings are already copy-on-write
+        if (pmap_enter(new_as, va, pa, flags) != 0) {
+          goto cleanup;
+        }
+
+        ref_file_page(pa);
+
+      } else if ((flags & MEM_PHYS) != MEM_PHYS && (flags & PROT_WRITE)) {
 //        Info (".. va:%08x, rw, anon, mark both as COW", (uint32_t)va);
         
         // Read-Write mapping, Mark page in both as COW and read-only;
@@ -130,6 +141,9 @@ int fork_address_space(struct AddressSpace *new_as, struct AddressSpace *old_as)
         }
       }
     }
+
+    // The child is not yet runnable and each page is complete
+    KernelPreemptionPoint();
   }
 
   return 0;
@@ -170,6 +184,12 @@ void cleanup_address_space(struct AddressSpace *as)
         continue;
       }
 
+      if ((flags & MEM_MASK) == MEM_FILE) {
+        unmap_file_page(as, va, pa, flags);
+        pmap_remove(as, va);
+        continue;
+      }
+
       if (pmap_remove(as, va) != 0) {
         continue;
       }
@@ -185,8 +205,12 @@ void cleanup_address_space(struct AddressSpace *as)
         free_pageframe(pf);
       }
     }
+
+    KernelPreemptionPoint();
   }
 
+  release_mapped_files(as, VM_USER_BASE, VM_USER_CEILING - VM_USER_BASE);
+
   as->segment_cnt = 1;
   as->segment_table[0] = VM_USER_BASE | SEG_TYPE_FREE;
   as->segment_table[1] = VM_USER_CEILING | SEG_TYPE_CEILING;
@@ -23,6 +23,7 @@
 #include <kernel/arch.h>
 #include <kernel/dbg.h>
 #include <kernel/error.h>
+#include <kernel/filesystem.h>
 #include <kernel/globals.h>
 #include <kernel/lists.h>
 #include <kernel/proc.h>
@@ -73,11 +74,23 @@ void kfree_page(void *vaddr)
 }
 
 
+/* @brief   Allocate a cleared 4k, 16k or 64k page and return a Pageframe struct
+ */
+struct Pageframe *alloc_pageframe(vm_size size)
+{
+  return alloc_pageframe_flags(size, PGF_CLEAR);
+}
+
+
 /* @brief   Allocate a 4k, 16k or 64k page and return a Pageframe struct
+ *
+ * @param   size, size of page to allocate
+ * @param   flags, PGF_CLEAR to zero the page, other flags are set in the pageframe
+ * @return  Pageframe or NULL if no memory is available
  *
  * Splitting larger slabs into smaller sizes if needed.
  */
-struct Pageframe *alloc_pageframe(vm_size size)
+struct Pageframe *alloc_pageframe_flags(vm_size size, bits32_t flags)
 {
   struct Pageframe *head = NULL;
   int t;
@@ -106,6 +119,15 @@ struct Pageframe *alloc_pageframe(vm_size size)
     }
   }
 
+  // Shrink the file cache if memory is exhausted
+  if (head == NULL && size == 4096) {
+    head = reclaim_cache_pageframe();
+    
+    if (head != NULL) {
+      head->flags = 0;
+    }
+  }
+
   if (head == NULL) {
     Warn("no pageframe available");
     return NULL;
@@ -136,8 +158,9 @@ struct Pageframe *alloc_pageframe(vm_size size)
     head[0].flags = 0;
   }
   
-  head->flags = PGF_INUSE;
+  head->flags = PGF_INUSE | (flags & ~PGF_CLEAR);
   head->reference_cnt = 0;
+  head->buf = NULL;
 
   pmap_pageframe_init(&head->pmap_pageframe);
 
@@ -145,8 +168,9 @@ struct Pageframe *alloc_pageframe(vm_size size)
 
 //	Info("..pf va:%08x, pa:%08x, pf:%08x, sz:%d", va, head->physical_addr, (uint32_t)head, size);
 
-  // TODO: Add flag to clear page
-  memset((void *)va, 0, size);
+  if (flags & PGF_CLEAR) {
+    memset((void *)va, 0, size);
+  }
 
   return head;
 }
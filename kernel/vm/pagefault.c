@@ -23,6 +23,7 @@
 #include <kernel/arch.h>
 #include <kernel/dbg.h>
 #include <kernel/error.h>
+#include <kernel/filesystem.h>
 #include <kernel/globals.h>
 #include <kernel/lists.h>
 #include <kernel/proc.h>
@@ -32,6 +33,44 @@
 #include <string.h>
 
 
+/* @brief   Make a user page accessible without touching its contents
+ *
+ * @param   addr, user address within the page
+ * @param   access, PROT_READ or PROT_WRITE
+ * @return  0 on success, -1 if the page cannot be accessed
+ *
+ * Resolves the fault that the access would take by calling page_fault()
+ * directly, so the kernel can fault in a user buffer before holding a lock
+ * or buf without reading or writing back user data. A MEM_FILE page is only
+ * dirtied if write access is asked for.
+ */
+int fault_in_page(vm_addr addr, bits32_t access)
+{
+  struct Process *current;
+  uint32_t page_flags;
+  vm_addr paddr;
+
+  current = get_current_process();
+  addr = ALIGN_DOWN(addr, PAGE_SIZE);
+
+  if (addr < VM_USER_BASE || addr >= VM_USER_CEILING) {
+    return -1;
+  }
+  
+  if (pmap_extract(&current->as, addr, &paddr, &page_flags) == 0) {
+    if (!(access & PROT_WRITE)) {
+      return 0;
+    }
+    
+    if ((page_flags & (PROT_WRITE | MAP_COW)) == PROT_WRITE) {
+      return 0;
+    }
+  }
+
+  return page_fault(addr, access);
+}
+
+
 /* @brief   Page fault exception handler
  */
 int page_fault(vm_addr addr, bits32_t access)
@@ -62,14 +101,16 @@ int page_fault(vm_addr addr, bits32_t access)
 #endif    
     
   if (pmap_extract(&current->as, addr, &paddr, &page_flags) != 0) {
-    // Page is not present
-    return -1;
+    // Page is not present, it may be part of a mapped file
+    return file_page_fault(&current->as, addr, access);
   }
 	
 	Info("extract paddr:%08x, page_flags:%08x", paddr, page_flags);
 
 
-  if ((page_flags & MEM_MASK) == MEM_PHYS) {
+  if ((page_flags & MEM_MASK) == MEM_FILE) {
+    return file_page_fault(&current->as, addr, access);
+  } else if ((page_flags & MEM_MASK) == MEM_PHYS) {
   	Info("fault page flags MEM_PHYS");
     return -1;
   } else if ((page_flags & MEM_MASK) != MEM_ALLOC) {
@@ -23,6 +23,7 @@
 #include <kernel/arch.h>
 #include <kernel/dbg.h>
 #include <kernel/error.h>
+#include <kernel/filesystem.h>
 #include <kernel/globals.h>
 #include <kernel/lists.h>
 #include <kernel/proc.h>
@@ -203,6 +204,9 @@ int sys_virtualfree(void *_addr, size_t len)
   struct AddressSpace *as;
   vm_addr addr;
   vm_addr va;
+  vm_addr pa;
+  bits32_t flags;
+  struct Pageframe *pf;
 
   current = get_current_process();
   as = &current->as;
@@ -210,10 +214,25 @@ int sys_virtualfree(void *_addr, size_t len)
   len = ALIGN_UP(len, PAGE_SIZE);
 
   for (va = addr; va < addr + len; va += PAGE_SIZE) {
-    // FIXME: Get pageframe (pmap_extract?)  decrement ref count.  Free page if ref_cnt == 0
-    // Finish FreePageframe
+    if (pmap_extract(as, va, &pa, &flags) != 0) {
+      continue;
+    }
     
-    pmap_remove(as, va);
+    if ((flags & MEM_MASK) == MEM_FILE) {
+      // Buf page loaned by a message IOV
+      unmap_file_page(as, va, pa, flags);
+      pmap_remove(as, va);
+    } else if ((flags & MEM_MASK) == MEM_ALLOC) {
+      pmap_remove(as, va);
+      pf = pmap_pa_to_pf(pa);
+      pf->reference_cnt--;
+
+      if (pf->reference_cnt == 0) {
+        free_pageframe(pf);
+      }
+    } else {
+      pmap_remove(as, va);
+    }
   }
 
   pmap_flush_tlbs();  
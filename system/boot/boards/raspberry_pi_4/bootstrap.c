@@ -128,7 +128,7 @@ void bootstrap_kernel(vm_addr kernel_ceiling)
 
   hal_set_ttbcr(0);
   hal_set_dacr(0x01);  // FIXME: Set all domains with 0x55555555
-  hal_set_ttbr0((uint32_t)root_pagedir);
+  hal_set_ttbr0((uint32_t)root_pagedir | TTBR_CACHE_CONF);
 
   sctlr = hal_get_sctlr();
   sctlr |= SCTLR_M | SCTLR_C | SCTLR_I;    
@@ -170,15 +170,15 @@ void init_page_directory(void)
 
 /*
  * Initialise the page table entries to map phyiscal memory from 0 to 512MB
- * into the kernel starting at 0x80000000.
+ * into the kernel starting at 0x80000000. RAM is mapped as shareable Normal
+ * memory so that the kernel's spinlocks work across cores.
  */
 void init_kernel_pagetables(void)
 {
   uint32_t pa_bits;
   vm_addr pa;
 
-  pa_bits = L2_TYPE_S | L2_AP_RWK;
-	//  pa_bits |= L2_B | L2_C;			// FIXME
+  pa_bits = L2_TYPE_S | L2_AP_RWK | L2_MEM_NORMAL;
 
   for (pa = 0; pa < bootinfo.mem_size; pa += PAGE_SIZE) {
     kernel_pagetables[pa / PAGE_SIZE] = pa | pa_bits;
@@ -218,8 +218,7 @@ void init_bootloader_pagetables(void)
 
     pte_idx = (pa & L2_ADDR_BITS) >> L2_IDX_SHIFT;
 
-    pa_bits = L2_TYPE_S | L2_AP_RWKU;
-    // pa_bits |= L2_B | L2_C;   // FIXME:
+    pa_bits = L2_TYPE_S | L2_AP_RWKU | L2_MEM_NORMAL;
     
     pt[pte_idx] = pa | pa_bits;
   }  
@@ -245,6 +244,7 @@ void init_io_pagetable(void)
   bootinfo.aux_base   = (vm_addr)io_map(AUX_BASE, PAGE_SIZE);	
   bootinfo.gicd_base  = (vm_addr)io_map(GICD_BASE, PAGE_SIZE);
   bootinfo.gicc_base[0] = (vm_addr)io_map(GICC_BASE, PAGE_SIZE);
+  bootinfo.arm_base   = (vm_addr)io_map(ARM_LOCAL_BASE, PAGE_SIZE);
 	
 	aux_regs_va = (void *)bootinfo.aux_base;
 
@@ -262,6 +262,7 @@ void init_io_pagetable(void)
 	boot_log_info("bi.aux_base:     %08x", (uint32_t)bootinfo.aux_base);
 	boot_log_info("bi.gicd_base:    %08x", (uint32_t)bootinfo.gicd_base);
 	boot_log_info("bi.gicc_base[0]: %08x", (uint32_t)bootinfo.gicc_base[0]);
+	boot_log_info("bi.arm_base:     %08x", (uint32_t)bootinfo.arm_base);
 	boot_log_info("bi.mailbox_base: %08x", (uint32_t)bootinfo.mailbox_base);
 
 }
@@ -0,0 +1,97 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscalls.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define DEFAULT_ITERATIONS  10000
+
+
+/* @brief   Main function of the context switch microbenchmark
+ *
+ * @param   argc, number of arguments
+ * @param   argv, optional number of round trips to measure
+ * @return  0 on success, non-zero on failure
+ *
+ * A parent and child process pass a byte back and forth over a pair of
+ * pipes. Each round trip blocks and wakes both processes once, so it costs
+ * two context switches plus two pipe reads and writes. Run it before and
+ * after scheduler changes to compare the cost of a switch.
+ */
+int main(int argc, char **argv)
+{
+  int ping[2];
+  int pong[2];
+  int iterations;
+  pid_t pid;
+  char c = 0;
+  struct timespec start, end;
+  uint64_t elapsed_ns;
+
+  iterations = (argc > 1) ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+
+  if (iterations <= 0) {
+    printf("ctxbench: invalid iteration count\n");
+    return -1;
+  }
+
+  if (pipe(ping) != 0 || pipe(pong) != 0) {
+    printf("ctxbench: failed to create pipes\n");
+    return -1;
+  }
+
+  pid = fork();
+
+  if (pid < 0) {
+    printf("ctxbench: fork failed\n");
+    return -1;
+  }
+
+  if (pid == 0) {
+    close(ping[1]);
+    close(pong[0]);
+
+    for (int t = 0; t < iterations; t++) {
+      if (read(ping[0], &c, 1) != 1 || write(pong[1], &c, 1) != 1) {
+        exit(-1);
+      }
+    }
+
+    exit(0);
+  }
+
+  close(ping[0]);
+  close(pong[1]);
+
+  if (clock_gettime(CLOCK_MONOTONIC_RAW, &start) != 0) {
+    printf("ctxbench: clock_gettime failed\n");
+    return -1;
+  }
+
+  for (int t = 0; t < iterations; t++) {
+    if (write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1) {
+      printf("ctxbench: round trip %d failed\n", t);
+      return -1;
+    }
+  }
+
+  if (clock_gettime(CLOCK_MONOTONIC_RAW, &end) != 0) {
+    printf("ctxbench: clock_gettime failed\n");
+    return -1;
+  }
+
+  waitpid(pid, NULL, 0);
+
+  elapsed_ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL
+               + end.tv_nsec - start.tv_nsec;
+
+  printf("ctxbench: %d round trips in %u us\n", iterations, (uint32_t)(elapsed_ns / 1000));
+  printf("ctxbench: %u ns per context switch\n", (uint32_t)(elapsed_ns / (2 * (uint64_t)iterations)));
+  return 0;
+}
+
@@ -37,8 +37,8 @@ struct timer_wait tw;
 
 
 /*
- * This can put task to sleep, granularity is kernel's timer tick rate.
- * Unless we get fancy with variable intervals between timers.
+ * Sleeps rather than busy-waits, short delays use the kernel's high
+ * resolution timers so are accurate to a few microseconds.
  */
 int delay_microsecs(int usec)
 {
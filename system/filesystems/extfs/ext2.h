@@ -56,11 +56,13 @@ struct Config
 /*
  * Config settings, tweak as needed
  */
-#define NMSG_BACKLOG 							1					/* Number of inflight messages this driver can handle */
+#define NMSG_BACKLOG 							16				/* Number of inflight messages this driver can handle */
+#define NMSGVEC                  16         /* Messages received or replied to per getmsgv/replymsgv */
 #define NR_CACHE_BLOCKS          64         /* Keep 64 blocks in the local block cache */
 #define NR_INODES                64         /* size of cached inode table */
 #define INODE_HASH_SIZE         128
 #define BDFLUSH_INTERVAL_SECS     10
+#define BDFLUSH_TIMER_ID          1     // ident of the periodic EVFILT_TIMER
 
 /*
  * Miscellaneous
@@ -626,6 +628,8 @@ void inode_markclean(struct inode *inode);
 
 // main.c
 int main(int argc, char *argv[]);
+void queue_reply(int status);
+void flush_replies(void);
 
 // ops_dir.c
 void ext2_lookup(struct fsreq *req);
@@ -16,6 +16,9 @@ int portid;                         /* msgport created by mount() */
 int kq;                             /* kqueue for receiving events */
 msgid_t msgid;                      /* msgid of current message */
 
+struct msgvec reply_queue[NMSGVEC]; /* replies deferred until the end of a batch */
+int reply_queue_cnt;
+
 bool be_cpu;                        /* true if cpu is big-endian and we should byte-swap fields */
 
 struct block_cache *cache;          /* file system block cache */
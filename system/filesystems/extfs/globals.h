@@ -18,6 +18,9 @@ extern int portid;                  /* msgport created by mount() */
 extern int kq;                      /* kqueue for receiving events */
 extern msgid_t msgid;               /* msgid of current message */
 
+extern struct msgvec reply_queue[NMSGVEC];  /* replies deferred until the end of a batch */
+extern int reply_queue_cnt;
+
 extern bool be_cpu;                        /* true if cpu is big-endian and we should byte-swap fields */
 
 extern struct block_cache *cache;          /* file system block cache */
@@ -19,109 +19,119 @@
 int main(int argc, char *argv[])
 {
   struct kevent ev;
-  struct fsreq req;
-  int sc;
+  struct msgvec msgv[NMSGVEC];
+  struct fsreq reqv[NMSGVEC];
+  struct fsreq *req;
+  int nmsgs;
   int nevents;
-  struct timespec now, next_bdflush, diff;
-  struct timespec bdflush_interval;
-  bool elapsed;
   
   log_info("starting !!!");
   
   init(argc, argv);
   
-  bdflush_interval.tv_sec = BDFLUSH_INTERVAL_SECS;
-  bdflush_interval.tv_nsec = 0;
-
-  clock_gettime(CLOCK_MONOTONIC, &now);
-
-  add_timespec(&next_bdflush, &now, &bdflush_interval);
-  
   EV_SET(&ev, portid, EVFILT_MSGPORT, EV_ADD | EV_ENABLE, 0, 0, 0); 
   kevent(kq, &ev, 1, NULL, 0, NULL);
 
+  EV_SET(&ev, BDFLUSH_TIMER_ID, EVFILT_TIMER, EV_ADD | EV_ENABLE, NOTE_SECONDS,
+         (void *)BDFLUSH_INTERVAL_SECS, 0); 
+  kevent(kq, &ev, 1, NULL, 0, NULL);
+
+  for (int t = 0; t < NMSGVEC; t++) {
+    msgv[t].buf = &reqv[t];
+    msgv[t].buf_sz = sizeof reqv[t];
+  }
+  
   while (1) {
-    nevents = kevent(kq, NULL, 0, &ev, 1, &bdflush_interval);
+    nevents = kevent(kq, NULL, 0, &ev, 1, NULL);
   
     if (nevents == 1 && ev.ident == portid && ev.filter == EVFILT_MSGPORT) {
-      while ((sc = getmsg(portid, &msgid, &req, sizeof req)) == sizeof req) {      
-        switch (req.cmd) {
-          case CMD_READ:
-            ext2_read(&req);
-            break;
-
-          case CMD_WRITE:
-            ext2_write(&req);
-            break;
-
-          case CMD_LOOKUP:
-            ext2_lookup(&req);
-            break;
+      while ((nmsgs = getmsgv(portid, msgv, NMSGVEC)) > 0) {
+        for (int t = 0; t < nmsgs; t++) {
+          msgid = msgv[t].msgid;
+          req = &reqv[t];
           
-          case CMD_CLOSE:
-            ext2_close(&req);
-            break;
+          if (msgv[t].status != sizeof *req) {
+            log_warn("extfs: short message: %d", msgv[t].status);
+            queue_reply(-EINVAL);
+            continue;
+          }
           
-          case CMD_CREATE:
-            ext2_create(&req);
-
-          case CMD_READDIR:
-            ext2_readdir(&req);
-            break;
-
-          case CMD_UNLINK:
-            ext2_unlink(&req);
-            break;
-
-          case CMD_RMDIR:
-            ext2_rmdir(&req);
-            break;
-
-          case CMD_MKDIR:
-            ext2_mkdir(&req);
-            break;
-
-          case CMD_MKNOD:
-            ext2_mknod(&req);
-            break;
-
-          case CMD_RENAME:
-            ext2_rename(&req);
-            break;
-
-          case CMD_CHMOD:
-            ext2_chmod(&req);
-            break;
-
-          case CMD_CHOWN:
-            ext2_chown(&req);
-            break;
-
-          case CMD_TRUNCATE:
-            ext2_truncate(&req);
-            break;
-
-          // TODO: Add VNODEATTR
-
-          default:
-            log_warn("extfs: unknown command: %d", req.cmd);
-            replymsg(portid, msgid, -ENOTSUP, NULL, 0);
-            break;
+          switch (req->cmd) {
+            case CMD_READ:
+              ext2_read(req);
+              break;
+
+            case CMD_WRITE:
+              ext2_write(req);
+              break;
+
+            case CMD_LOOKUP:
+              ext2_lookup(req);
+              break;
+            
+            case CMD_CLOSE:
+              ext2_close(req);
+              break;
+            
+            case CMD_CREATE:
+              ext2_create(req);
+
+            case CMD_READDIR:
+              ext2_readdir(req);
+              break;
+
+            case CMD_UNLINK:
+              ext2_unlink(req);
+              break;
+
+            case CMD_RMDIR:
+              ext2_rmdir(req);
+              break;
+
+            case CMD_MKDIR:
+              ext2_mkdir(req);
+              break;
+
+            case CMD_MKNOD:
+              ext2_mknod(req);
+              break;
+
+            case CMD_RENAME:
+              ext2_rename(req);
+              break;
+
+            case CMD_CHMOD:
+              ext2_chmod(req);
+              break;
+
+            case CMD_CHOWN:
+              ext2_chown(req);
+              break;
+
+            case CMD_TRUNCATE:
+              ext2_truncate(req);
+              break;
+
+            // TODO: Add VNODEATTR
+
+            default:
+              log_warn("extfs: unknown command: %d", req->cmd);
+              queue_reply(-ENOTSUP);
+              break;
+          }
         }
+        
+        flush_replies();
       }
 
-      if (sc != 0) {
-        log_error("ext2fs: getmsg err = %d, %s", sc, strerror(-sc));
+      if (nmsgs != 0) {
+        log_error("ext2fs: getmsgv err = %d, %s", errno, strerror(errno));
         exit(-1);
       }
     }
 
-	  clock_gettime(CLOCK_MONOTONIC, &now);			
-  	elapsed = diff_timespec(&diff, &now, &next_bdflush);
-    
-		if (elapsed) {
+    if (nevents == 1 && ev.ident == BDFLUSH_TIMER_ID && ev.filter == EVFILT_TIMER) {
 			bdflush(portid);
-      add_timespec(&next_bdflush, &bdflush_interval, &now);
   	}
   }
 
@@ -129,7 +139,35 @@ int main(int argc, char *argv[])
 }
 
 
+/* @brief   Queue a status-only reply to the current message
+ *
+ * @param   status, reply status
+ *
+ * Queued replies are sent together by flush_replies() at the end of the
+ * batch of messages received by getmsgv().
+ */
+void queue_reply(int status)
+{
+  if (reply_queue_cnt == NMSGVEC) {
+    flush_replies();
+  }
+  
+  reply_queue[reply_queue_cnt].msgid = msgid;
+  reply_queue[reply_queue_cnt].status = status;
+  reply_queue[reply_queue_cnt].buf = NULL;
+  reply_queue[reply_queue_cnt].buf_sz = 0;
+  reply_queue_cnt++;
+}
 
 
+/* @brief   Send the queued replies
+ */
+void flush_replies(void)
+{
+  if (reply_queue_cnt > 0) {
+    replymsgv(portid, reply_queue, reply_queue_cnt);
+    reply_queue_cnt = 0;
+  }
+}
 
 
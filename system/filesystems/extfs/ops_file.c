@@ -27,7 +27,7 @@ void ext2_read(struct fsreq *req)
   count = req->args.read.sz;
   
   nbytes_read = read_file(ino_nr, count, offset);
-  replymsg(portid, msgid, nbytes_read, NULL, 0);
+  queue_reply(nbytes_read);
 }
 
 
@@ -47,7 +47,7 @@ void ext2_write(struct fsreq *req)
   count = req->args.write.sz;
 
   nbytes_written = write_file(ino_nr, count, offset);
-  replymsg(portid, msgid, nbytes_written, NULL, 0);
+  queue_reply(nbytes_written);
 }
 
 
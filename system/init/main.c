@@ -5,6 +5,7 @@
 #include <string.h>
 #include <sys/debug.h>
 #include <sys/dirent.h>
+#include <sys/event.h>
 #include <sys/signal.h>
 #include <sys/stat.h>
 #include <sys/syscalls.h>
@@ -334,8 +335,8 @@ int cmdWaitfor (void) {
   char path[PATH_MAX]; 
   char *parent_path;
   int fd = -1;
-  struct pollfd pfd;
-  int sc;
+  int kq;
+  struct kevent ev;
 
   fullpath = tokenize(NULL);
   
@@ -357,23 +358,12 @@ int cmdWaitfor (void) {
     exit(-1);
   }
 
-
-#if 0
-  int kq;
-  struct kevent ev;
-  struct timespec ts;
-
-  if ((kq = kqueue()) != 0) {
-    return -1;
+  if ((kq = kqueue()) < 0) {
+    exit(-1);
   }
 
-  ts.tv_sec = 0;
-  ts.tv_nanoseconds = 200 * 1000000;
-
-  // FIXME: Use EVFILT_FS, no filehandle needed, is notified on all
-  // global mount/unmount changes.
-      
-  EV_SET(&ev, fd, EVFILT_VNODE, EV_ADD | EV_ENABLE, 0, 0, 0); 
+  // Notified of all mount and unmount changes, no need to poll
+  EV_SET(&ev, 0, EVFILT_FS, EV_ADD | EV_ENABLE, NOTE_MOUNT, 0, 0); 
   kevent(kq, &ev, 1,  NULL, 0, NULL);
 
   while(1) {
@@ -381,20 +371,10 @@ int cmdWaitfor (void) {
       break;
     }
 
-    kevent(kq, NULL, 0, &ev, 1, &ts);
+    kevent(kq, NULL, 0, &ev, 1, NULL);
   }
   
   close(kq);
-  
-#else
-  while (1) {
-    if (stat(fullpath, &st) == 0 && st.st_dev != parent_stat.st_dev) {
-      break;
-    }    
-
-    sleep(1);
-  }
-#endif
 
   close(fd);  
   return 0;  
@@ -46,6 +46,7 @@ cp build/host/bin/ksh               build/$KERNEL_IFS_DIR/bin/
 #cp build/host/bin/cat               build/$KERNEL_IFS_DIR/bin/
 #cp build/host/bin/tr                build/$KERNEL_IFS_DIR/bin/
 #cp build/host/sbin/readfile         build/$KERNEL_IFS_DIR/bin/
+cp build/host/sbin/ctxbench          build/$KERNEL_IFS_DIR/bin/
 	
 arm-none-eabi-objcopy build/host/sbin/boot -O binary output/boot.img
 